@@ -0,0 +1,147 @@
+/*
+ * bank-upload.cpp
+ * PSG
+ *
+ * This file contains a program for uploading a bank of instrument patches to an
+ * attached PSG device in as few messages as possible. The bank file has one patch
+ * per line, as the patch number followed by the instrument data from the
+ * instrument designer (Base64); blank lines and lines starting with # are skipped.
+ * Runs of consecutive patches are sent as patch blocks, and each block is
+ * acknowledged by the device before the next one is sent.
+ *
+ * Usage: bank-upload [-c] <bank.txt>
+ * With -c, the bank is committed to the device's flash afterwards.
+ *
+ * This code is licensed under the GPLv2 license.
+ * Copyright (c) 2022-2023 JackMacWindows.
+ */
+
+#include <portmidi.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <cstring>
+#include "psg-bank.h"
+#include "psg-midi.h"
+
+static std::vector<uint8_t> base64Decode(const std::string& str) {
+    static const std::string table = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::vector<uint8_t> out;
+    uint32_t bits = 0;
+    int nbits = 0;
+    for (char c : str) {
+        size_t v = table.find(c);
+        if (v == std::string::npos) continue;
+        bits = (bits << 6) | v;
+        nbits += 6;
+        if (nbits >= 8) {
+            nbits -= 8;
+            out.push_back((bits >> nbits) & 0xFF);
+        }
+    }
+    return out;
+}
+
+int main(int argc, const char * argv[]) {
+    bool commit = false;
+    const char * path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0) commit = true;
+        else path = argv[i];
+    }
+    if (path == NULL) {
+        std::cerr << "Usage: " << argv[0] << " [-c] <bank.txt>\n";
+        return 1;
+    }
+    std::ifstream in(path);
+    if (!in.is_open()) {
+        std::cerr << "Could not open input file\n";
+        return 2;
+    }
+    std::vector<uint8_t> patches[128];
+    std::string line;
+    int lineno = 0, count = 0;
+    while (std::getline(in, line)) {
+        lineno++;
+        if (line.empty() || line[0] == '#' || line.find_first_not_of(" \t\r") == std::string::npos) continue;
+        std::istringstream ss(line);
+        int n;
+        std::string data;
+        ss >> n >> data;
+        std::vector<uint8_t> legacy = base64Decode(data);
+        if (ss.fail() || n < 0 || n > 127 || legacy.size() != PSG_LEGACY_PATCH_SIZE || (patches[n] = psgCompactPatch(legacy.data())).empty()) {
+            std::cerr << "Invalid patch on line " << lineno << "\n";
+            return 3;
+        }
+        count++;
+    }
+    in.close();
+    if (count == 0) {
+        std::cerr << "No patches in bank file\n";
+        return 3;
+    }
+
+    std::cout << "Opening MIDI device\n";
+    PortMidiStream * stream = NULL, * streamin = NULL;
+    PmError error;
+    if ((error = Pm_Initialize()) != pmNoError) throw std::runtime_error(std::string("Could not init: ") + Pm_GetErrorText(error));
+    if ((error = psgOpenDevice(&stream, &streamin)) != pmNoError) {
+        std::cerr << "Could not open device: " << Pm_GetErrorText(error) << "\n";
+        return error;
+    }
+    if (stream == NULL || streamin == NULL) {
+        std::cerr << "No PSG device found\n";
+        return 6;
+    }
+
+    // send each run of consecutive patches, split where a block would get too big
+    size_t sent = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int first = 0; first < 128;) {
+        if (patches[first].empty()) {
+            first++;
+            continue;
+        }
+        std::vector<std::vector<uint8_t>> run;
+        while (first + run.size() < 128 && !patches[first + run.size()].empty()) {
+            run.push_back(patches[first + run.size()]);
+            if (psgBlockSize(run) > PSG_BLOCK_MAX_SIZE) {
+                run.pop_back();
+                break;
+            }
+        }
+        if (run.empty()) {
+            std::cerr << "Patch " << first << " is too large to send\n";
+            return 7;
+        }
+        std::vector<uint8_t> msg = psgEncodeBlock(first, run);
+        std::cout << "Sending patches " << first << "-" << first + run.size() - 1 << " (" << msg.size() << " bytes)\n";
+        psgWriteSysEx(stream, msg.data());
+        std::vector<uint8_t> reply;
+        int status = psgWaitForReply(streamin, 0x07, reply, 5);
+        if (status == -1) {
+            std::cerr << "No reply from device\n";
+            return 8;
+        } else if (status != PSG_BLOCK_OK) {
+            std::cerr << "Device rejected patches: " << psgBlockStatusText(status) << "\n";
+            return 9;
+        }
+        sent += msg.size();
+        first += run.size();
+    }
+    auto time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Uploaded " << count << " patches (" << sent << " bytes) in " << time << " ms\n";
+    if (commit) {
+        std::cout << "Committing bank to flash\n";
+        uint8_t msg[] = {0xF0, 0x00, 0x46, 0x71, 0x06, 0x00, 0x00, 0xF7};
+        psgWriteSysEx(stream, msg);
+        std::this_thread::sleep_for(std::chrono::milliseconds(500)); // let the write go out before closing
+    }
+    Pm_Close(stream);
+    Pm_Close(streamin);
+    return 0;
+}
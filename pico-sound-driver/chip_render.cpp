@@ -0,0 +1,547 @@
+/*
+ * pico-sound-driver/chip_render.cpp
+ * PSG
+ *
+ * This file contains the bus splitter and the chip renderers shared by the host
+ * tools.
+ *
+ * This code is licensed under the GPLv2 license.
+ * Copyright (c) 2022-2023 JackMacWindows.
+ */
+
+#include "chip_render.h"
+#include <string.h>
+
+// PSG.X sine_table, indexed by the high byte of the position
+static const uint8_t sineTable[256] = {
+    127, 130, 133, 136, 139, 143, 146, 149, 152, 155, 158, 161, 164, 167, 170, 173,
+    176, 179, 182, 184, 187, 190, 193, 195, 198, 200, 203, 205, 208, 210, 213, 215,
+    217, 219, 221, 224, 226, 228, 229, 231, 233, 235, 236, 238, 239, 241, 242, 244,
+    245, 246, 247, 248, 249, 250, 251, 251, 252, 253, 253, 254, 254, 254, 254, 254,
+    255, 254, 254, 254, 254, 254, 253, 253, 252, 251, 251, 250, 249, 248, 247, 246,
+    245, 244, 242, 241, 239, 238, 236, 235, 233, 231, 229, 228, 226, 224, 221, 219,
+    217, 215, 213, 210, 208, 205, 203, 200, 198, 195, 193, 190, 187, 184, 182, 179,
+    176, 173, 170, 167, 164, 161, 158, 155, 152, 149, 146, 143, 139, 136, 133, 130,
+    127, 124, 121, 118, 115, 111, 108, 105, 102, 99, 96, 93, 90, 87, 84, 81,
+    78, 75, 72, 70, 67, 64, 61, 59, 56, 54, 51, 49, 46, 44, 41, 39,
+    37, 35, 33, 30, 28, 26, 25, 23, 21, 19, 18, 16, 15, 13, 12, 10,
+    9, 8, 7, 6, 5, 4, 3, 3, 2, 1, 1, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 1, 1, 2, 3, 3, 4, 5, 6, 7, 8,
+    9, 10, 12, 13, 15, 16, 18, 19, 21, 23, 25, 26, 28, 30, 33, 35,
+    37, 39, 41, 44, 46, 49, 51, 54, 56, 59, 61, 64, 67, 70, 72, 75,
+    78, 81, 84, 87, 90, 93, 96, 99, 102, 105, 108, 111, 115, 118, 121, 124
+};
+
+void BusSplitter::gpio(uint64_t time, unsigned pin, bool value) {
+    time *= 1000;
+    if (pending && time != pendingTime) finish();
+    lines.set(pin, value);
+    pendingTime = time;
+    pending = true;
+}
+
+void BusSplitter::finish() {
+    if (!pending) return;
+    pending = false;
+    BusState state;
+    state.time = pendingTime;
+    state.latched = lines.latched;
+    state.data = lines.data();
+    state.dc = lines.dc();
+    state.stereo = lines.stereo();
+    if (!states.empty()) {
+        const BusState& last = states.back();
+        if (last.latched == state.latched && last.data == state.data && last.dc == state.dc && last.stereo == state.stereo) return;
+    }
+    states.push_back(state);
+}
+
+uint8_t ChipEmulator::sampleAt(uint64_t time) {
+    for (; next < bus.size() && bus[next].time <= time; next++) {
+        uint8_t porta, portc;
+        chipPins(bus[next], chip, &porta, &portc);
+        if (porta != pins[0] || portc != pins[1]) {
+            pic.runUntil(bus[next].time);
+            pic.setInputs(porta, portc);
+            pins[0] = porta;
+            pins[1] = portc;
+        }
+    }
+    pic.runUntil(time);
+    return pic.dacEnabled() ? pic.dac() : 128;
+}
+
+void ChipEmulator::render(uint8_t * out, size_t count) {
+    for (size_t i = 0; i < count; i++) out[i] = sampleAt(samples++ * CHIP_SAMPLE_PERIOD);
+}
+
+ChipModel::ChipModel(const std::vector<BusState>& bus, int chip): ChipRenderer(bus, chip) {
+    noise[0] = picPowerOnByte(0x123);
+    noise[1] = picPowerOnByte(0x124);
+    adjust = picPowerOnByte(0x76);
+    due = -(int64_t)(FIRMWARE_START_TIME + CHIP_SAMPLE_PERIOD) / PIC_CYCLE_TIME;
+    init();
+}
+
+// What the firmware's init does: everything but the noise generator and the
+// volume adjustment starts from zero.
+void ChipModel::init() {
+    wave = volume = duty = 0;
+    increment = position = 0;
+    dacValue = 0x7F;
+    stopped = false;
+    dacOff = false;
+    advancePending = false;
+    held = false;
+}
+
+// Lists the lengths of the instructions the loop runs in an iteration, the way
+// it would go round with things as they are now.
+int ChipModel::loopInstructions(uint8_t * lengths) const {
+    int n = 0;
+    auto add = [&](std::initializer_list<uint8_t> list) {for (uint8_t l : list) lengths[n++] = l;};
+    auto delay = [&](int count) {
+        for (int i = 1; i < count; i++) add({1, 2});
+        add({2});
+    };
+    if (volume == 0) {
+        add({1, 1, 2, 1, 1, 2});
+        return n;
+    } else if (increment == 0) {
+        add({1, 2, 1, 2, 1, 1, 2, 1, 1, 2});
+        return n;
+    }
+    if (increment >> 8) add({1, 2, 1, 1, 2, 1, 1, 1, 1, 1, 2, 2});
+    else add({1, 2, 1, 2, 1, 2, 2, 1, 2, 2});
+    uint8_t hi = position >> 8, u;
+    switch (wave) {
+        case 1:
+            add({1, 1, 1, 1, 1, 1, 1, 1, 1, 1});
+            delay(12);
+            add({1, 2});
+            break;
+        case 2: case 3: case 4: case 5:
+            if (wave == 4) {
+                if (hi & 0x80) add({1, 2, 1, 1, 1, 1, 1, 2});
+                else add({2, 1, 1, 1, 1, 1, 1, 2});
+            } else if (wave == 5) add({1, 2, 2, 2, 1, 2});
+            else add({1, 1, 1, 1, 1, 1, 1, 1, 2});
+            // the multiply takes a cycle less to skip the add for each bit that's clear
+            u = wave == 2 ? hi : (wave == 3 ? 0xFF - hi : (wave == 4 ? (hi & 0x80 ? (0xFF - hi) * 2 : hi * 2) : sineTable[hi]));
+            add({1, 1, 1});
+            for (int i = 0; i < 8; i++) {
+                if (u & (1 << i)) add({1, 1, 1, 1});
+                else add({2, 1, 1});
+            }
+            add({1, 1, 1});
+            break;
+        case 6:
+            if (halfCarry) {
+                uint8_t feedback = ((noise[1] >> 1) ^ noise[1]) & 1;
+                uint8_t bit = (noise[1] >> 1) & 1;
+                add({2, 1, 1, 1, 1});
+                if (feedback) add({1, 1});
+                else add({2});
+                add({1});
+                if (bit) add({2});
+                else add({1, 1});
+                add({1, 1, 1, 1});
+                delay(10);
+                add({1, 1, 2});
+            } else {
+                add({1, 2, 1, 1});
+                delay(13);
+                add({1, 1, 2});
+            }
+            break;
+        default:
+            add({1, 1, 2});
+            return n;
+    }
+    add({1, 1, 1, 1, 2});
+    return n;
+}
+
+// Whether the given number of cycles into an iteration is part way through an
+// instruction, which the interrupt has to wait for.
+bool ChipModel::midInstruction(int64_t into) const {
+    uint8_t lengths[80];
+    int n = loopInstructions(lengths), at = 0, total = 0;
+    for (int i = 0; i < n; i++) total += lengths[i];
+    if (into <= 0) into += total; // the end of the last iteration
+    for (int i = 0; i < n && at < into; i++) {
+        if (lengths[i] == 2 && at + 1 == into) return true;
+        at += lengths[i];
+    }
+    return false;
+}
+
+// Notes that the interrupt came the given number of cycles into an iteration
+// that hadn't written the DAC yet. It writes once the handler returns.
+void ChipModel::hold(int64_t into) {
+    held = true;
+    heldInto = into;
+    heldLength = silent() ? silentCycles() : cost();
+    heldWave = wave;
+    heldVolume = volume;
+    heldAdjust = adjust;
+    heldDuty = duty;
+    heldIncrement = increment;
+    heldTime = UINT64_MAX;
+}
+
+// Works out which way the held iteration goes round, and what its write puts
+// out and when, once the handler is done. Whatever the loop reads after the
+// point it was stopped at is the handler's, including the checks that pick
+// its way round: the volume at the start, the increment's bytes at 3 and 6
+// cycles in and the wave at 11.
+void ChipModel::finishHold() {
+    uint16_t inc = ((heldInto > 3 ? heldIncrement : increment) & 0xFF00) | ((heldInto > 6 ? heldIncrement : increment) & 0xFF);
+    uint8_t w = heldInto > 11 ? heldWave : wave;
+    int write, length;
+    bool quiet = true;
+    if (heldVolume == 0) write = 5, length = 8;
+    else if (inc == 0) write = 11, length = 14;
+    else if (w == 0 || w == 7) write = 17, length = 20;
+    else {
+        quiet = false;
+        write = w == 1 ? 23 : (w == 6 ? 28 : 63);
+        length = w == 6 && !halfCarry ? LOOP_CYCLES - 1 : LOOP_CYCLES;
+    }
+    // the loop was taken to go round the way it was going when it stopped
+    due -= length - heldLength;
+    advancePending = !quiet;
+    heldTime = handlerAt + (write - heldInto) * PIC_CYCLE_TIME;
+    if (quiet) {
+        heldValue = 0x7F;
+        return;
+    }
+    // where each wave reads the volume and adjustment
+    int volumeRead = w == 1 ? 21 : 26, adjustRead = w == 1 ? 22 : (w == 6 ? 27 : 62);
+    uint8_t value = dacValue;
+    output(w, heldInto <= volumeRead ? volume : heldVolume, heldInto <= adjustRead ? adjust : heldAdjust,
+        heldInto <= 16 ? duty : heldDuty);
+    heldValue = dacValue;
+    dacValue = value;
+}
+
+// Takes a bus state the way the interrupt handler does: a rising edge on INT
+// starts a command, and the handler polls the data clock for each byte of it.
+// Edges on INT are dropped until the command is finished, since the handler
+// clears INTF when it returns. The handler's timing is followed to the cycle,
+// so the wave loop loses as much time to it as it does on the chip.
+void ChipModel::apply(const BusState& state) {
+    bool intLine = (state.latched >> chip) & 1;
+    bool intRise = intLine && !lastInt;
+    lastInt = intLine;
+    if (state.dc != lastDC) dcTime = state.time;
+    lastDC = state.dc;
+    // the firmware doesn't turn the interrupt on until it's ready to go round its loop
+    if (stopped || state.time < FIRMWARE_START_TIME) return;
+    if (intRise && wait == Wait::None) {
+        wait = Wait::Command;
+        waitStart = state.time;
+        handlerAt = state.time + 7 * PIC_CYCLE_TIME; // three to get in, four to the first poll
+        clockLow = false;
+        int64_t since = ((int64_t)waitStart - ((int64_t)samples - 1) * CHIP_SAMPLE_PERIOD) / PIC_CYCLE_TIME;
+        // the interrupt waits for the instruction it lands in to finish
+        auto settle = [&]() {
+            if (midInstruction(since + due)) {
+                since++;
+                waitStart += PIC_CYCLE_TIME;
+                handlerAt += PIC_CYCLE_TIME;
+            }
+            return since + due; // cycles into the next iteration
+        };
+        advanceInto = 0;
+        advanceFrom = increment;
+        if (silent()) {
+            // the loop goes back to where it was in its short way round
+            int loop = silentCycles();
+            while (since + due > loop) {
+                due -= loop;
+                dacValue = 0x7F;
+            }
+            int64_t into = settle();
+            if (into > 0) {
+                due -= loop;
+                if (into > writeCycle()) dacValue = 0x7F;
+                else hold(into);
+            }
+        } else {
+            // Whatever the loop did before the interrupt came still happened.
+            // If it stopped before the write, the write happens when the
+            // handler returns, with what the loop had read and what it reads
+            // after. Either way, the position moves on at the end, by the
+            // handler's increment for whichever bytes of it the loop hadn't
+            // loaded yet.
+            catchUp(ADVANCE_CYCLE - 1 - since);
+            int64_t into = settle();
+            if (into > writeCycle()) {
+                advanceInto = into;
+                due -= cost();
+                output();
+                advancePending = true;
+            } else if (into > 0) {
+                // the settings the loop hadn't read yet come from the handler
+                due -= cost();
+                hold(into);
+                advancePending = true;
+            } else if (into + LOOP_CYCLES < ADVANCE_CYCLE) {
+                // the last iteration was run for its write, but hadn't got
+                // to its end yet
+                advanceInto = into + cost();
+                position -= increment;
+                advancePending = true;
+            }
+        }
+    }
+    if (wait == Wait::None) return;
+    while (state.dc != clockLow) {
+        // The polling loops take three cycles a turn, and two to get out once
+        // the clock is at the level they want.
+        if (dcTime > handlerAt) handlerAt += (dcTime - handlerAt + 3 * PIC_CYCLE_TIME - 1) / (3 * PIC_CYCLE_TIME) * (3 * PIC_CYCLE_TIME);
+        handlerAt += 2 * PIC_CYCLE_TIME;
+        if (clockLow) {
+            clockLow = false;
+            continue;
+        }
+        uint8_t b = state.data;
+        Wait was = wait;
+        wait = Wait::None;
+        int cycles = 0; // from reading the byte to the next poll, or to the end of the handler
+        switch (was) {
+            case Wait::Command:
+                if ((b & 0xC0) == 0xC0) {
+                    if ((b & 0x3F) == 0x3F) {
+                        wait = Wait::System;
+                        cycles = 11;
+                    } else cycles = 25;
+                } else if (b & 0x80) {
+                    increment = (b & 0x3F) << 8 | (increment & 0xFF);
+                    wait = Wait::IncrementLow;
+                    cycles = 8;
+                } else if (b & 0x40) {
+                    volume = (b & 0x3F) << 2;
+                    adjust = 0x7F - (volume >> 1);
+                    cycles = 22;
+                } else {
+                    wave = b & 0x07;
+                    if (wave == 1) {
+                        wait = Wait::Duty;
+                        cycles = 10;
+                    } else cycles = 18;
+                }
+                break;
+            case Wait::Duty:
+                duty = b;
+                cycles = 16;
+                break;
+            case Wait::IncrementLow:
+                increment = (increment & 0xFF00) | b;
+                cycles = 14;
+                break;
+            case Wait::System:
+                if ((b & 0x3F) == 0) init();
+                else if ((b & 0x3F) <= 2) stopped = true; // the bootloader
+                cycles = 16;
+                break;
+            case Wait::None: break;
+        }
+        handlerAt += cycles * PIC_CYCLE_TIME;
+        if (wait != Wait::None) {
+            clockLow = true;
+            return;
+        }
+        if (held) finishHold();
+        if (advancePending) {
+            advancePending = false;
+            if (!stopped) {
+                // the loop ends by loading each byte of the increment into W
+                // and adding it in, low byte first; a byte it had loaded
+                // before the interrupt is the old one
+                uint16_t by = increment;
+                if (advanceInto > cost() - 6) by = (by & 0xFF00) | (advanceFrom & 0xFF);
+                if (advanceInto > cost() - 4) by = (by & 0xFF) | (advanceFrom & 0xFF00);
+                advance(by);
+            }
+        }
+        // the wave loop stops for as long as the handler runs
+        due -= (handlerAt - waitStart) / PIC_CYCLE_TIME;
+        return;
+    }
+}
+
+// What the wave loop writes to the DAC for each wave but noise, from the high
+// byte of the position.
+template<int W> static inline uint8_t waveValue(uint8_t hi, uint8_t vol, uint8_t adj, uint8_t duty) {
+    uint8_t u;
+    switch (W) {
+        case 1: return (hi >= duty ? 0 : vol) + adj;
+        case 2: u = hi; break;
+        case 3: u = 0xFF - hi; break;
+        case 4: u = hi & 0x80 ? (uint8_t)((0xFF - hi) * 2) : (uint8_t)(hi * 2); break;
+        default: u = sineTable[hi]; break;
+    }
+    return ((u * vol) >> 8) + adj;
+}
+
+// One loop iteration per sample. Every wave but noise only depends on the
+// position, so each sample is independent of the others and this vectorizes.
+template<int W> static void waveBlock(uint8_t * out, int n, uint16_t pos, uint16_t inc, uint8_t vol, uint8_t adj, uint8_t duty) {
+    for (int i = 0; i < n; i++) out[i] = waveValue<W>((uint16_t)(pos + (unsigned)i * inc) >> 8, vol, adj, duty);
+}
+
+// Runs every iteration that starts more than limit cycles before the sample
+// due is counted from.
+void ChipModel::catchUp(int64_t limit) {
+    while (due > limit) {
+        due -= cost();
+        output();
+        advance();
+    }
+}
+
+// Does the part of an iteration up to the DAC write, leaving it in dacValue.
+// The wave and its settings are passed in, since the handler can change them
+// part way through.
+void ChipModel::output(uint8_t w, uint8_t vol, uint8_t adj, uint8_t dut) {
+    if (w == 6) {
+        // the NES noise algorithm, clocked by the half carry out of the position's high byte
+        if (halfCarry) {
+            uint8_t feedback = ((noise[1] >> 1) ^ noise[1]) & 1;
+            uint8_t carry = noise[0] & 1;
+            noise[0] >>= 1;
+            noise[1] = noise[1] >> 1 | carry << 7;
+            if (feedback) noise[0] |= 0x40;
+            dacValue = (noise[1] & 1 ? 0 : vol) + adj;
+        }
+    } else {
+        uint8_t hi = position >> 8;
+        switch (w) {
+            case 1: dacValue = waveValue<1>(hi, vol, adj, dut); break;
+            case 2: dacValue = waveValue<2>(hi, vol, adj, dut); break;
+            case 3: dacValue = waveValue<3>(hi, vol, adj, dut); break;
+            case 4: dacValue = waveValue<4>(hi, vol, adj, dut); break;
+            default: dacValue = waveValue<5>(hi, vol, adj, dut); break;
+        }
+    }
+}
+
+// Moves the position on, at the end of an iteration.
+void ChipModel::advance(uint16_t by) {
+    unsigned low = (position & 0xFF) + (by & 0xFF);
+    halfCarry = ((position >> 8) & 0x0F) + ((by >> 8) & 0x0F) + (low >> 8) > 0x0F;
+    position += by;
+}
+
+void ChipModel::synthesize(uint8_t * out, size_t count) {
+    if (stopped) {
+        memset(out, dacOff ? 128 : dacValue, count);
+        return;
+    } else if (wait != Wait::None) {
+        // the handler has the loop stopped until the command is finished
+        due += (int64_t)count * LOOP_CYCLES;
+        memset(out, dacValue, count);
+        return;
+    } else if (silent()) {
+        // the loop goes round without moving the position, writing the middle level
+        int loop = silentCycles(), write = writeCycle();
+        size_t i = 0;
+        for (; i < count && dacValue != 0x7F; i++) {
+            due += LOOP_CYCLES;
+            if (due > write) {
+                due -= (due - write + loop - 1) / loop * loop;
+                dacValue = 0x7F;
+            }
+            out[i] = dacValue;
+        }
+        // after that, the rest of the block is all the same
+        due += (int64_t)(count - i) * LOOP_CYCLES;
+        if (due > write) due -= (due - write + loop - 1) / loop * loop;
+        memset(out + i, 0x7F, count - i);
+        return;
+    }
+    const int write = writeCycle();
+    size_t i = 0;
+    if (wave == 6) {
+        for (; i < count; i++) {
+            due += LOOP_CYCLES;
+            catchUp(write);
+            out[i] = dacValue;
+        }
+        return;
+    }
+    // catch up with any time the interrupt handler took first
+    for (; i < count && (due <= write - LOOP_CYCLES || due > write); i++) {
+        due += LOOP_CYCLES;
+        catchUp(write);
+        out[i] = dacValue;
+    }
+    // now each sample has exactly one iteration's write in it
+    int n = count - i;
+    if (n == 0) return;
+    switch (wave) {
+        case 1: waveBlock<1>(out + i, n, position, increment, volume, adjust, duty); break;
+        case 2: waveBlock<2>(out + i, n, position, increment, volume, adjust, duty); break;
+        case 3: waveBlock<3>(out + i, n, position, increment, volume, adjust, duty); break;
+        case 4: waveBlock<4>(out + i, n, position, increment, volume, adjust, duty); break;
+        case 5: waveBlock<5>(out + i, n, position, increment, volume, adjust, duty); break;
+    }
+    // leave the position and half carry where the last iteration did
+    position += (unsigned)(n - 1) * increment;
+    output();
+    advance();
+}
+
+void ChipModel::render(uint8_t * out, size_t count) {
+    while (count) {
+        uint64_t time = samples * CHIP_SAMPLE_PERIOD;
+        while (next < bus.size() && bus[next].time <= time) apply(bus[next++]);
+        if (held && heldTime < time) {
+            if (!stopped) dacValue = heldValue;
+            held = false;
+        }
+        if (wait != Wait::None && time >= waitStart + PIC_WDT_PERIOD) {
+            // The watchdog resets the chip. A system command starts over from
+            // init; otherwise the firmware goes straight back to its loop
+            // with the reset values in INTCON and DAC1CON0, so it stays silent
+            // and deaf until it's power cycled.
+            if (wait == Wait::System) init();
+            else stopped = dacOff = true;
+            wait = Wait::None;
+        }
+        // run up to whatever happens next
+        uint64_t until = next < bus.size() ? bus[next].time : UINT64_MAX;
+        if (wait != Wait::None && waitStart + PIC_WDT_PERIOD < until) until = waitStart + PIC_WDT_PERIOD;
+        if (held && heldTime < until) until = heldTime + 1;
+        size_t n = count;
+        if (until != UINT64_MAX && (until - time + CHIP_SAMPLE_PERIOD - 1) / CHIP_SAMPLE_PERIOD < n) n = (until - time + CHIP_SAMPLE_PERIOD - 1) / CHIP_SAMPLE_PERIOD;
+        synthesize(out, n);
+        // the DAC isn't turned on until the firmware has set itself up
+        for (size_t i = 0; i < n && (samples + i) * CHIP_SAMPLE_PERIOD < FIRMWARE_START_TIME; i++) out[i] = 128;
+        out += n;
+        count -= n;
+        samples += n;
+    }
+}
+
+void writeLE(std::ostream& out, uint32_t value, int size) {
+    for (int i = 0; i < size; i++) out.put((char)((value >> (i * 8)) & 0xFF));
+}
+
+void writeWAVHeader(std::ostream& out, uint32_t rate, int channels, int bits, uint32_t frames) {
+    uint32_t dataSize = frames * channels * (bits / 8);
+    out.write("RIFF", 4);
+    writeLE(out, 36 + dataSize, 4);
+    out.write("WAVEfmt ", 8);
+    writeLE(out, 16, 4);
+    writeLE(out, 1, 2); // PCM
+    writeLE(out, channels, 2);
+    writeLE(out, rate, 4);
+    writeLE(out, rate * channels * (bits / 8), 4);
+    writeLE(out, channels * (bits / 8), 2);
+    writeLE(out, bits, 2);
+    out.write("data", 4);
+    writeLE(out, dataSize, 4);
+}
@@ -0,0 +1,181 @@
+/*
+ * pico-sound-driver/chip_render.h
+ * PSG
+ *
+ * This file contains the pieces shared by the host renderers: splitting the GPIO
+ * activity on the bus into what each chip sees on its pins, and turning that
+ * into the chip's DAC output, either with the PIC emulator running the real
+ * firmware or with a model of the firmware's wave loop that is much faster.
+ *
+ * This code is licensed under the GPLv2 license.
+ * Copyright (c) 2022-2023 JackMacWindows.
+ */
+
+#ifndef CHIP_RENDER_H
+#define CHIP_RENDER_H
+
+#include "pic_emu.h"
+#include <stdint.h>
+#include <ostream>
+#include <vector>
+
+#define CHIPS 16
+#define CHIP_SAMPLE_PERIOD 8750 // ns; the firmware's main loop is 70 cycles at 32 MHz
+#define CHIP_SAMPLE_RATE 114286 // the same, rounded for WAV headers
+#define PIC_CYCLE_TIME 125 // ns at 32 MHz
+#define LOOP_CYCLES 70
+#define ADVANCE_CYCLE 67 // when the loop moves the position on
+#define FIRMWARE_START_TIME 256750 // ns from power-on to the first time round the loop
+#define PIN_DC     14
+#define PIN_STEREO 18
+#define PIN_STROBE 19
+#define PIN_DATA   20
+#define PIN_CLOCK  21
+
+// The state of the lines the chips can see, from a given time on.
+struct BusState {
+    uint64_t time; // ns
+    uint16_t latched; // shift register outputs, one INT line per chip
+    uint8_t data; // D7-D0
+    bool dc;
+    bool stereo; // the board's output switch
+};
+
+// The levels of the GPIO lines, followed through the shift register the way
+// the board wires it: a rising edge on CLOCK shifts DATA in, and one on STROBE
+// latches the shifted bits onto the chips' INT lines.
+struct BusLines {
+    uint32_t gpio = 0;
+    uint16_t shift = 0, latched = 0;
+    // Applies a transition, returning whether it was a rising edge.
+    bool set(unsigned pin, bool value) {
+        bool rising = value && !((gpio >> pin) & 1);
+        if (value) gpio |= 1 << pin;
+        else gpio &= ~(1 << pin);
+        if (rising && pin == PIN_CLOCK) shift = shift << 1 | ((gpio >> PIN_DATA) & 1);
+        else if (rising && pin == PIN_STROBE) latched = shift;
+        return rising;
+    }
+    uint8_t data() const {
+        uint8_t d = 0;
+        for (int i = 0; i < 8; i++) d |= ((gpio >> (13 - i)) & 1) << i; // D7-D0 are on GPIO 6-13
+        return d;
+    }
+    bool dc() const {return (gpio >> PIN_DC) & 1;}
+    bool stereo() const {return (gpio >> PIN_STEREO) & 1;}
+};
+
+// Follows GPIO transitions through the shift register and keeps a list of the
+// states they leave the bus in. Transitions at the same time are taken to
+// happen together, so only the state once they're all done is kept.
+class BusSplitter {
+public:
+    std::vector<BusState> states;
+    void gpio(uint64_t time, unsigned pin, bool value); // time in us, as psg-host traces it
+    void finish(); // call after the last transition
+private:
+    BusLines lines;
+    uint64_t pendingTime = 0;
+    bool pending = false;
+};
+
+// Works out the levels on a chip's PORTA and PORTC pins: RA1 is the data clock,
+// RA2 is the chip's INT line, RA5/RA4 are D7/D6 and RC5-0 are D5-D0.
+static inline void chipPins(const BusState& state, int chip, uint8_t * porta, uint8_t * portc) {
+    *porta = (state.dc ? 0x02 : 0) | ((state.latched >> chip) & 1) << 2 | ((state.data >> 6) & 3) << 4;
+    *portc = state.data & 0x3F;
+}
+
+// Produces one chip's DAC output, one sample every CHIP_SAMPLE_PERIOD.
+class ChipRenderer {
+public:
+    ChipRenderer(const std::vector<BusState>& bus, int chip): bus(bus), chip(chip) {}
+    virtual ~ChipRenderer() {}
+    // Renders the next count samples. 128 stands in for the DAC being off.
+    virtual void render(uint8_t * out, size_t count) = 0;
+protected:
+    const std::vector<BusState>& bus;
+    int chip;
+    size_t next = 0; // next bus state to apply
+    uint64_t samples = 0; // samples rendered so far
+};
+
+// Runs the PIC firmware in the emulator, so the output is exactly what the
+// chip would write to its DAC.
+class ChipEmulator: public ChipRenderer {
+public:
+    ChipEmulator(const std::vector<BusState>& bus, int chip, const uint16_t * program): ChipRenderer(bus, chip), pic(program) {}
+    void render(uint8_t * out, size_t count) override;
+    uint8_t sampleAt(uint64_t time); // the DAC output at a time, which must not go backwards
+    const PicEmu& emulator() const {return pic;}
+private:
+    PicEmu pic;
+    uint8_t pins[2] = {0, 0};
+};
+
+// Follows the firmware's interrupt handler and wave loop by counting their
+// cycles instead of running them: the handler's polls, the point in an
+// iteration it stops the loop at and what the loop had read by then. The
+// waveforms, volume scaling and noise generator match the firmware's arithmetic,
+// so the output is the same as the emulator's, sample for sample, at a small
+// fraction of the cost. Clock changes are ignored (the driver never sends them).
+class ChipModel: public ChipRenderer {
+public:
+    ChipModel(const std::vector<BusState>& bus, int chip);
+    void render(uint8_t * out, size_t count) override;
+private:
+    enum class Wait {None, Command, Duty, IncrementLow, System};
+    // the firmware's variables, in the common memory it keeps them in
+    uint8_t wave, volume, adjust, duty;
+    uint16_t increment, position;
+    uint8_t noise[2]; // 0x123, 0x124; not cleared by a reset
+    bool halfCarry = false; // STATUS.DC from the last position update, which clocks the noise
+    uint8_t dacValue = 0x7F;
+    bool stopped = false; // in the bootloader, or reset by the watchdog
+    bool dacOff = false;
+    Wait wait = Wait::None;
+    uint64_t waitStart = 0; // the watchdog goes off PIC_WDT_PERIOD after the interrupt
+    bool lastInt = false, lastDC = false;
+    uint64_t dcTime = 0; // when the data clock last changed
+    uint64_t handlerAt = 0; // when the handler gets to the poll it's waiting in
+    bool clockLow = false; // the handler is waiting for the clock to go low before the next byte
+    int64_t due = 0; // cycles from the start of the next loop iteration to the last sample
+    bool advancePending = false; // the handler stopped the loop after its write
+    int64_t advanceInto = 0; // how far into the iteration that was
+    uint16_t advanceFrom = 0; // the increment before the handler
+    bool held = false; // the handler stopped the loop before its write
+    int64_t heldInto = 0, heldLength = 0; // cycles into the iteration the handler stopped it, and how long it was taken to be
+    uint8_t heldWave = 0, heldVolume = 0, heldAdjust = 0, heldDuty = 0; // what the loop had read
+    uint16_t heldIncrement = 0;
+    uint8_t heldValue = 0;
+    uint64_t heldTime = 0; // when the write happens
+
+    void init();
+    bool silent() const {return volume == 0 || increment == 0 || wave == 0 || wave == 7;}
+    // how long the loop takes to go round when it's silent, depending on which check it stops at
+    int silentCycles() const {return volume == 0 ? 8 : (increment == 0 ? 14 : 20);}
+    // how far into an iteration the DAC is written, in cycles
+    int writeCycle() const {
+        if (silent()) return volume == 0 ? 5 : (increment == 0 ? 11 : 17);
+        return wave == 1 ? 23 : (wave == 6 ? 28 : 63);
+    }
+    void catchUp(int64_t limit);
+    // cycles an iteration takes; when the noise doesn't change, its branch of
+    // the loop is one cycle shorter than the others
+    int cost() const {return wave == 6 && !halfCarry ? LOOP_CYCLES - 1 : LOOP_CYCLES;}
+    int loopInstructions(uint8_t * lengths) const;
+    bool midInstruction(int64_t into) const;
+    void hold(int64_t into);
+    void finishHold();
+    void output(uint8_t w, uint8_t vol, uint8_t adj, uint8_t dut);
+    void output() {output(wave, volume, adjust, duty);}
+    void advance(uint16_t by);
+    void advance() {advance(increment);}
+    void apply(const BusState& state);
+    void synthesize(uint8_t * out, size_t count);
+};
+
+void writeWAVHeader(std::ostream& out, uint32_t rate, int channels, int bits, uint32_t frames);
+void writeLE(std::ostream& out, uint32_t value, int size);
+
+#endif
@@ -0,0 +1,139 @@
+/*
+ * pico-sound-driver/hal.h
+ * PSG
+ *
+ * This file contains the hardware abstraction layer for the firmware. On the
+ * Pico, every call maps straight onto the SDK/TinyUSB. When built with PSG_HOST
+ * defined, the calls go to the host backend in hal_host.cpp instead, which
+ * records GPIO transitions against a virtual clock rather than sleeping, so the
+ * MIDI -> bus pipeline can run on a normal computer.
+ *
+ * This code is licensed under the GPLv2 license.
+ * Copyright (c) 2022-2023 JackMacWindows.
+ */
+
+#ifndef HAL_H
+#define HAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifdef PSG_HOST
+
+#include <mutex>
+
+#ifndef PICO_DEFAULT_LED_PIN
+#define PICO_DEFAULT_LED_PIN 25
+#endif
+
+typedef std::mutex hal_mutex_t;
+
+void hal_gpio_out(unsigned pin);
+void hal_gpio_in(unsigned pin);
+void hal_gpio_put(unsigned pin, bool value);
+bool hal_gpio_get(unsigned pin);
+void hal_sleep_us(uint64_t us);
+void hal_sleep_ms(uint32_t ms);
+uint64_t hal_time_us();
+void hal_wait_until(uint64_t time);
+static inline void hal_event_signal() {}
+void hal_event_wait_until(uint64_t time);
+static inline void hal_mutex_init([[maybe_unused]] hal_mutex_t * mtx) {}
+static inline void hal_mutex_enter(hal_mutex_t * mtx) {mtx->lock();}
+static inline void hal_mutex_exit(hal_mutex_t * mtx) {mtx->unlock();}
+bool hal_midi_available();
+void hal_midi_read(uint8_t packet[4]);
+bool hal_midi_write(const uint8_t packet[4]);
+void hal_unique_id(uint8_t id[8]);
+#define HAL_FLASH_SIZE (2 * 1024 * 1024)
+#define HAL_FLASH_SECTOR_SIZE 4096
+#define HAL_FLASH_PAGE_SIZE 256
+const uint8_t * hal_flash_read(uint32_t offset);
+void hal_flash_erase(uint32_t offset, uint32_t size);
+void hal_flash_program(uint32_t offset, const uint8_t * data, uint32_t size);
+[[noreturn]] void hal_reboot();
+[[noreturn]] void hal_reboot_watchdog();
+[[noreturn]] void hal_reboot_bootloader();
+
+#else
+
+#include <hardware/flash.h>
+#include <hardware/gpio.h>
+#include <hardware/sync.h>
+#include <hardware/timer.h>
+#include <hardware/watchdog.h>
+#include <pico/mutex.h>
+#include <pico/time.h>
+#include <pico/bootrom.h>
+#include <pico/multicore.h>
+#include <tusb.h>
+
+typedef mutex_t hal_mutex_t;
+
+static inline void hal_gpio_out(unsigned pin) {gpio_init(pin); gpio_set_dir(pin, true);}
+static inline void hal_gpio_in(unsigned pin) {gpio_init(pin); gpio_set_dir(pin, false);}
+static inline void hal_gpio_put(unsigned pin, bool value) {gpio_put(pin, value);}
+static inline bool hal_gpio_get(unsigned pin) {return gpio_get(pin);}
+static inline void hal_sleep_us(uint64_t us) {sleep_us(us);}
+static inline void hal_sleep_ms(uint32_t ms) {sleep_ms(ms);}
+static inline uint64_t hal_time_us() {return time_us_64();}
+static inline void hal_wait_until(uint64_t time) {sleep_until(from_us_since_boot(time));}
+// wakes the other core out of hal_event_wait_until
+static inline void hal_event_signal() {__sev();}
+// sleeps until the given time or until the other core signals, whichever is first
+static inline void hal_event_wait_until(uint64_t time) {best_effort_wfe_or_timeout(from_us_since_boot(time));}
+static inline void hal_mutex_init(hal_mutex_t * mtx) {mutex_init(mtx);}
+static inline void hal_mutex_enter(hal_mutex_t * mtx) {mutex_enter_blocking(mtx);}
+static inline void hal_mutex_exit(hal_mutex_t * mtx) {mutex_exit(mtx);}
+static inline bool hal_midi_available() {return tud_midi_available();}
+static inline void hal_midi_read(uint8_t packet[4]) {tud_midi_packet_read(packet);}
+static inline bool hal_midi_write(const uint8_t packet[4]) {return tud_midi_packet_write(packet);}
+static inline void hal_unique_id(uint8_t id[8]) {flash_get_unique_id(id);}
+
+#define HAL_FLASH_SIZE PICO_FLASH_SIZE_BYTES
+#define HAL_FLASH_SECTOR_SIZE FLASH_SECTOR_SIZE
+#define HAL_FLASH_PAGE_SIZE FLASH_PAGE_SIZE
+
+static inline const uint8_t * hal_flash_read(uint32_t offset) {return (const uint8_t*)(XIP_BASE + offset);}
+
+// Neither core can run from flash while it's being written, so these must be
+// called from core 1 with core 0 set up as a lockout victim. Data must be in RAM.
+static inline void hal_flash_erase(uint32_t offset, uint32_t size) {
+    multicore_lockout_start_blocking();
+    uint32_t ints = save_and_disable_interrupts();
+    flash_range_erase(offset, size);
+    restore_interrupts(ints);
+    multicore_lockout_end_blocking();
+}
+
+static inline void hal_flash_program(uint32_t offset, const uint8_t * data, uint32_t size) {
+    multicore_lockout_start_blocking();
+    uint32_t ints = save_and_disable_interrupts();
+    flash_range_program(offset, data, size);
+    restore_interrupts(ints);
+    multicore_lockout_end_blocking();
+}
+
+[[noreturn]] static inline void hal_reboot() {
+    // apparently this works to reset the chip?
+    (*((volatile uint32_t*)(PPB_BASE + 0x0ED0C))) = 0x5FA0004;
+    // we should be done by now, but just in case:
+    watchdog_enable(1, 1);
+    while (true);
+}
+
+// Only lets the watchdog reset the chip, like the end of a PIC flash always has.
+[[noreturn]] static inline void hal_reboot_watchdog() {
+    watchdog_enable(1, 1);
+    while (true);
+}
+
+[[noreturn]] static inline void hal_reboot_bootloader() {
+    reset_usb_boot(1 << PICO_DEFAULT_LED_PIN, 0);
+    while (true);
+}
+
+#endif
+
+#endif
@@ -0,0 +1,202 @@
+/*
+ * pico-sound-driver/hal_host.cpp
+ * PSG
+ *
+ * This file contains the host backend of the hardware abstraction layer. Time is
+ * virtual: sleeping advances the clock instead of blocking, and every GPIO
+ * transition is stamped with the virtual time it happened at. MIDI packets are
+ * fed in through a queue in place of the TinyUSB FIFO.
+ *
+ * This code is licensed under the GPLv2 license.
+ * Copyright (c) 2022-2023 JackMacWindows.
+ */
+
+#include "hal_host.h"
+#include <atomic>
+#include <deque>
+#include <stdio.h>
+#include <stdlib.h>
+
+char usb_serial[] = "0000000000000000:PSGv1.2.0";
+
+static std::atomic<uint64_t> now(0);
+static uint32_t gpio_state = 0, gpio_dir = 0;
+static uint64_t gpio_transitions = 0;
+static bool tracing = false;
+static std::vector<GPIOEvent> trace_events;
+static gpio_callback_t gpio_callback = NULL;
+static void * gpio_callback_data = NULL;
+static wait_callback_t wait_callback = NULL;
+static void * wait_callback_data = NULL;
+static std::deque<uint32_t> midi_in;
+static std::vector<uint32_t> midi_out;
+static std::vector<uint8_t> flash(HAL_FLASH_SIZE, 0xFF);
+
+void hal_gpio_out(unsigned pin) {
+    gpio_dir |= 1 << pin;
+    gpio_state &= ~(1 << pin);
+}
+
+void hal_gpio_in(unsigned pin) {
+    gpio_dir &= ~(1 << pin);
+}
+
+void hal_gpio_put(unsigned pin, bool value) {
+    if (((gpio_state >> pin) & 1) == value) return;
+    gpio_state ^= 1 << pin;
+    gpio_transitions++;
+    uint64_t time = now.load();
+    if (tracing) trace_events.push_back({time, (uint8_t)pin, value});
+    if (gpio_callback) gpio_callback(time, pin, value, gpio_callback_data);
+}
+
+bool hal_gpio_get(unsigned pin) {
+    return (gpio_state >> pin) & 1;
+}
+
+void hal_sleep_us(uint64_t us) {
+    now += us;
+}
+
+void hal_sleep_ms(uint32_t ms) {
+    now += (uint64_t)ms * 1000;
+}
+
+uint64_t hal_time_us() {
+    return now.load();
+}
+
+void hal_wait_until(uint64_t time) {
+    if (wait_callback) wait_callback(time, wait_callback_data);
+    else hal_host_advance_to(time);
+}
+
+bool hal_midi_available() {
+    return !midi_in.empty();
+}
+
+void hal_midi_read(uint8_t packet[4]) {
+    uint32_t p = midi_in.front();
+    midi_in.pop_front();
+    memcpy(packet, &p, 4);
+}
+
+bool hal_midi_write(const uint8_t packet[4]) {
+    uint32_t p;
+    memcpy(&p, packet, 4);
+    midi_out.push_back(p);
+    return true;
+}
+
+void hal_unique_id(uint8_t id[8]) {
+    for (int i = 0; i < 8; i++) id[i] = 0x50 + i;
+}
+
+const uint8_t * hal_flash_read(uint32_t offset) {
+    return flash.data() + offset;
+}
+
+void hal_flash_erase(uint32_t offset, uint32_t size) {
+    if (offset % HAL_FLASH_SECTOR_SIZE || size % HAL_FLASH_SECTOR_SIZE || offset + size > HAL_FLASH_SIZE) {
+        fprintf(stderr, "PSG: bad flash erase of %u bytes at %#x\n", size, offset);
+        abort();
+    }
+    memset(flash.data() + offset, 0xFF, size);
+}
+
+// Like NOR flash, programming can only clear bits; erasing sets them again.
+void hal_flash_program(uint32_t offset, const uint8_t * data, uint32_t size) {
+    if (offset % HAL_FLASH_PAGE_SIZE || size % HAL_FLASH_PAGE_SIZE || offset + size > HAL_FLASH_SIZE) {
+        fprintf(stderr, "PSG: bad flash program of %u bytes at %#x\n", size, offset);
+        abort();
+    }
+    for (uint32_t i = 0; i < size; i++) flash[offset + i] &= data[i];
+}
+
+void hal_reboot() {
+    fprintf(stderr, "PSG: reboot requested at %llu us\n", (unsigned long long)now.load());
+    exit(0);
+}
+
+void hal_reboot_watchdog() {
+    hal_reboot();
+}
+
+void hal_reboot_bootloader() {
+    fprintf(stderr, "PSG: bootloader requested at %llu us\n", (unsigned long long)now.load());
+    exit(0);
+}
+
+// The wait callback stands in for the other core, so it's also what wakes us.
+void hal_event_wait_until(uint64_t time) {
+    hal_wait_until(time);
+}
+
+void hal_host_advance_to(uint64_t time) {
+    if (time > now.load()) now = time;
+}
+
+void hal_host_set_wait_callback(wait_callback_t cb, void * userdata) {
+    wait_callback = cb;
+    wait_callback_data = userdata;
+}
+
+void hal_host_set_input(unsigned pin, bool value) {
+    if (gpio_dir & (1 << pin)) return;
+    if (value) gpio_state |= 1 << pin;
+    else gpio_state &= ~(1 << pin);
+}
+
+uint32_t hal_host_gpio_state() {
+    return gpio_state;
+}
+
+void hal_host_trace(bool enable) {
+    tracing = enable;
+}
+
+std::vector<GPIOEvent>& hal_host_trace_events() {
+    return trace_events;
+}
+
+void hal_host_set_gpio_callback(gpio_callback_t cb, void * userdata) {
+    gpio_callback = cb;
+    gpio_callback_data = userdata;
+}
+
+uint64_t hal_host_gpio_transitions() {
+    return gpio_transitions;
+}
+
+void hal_host_midi_push(const uint8_t packet[4]) {
+    uint32_t p;
+    memcpy(&p, packet, 4);
+    midi_in.push_back(p);
+}
+
+// Splits one complete MIDI message into USB-MIDI event packets on cable 0.
+void hal_host_midi_send(const uint8_t * msg, size_t len) {
+    if (len == 0) return;
+    uint8_t p[4] = {0, 0, 0, 0};
+    if (msg[0] == 0xF0) {
+        while (len > 3) {
+            p[0] = 0x04; p[1] = msg[0]; p[2] = msg[1]; p[3] = msg[2];
+            hal_host_midi_push(p);
+            msg += 3; len -= 3;
+        }
+        p[0] = 0x04 + len; p[1] = msg[0]; p[2] = len > 1 ? msg[1] : 0; p[3] = len > 2 ? msg[2] : 0;
+    } else if (msg[0] < 0xF0) {
+        p[0] = msg[0] >> 4; p[1] = msg[0]; p[2] = len > 1 ? msg[1] : 0; p[3] = len > 2 ? msg[2] : 0;
+    } else {
+        p[0] = len == 3 ? 0x03 : len == 2 ? 0x02 : 0x0F; p[1] = msg[0]; p[2] = len > 1 ? msg[1] : 0; p[3] = len > 2 ? msg[2] : 0;
+    }
+    hal_host_midi_push(p);
+}
+
+std::vector<uint32_t>& hal_host_midi_output() {
+    return midi_out;
+}
+
+std::vector<uint8_t>& hal_host_flash() {
+    return flash;
+}
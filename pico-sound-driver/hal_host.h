@@ -0,0 +1,66 @@
+/*
+ * pico-sound-driver/hal_host.h
+ * PSG
+ *
+ * This file contains the host-only side of the hardware abstraction layer: the
+ * controls for the virtual clock, GPIO trace, MIDI queues and flash of the host
+ * backend, as well as the firmware entry points that host programs drive directly.
+ *
+ * This code is licensed under the GPLv2 license.
+ * Copyright (c) 2022-2023 JackMacWindows.
+ */
+
+#ifndef HAL_HOST_H
+#define HAL_HOST_H
+
+#include "hal.h"
+#include <vector>
+
+struct GPIOEvent {
+    uint64_t time;
+    uint8_t pin;
+    bool value;
+};
+
+typedef void (*gpio_callback_t)(uint64_t time, unsigned pin, bool value, void * userdata);
+typedef void (*wait_callback_t)(uint64_t until, void * userdata);
+
+// virtual clock
+void hal_host_advance_to(uint64_t time);
+// Called by hal_wait_until in place of advancing the clock, so the host can
+// deliver input part way through a wait. It may return before `until`.
+void hal_host_set_wait_callback(wait_callback_t cb, void * userdata);
+
+// GPIO state and tracing
+void hal_host_set_input(unsigned pin, bool value);
+uint32_t hal_host_gpio_state();
+void hal_host_trace(bool enable);
+std::vector<GPIOEvent>& hal_host_trace_events();
+void hal_host_set_gpio_callback(gpio_callback_t cb, void * userdata);
+uint64_t hal_host_gpio_transitions();
+
+// MIDI queues
+void hal_host_midi_push(const uint8_t packet[4]);
+void hal_host_midi_send(const uint8_t * msg, size_t len);
+std::vector<uint32_t>& hal_host_midi_output();
+
+// flash contents, HAL_FLASH_SIZE bytes
+std::vector<uint8_t>& hal_host_flash();
+
+// firmware entry points (main.cpp)
+void psg_init();
+bool core2_tick();
+uint64_t core2_wait(uint64_t deadline, uint64_t start, bool animating);
+void tud_midi_rx_cb(uint8_t itf);
+void flushMidiOutput();
+void picCheckTimeout();
+// Whether core 1 has events from core 0 it hasn't handled yet.
+bool psg_host_events_waiting();
+// Loads one envelope (npoints x, y pairs) and steps it as a voice's volume
+// envelope would, returning its value in 16.16 fixed point.
+void psg_host_envelope_start(const uint16_t * points, uint8_t npoints, uint8_t sustain, uint8_t loopStart, uint8_t loopEnd);
+uint32_t psg_host_envelope_step(bool release, bool advance, int32_t frac);
+// The PIC volume level the left or right chip gets for a volume and MIDI pan.
+uint8_t psg_host_volume_level(uint8_t vol, uint8_t pan, bool right);
+
+#endif
@@ -0,0 +1,238 @@
+/*
+ * pico-sound-driver/host.cpp
+ * PSG
+ *
+ * This file contains a small driver for the host build of the firmware. It feeds
+ * a raw MIDI byte stream (e.g. a .syx file or a capture from amidi) through the
+ * same USB callback and core 1 tick the Pico runs, then reports how much virtual
+ * bus time and how many GPIO transitions it took, as well as the wall-clock cost
+ * of the firmware logic itself.
+ *
+ * Messages are spread evenly in time and delivered part way through core 1's
+ * waits, the way USB packets would arrive while it sleeps between ticks.
+ *
+ * Usage: psg-host [-t trace.csv] [-n messages-per-10ms] [-d extra-ms] [-r rate-hz] [-x] [-f flash.bin] <input.syx>
+ *
+ * The input is raw MIDI bytes as the board would receive them (status bytes,
+ * data and SysEx, running status allowed), not a Standard MIDI File: there is
+ * no header and there are no delta times.
+ *
+ * With -f, the flash starts out with the contents of the given image (if it
+ * exists) and is saved back to it afterwards, so a stored patch bank carries
+ * over from one run to the next like it would across power cycles.
+ *
+ * This code is licensed under the GPLv2 license.
+ * Copyright (c) 2022-2023 JackMacWindows.
+ */
+
+#include "hal_host.h"
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Splits a raw MIDI byte stream into complete messages, expanding running status.
+static std::vector<std::vector<uint8_t>> parseStream(const std::vector<uint8_t>& data) {
+    std::vector<std::vector<uint8_t>> messages;
+    uint8_t status = 0;
+    for (size_t i = 0; i < data.size();) {
+        uint8_t b = data[i];
+        if (b == 0xF0) {
+            size_t end = i;
+            while (end < data.size() && data[end] != 0xF7) end++;
+            if (end < data.size()) end++;
+            messages.emplace_back(data.begin() + i, data.begin() + end);
+            i = end;
+            continue;
+        } else if (b >= 0xF8) {
+            messages.push_back({b});
+            i++;
+            continue;
+        } else if (b & 0x80) {
+            status = b;
+            i++;
+        } else if (status == 0) {
+            i++;
+            continue;
+        }
+        int len;
+        switch (status & 0xF0) {
+            case 0xC0: case 0xD0: len = 1; break;
+            case 0xF0: len = status == 0xF2 ? 2 : (status == 0xF1 || status == 0xF3) ? 1 : 0; break;
+            default: len = 2; break;
+        }
+        std::vector<uint8_t> msg = {status};
+        for (int j = 0; j < len && i < data.size() && !(data[i] & 0x80); j++) msg.push_back(data[i++]);
+        messages.push_back(msg);
+        if (status >= 0xF0) status = 0;
+    }
+    return messages;
+}
+
+// Joins the SysEx packets the firmware has sent back into a byte stream.
+static std::vector<uint8_t> outputBytes() {
+    std::vector<uint8_t> bytes;
+    for (uint32_t p : hal_host_midi_output()) {
+        int n = (p & 0x0F) == 0x04 || (p & 0x0F) == 0x07 ? 3 : (p & 0x0F) == 0x06 ? 2 : 1;
+        for (int i = 0; i < n; i++) bytes.push_back((p >> (8 * (i + 1))) & 0xFF);
+    }
+    return bytes;
+}
+
+// Hands messages to the USB callback at their arrival times while core 1 waits.
+struct Feeder {
+    std::vector<std::vector<uint8_t>> messages;
+    size_t next = 0;
+    uint64_t start = 0, interval = 0;
+    uint64_t arrival(size_t i) const {return start + i * interval;}
+};
+
+static void feed(uint64_t until, void * userdata) {
+    Feeder * f = (Feeder*)userdata;
+    if (f->next < f->messages.size() && f->arrival(f->next) <= until) {
+        // stop at the first arrival so the firmware gets to react to it
+        hal_host_advance_to(f->arrival(f->next));
+        while (f->next < f->messages.size() && f->arrival(f->next) <= hal_time_us()) {
+            hal_host_midi_send(f->messages[f->next].data(), f->messages[f->next].size());
+            f->next++;
+        }
+    } else {
+        hal_host_advance_to(until);
+    }
+    if (hal_midi_available()) tud_midi_rx_cb(0);
+    flushMidiOutput(); // what core 0 does in between USB callbacks
+    picCheckTimeout();
+}
+
+static std::string tracePath, flashPath;
+
+// Reports how a PIC flash went and saves the flash image and trace. This also
+// runs if the firmware reboots, as it does at the end of a PIC flash.
+static void finish() {
+    static bool finished = false;
+    if (finished) return;
+    finished = true;
+    std::vector<uint8_t> output = outputBytes();
+    for (size_t i = 0; i + 10 <= output.size(); i++) {
+        if (output[i] == 0xF0 && output[i+1] == 0x00 && output[i+2] == 0x46 && output[i+3] == 0x71 && (output[i+4] == 0x00 || output[i+4] == 0x08) && output[i+9] == 0xF7 && output[i+6] != 0) {
+            static const char * status[] = {"in progress", "done", "bad record", "bad checksum", "rows out of order", "block too large"};
+            std::cout << "PIC flash:        " << (output[i+7] | (output[i+8] << 7)) << " rows, " << (output[i+6] < 6 ? status[output[i+6]] : "unknown status") << "\n";
+        }
+        if (i + 27 <= output.size() && output[i] == 0xF0 && output[i+1] == 0x00 && output[i+2] == 0x46 && output[i+3] == 0x71 && output[i+4] == 0x0A && output[i+6] == 0 && output[i+26] == 0xF7) {
+            unsigned rows = 0;
+            for (int j = 7; j < 26; j++) rows += __builtin_popcount(output[i+j]);
+            std::cout << "PIC manifest:     " << rows << " rows to send\n";
+        }
+    }
+    if (!flashPath.empty()) {
+        std::ofstream image(flashPath, std::ios::binary);
+        image.write((const char*)hal_host_flash().data(), hal_host_flash().size());
+    }
+    if (!tracePath.empty()) {
+        std::ofstream out(tracePath);
+        out << "time,pin,value\n";
+        for (const GPIOEvent& ev : hal_host_trace_events()) out << ev.time << "," << (int)ev.pin << "," << (int)ev.value << "\n";
+    }
+}
+
+int main(int argc, const char * argv[]) {
+    size_t perTick = 0;
+    uint64_t extra = 1000;
+    unsigned rate = 100;
+    bool express = false;
+    const char * input = NULL;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-t" && i + 1 < argc) tracePath = argv[++i];
+        else if (arg == "-n" && i + 1 < argc) perTick = std::stoul(argv[++i]);
+        else if (arg == "-d" && i + 1 < argc) extra = std::stoull(argv[++i]);
+        else if (arg == "-r" && i + 1 < argc) rate = std::stoul(argv[++i]);
+        else if (arg == "-x") express = true;
+        else if (arg == "-f" && i + 1 < argc) flashPath = argv[++i];
+        else input = argv[i];
+    }
+    if (input == NULL) {
+        std::cerr << "Usage: " << argv[0] << " [-t trace.csv] [-n messages-per-10ms] [-d extra-ms] [-r rate-hz] [-x] [-f flash.bin] <input.syx>\n"
+                  << "input.syx is a raw MIDI byte stream (e.g. from amidi -r), not a Standard MIDI File\n";
+        return 1;
+    }
+    std::ifstream in(input, std::ios::binary);
+    if (!in.is_open()) {
+        std::cerr << "Could not open input file\n";
+        return 2;
+    }
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+    Feeder feeder;
+    feeder.messages = parseStream(data);
+    const std::vector<std::vector<uint8_t>>& messages = feeder.messages;
+
+    if (!flashPath.empty()) {
+        std::ifstream image(flashPath, std::ios::binary);
+        if (image.is_open()) image.read((char*)hal_host_flash().data(), hal_host_flash().size());
+    }
+    hal_host_trace(!tracePath.empty());
+    atexit(finish);
+    psg_init();
+    if (rate != 100) {
+        const uint8_t setRate[] = {0xF0, 0x00, 0x46, 0x71, 0x04, 0x00, (uint8_t)(rate / 100), 0xF7};
+        hal_host_midi_send(setRate, sizeof(setRate));
+    }
+    if (express) {
+        const uint8_t setExpress[] = {0xF0, 0x00, 0x46, 0x71, 0x05, 0x00, 0x01, 0xF7};
+        hal_host_midi_send(setExpress, sizeof(setExpress));
+    }
+    tud_midi_rx_cb(0);
+    uint64_t start = hal_time_us(), busTime = 0, ticks = 0;
+    auto wallStart = std::chrono::steady_clock::now();
+    feeder.start = start;
+    feeder.interval = perTick ? 10000 / perTick : 0;
+    hal_host_set_wait_callback(feed, &feeder);
+    uint64_t deadline = start, end = 0;
+    while (true) {
+        uint64_t busStart = hal_time_us();
+        bool animating = core2_tick();
+        busTime += hal_time_us() - busStart;
+        ticks++;
+        deadline = core2_wait(deadline, busStart, animating);
+        if (feeder.next >= messages.size()) {
+            if (end == 0) end = hal_time_us() + extra * 1000;
+            else if (hal_time_us() >= end) break;
+        }
+    }
+    auto wall = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - wallStart).count();
+
+    std::cout << "Messages:         " << messages.size() << "\n";
+    std::cout << "Ticks:            " << ticks << "\n";
+    std::cout << "Virtual time:     " << (hal_time_us() - start) << " us\n";
+    std::cout << "Bus time:         " << busTime << " us (" << (ticks ? busTime / ticks : 0) << " us/tick)\n";
+    std::cout << "GPIO transitions: " << hal_host_gpio_transitions() << "\n";
+    std::cout << "Wall time:        " << wall << " us\n";
+    finish();
+    // replies to patch block uploads
+    std::vector<uint8_t> output = outputBytes();
+    unsigned blocksOK = 0, blocksFailed = 0;
+    for (size_t i = 0; i + 8 <= output.size(); i++)
+        if (output[i] == 0xF0 && output[i+1] == 0x00 && output[i+2] == 0x46 && output[i+3] == 0x71 && output[i+4] == 0x07 && output[i+7] == 0xF7)
+            (output[i+6] == 0 ? blocksOK : blocksFailed)++;
+    if (blocksOK || blocksFailed) std::cout << "Patch blocks:     " << blocksOK << " OK, " << blocksFailed << " failed\n";
+    // ask the firmware for its statistics the same way a host would
+    hal_host_set_wait_callback(NULL, NULL);
+    const uint8_t request[] = {0xF0, 0x00, 0x46, 0x71, 0x03, 0x00, 0xF7};
+    hal_host_midi_output().clear();
+    hal_host_midi_send(request, sizeof(request));
+    tud_midi_rx_cb(0);
+    std::vector<uint8_t> reply = outputBytes();
+    if (reply.size() > 7 && reply[4] == 0x03) {
+        static const char * names[] = {"Ring full stalls", "Ring high water", "Voice steals", "Voice drops", "Suppressed writes", "Tick overruns", "Ticks skipped", "Longest tick (us)",
+            "Latency <256us", "Latency <512us", "Latency <1ms", "Latency <2ms", "Latency <4ms", "Latency <8ms", "Latency <16ms", "Latency >=16ms", "Patch rejects", "Untimed notes"};
+        for (int i = 0; i < reply[6] && 12 + i * 5 <= (int)reply.size(); i++) {
+            uint32_t value = 0;
+            for (int j = 0; j < 5; j++) value |= (uint32_t)reply[7 + i*5 + j] << (j * 7);
+            std::string name = i < (int)(sizeof(names) / sizeof(names[0])) ? names[i] : "Statistic " + std::to_string(i);
+            std::cout << name << ":" << std::string(name.size() < 17 ? 17 - name.size() : 1, ' ') << value << "\n";
+        }
+    }
+    return 0;
+}
@@ -10,14 +10,15 @@
  * Copyright (c) 2022-2023 JackMacWindows.
  */
 
-#include <hardware/flash.h>
-#include <hardware/gpio.h>
-#include <hardware/timer.h>
-#include <hardware/watchdog.h>
-#include <pico/mutex.h>
+#include "hal.h"
+#include "ring.h"
+#include "tables.h"
+#include "psg-crc.h"
+#ifdef PSG_HOST
+#include "hal_host.h"
+#else
 #include <pico/multicore.h>
-#include <pico/bootrom.h>
-#include <tusb.h>
+#endif
 #include <math.h>
 #include <stdio.h>
 
@@ -30,8 +31,6 @@
 #define M_PI 3.14159265358979323846
 #endif
 
-#define gpio_out(pin) gpio_init(pin); gpio_set_dir(pin, true)
-#define gpio_in(pin) gpio_init(pin); gpio_set_dir(pin, false)
 #define COMMAND_WAVE_TYPE 0x00
 #define COMMAND_VOLUME    0x40
 #define COMMAND_FREQUENCY 0x80
@@ -41,14 +40,23 @@
 #define PIN_DATA   20
 #define PIN_CLOCK  21
 
-#define sleep_us_sr(n) sleep_us((n))
-#define sleep_us_pic(n) sleep_us((n))
+// Envelope points are in 10 ms units no matter how fast the control loop runs;
+// at higher rates the envelopes step once every controlDiv ticks and are
+// interpolated in between.
+#define ENVELOPE_PERIOD 10000
+#define MAX_CONTROL_DIV 10
+#define IDLE_TIMEOUT 1000000 // longest core 1 sleeps with nothing animating, in us
+#define LATENCY_BINS 8
+
+#define sleep_us_sr(n) hal_sleep_us((n))
+#define sleep_us_pic(n) hal_sleep_us((n))
 
 // !! CLOCK MULTIPLIER CONSTANT !!
 // UPDATE THIS IF MODIFYING THE RUN LENGTH OF THE LOOP CODE
+// (and regenerate noteTable in tables.h, which is derived from it)
 #define CLOCKS_PER_LOOP 70
 
-enum class WaveType {
+enum class WaveType : uint8_t {
     None,
     Sine,
     Triangle,
@@ -60,17 +68,12 @@ enum class WaveType {
     PitchedNoise
 };
 
-enum class InterpolationMode {
-    None,
-    Linear
-};
-
 struct Point {
     uint16_t x, y;
 };
 
+// An envelope's points are npoints entries of pointPool; see envelopePoints.
 struct Envelope {
-    Point points[12];
     uint8_t npoints = 0;
     uint8_t sustain = 0xFF;
     uint8_t loopStart = 0xFF;
@@ -82,34 +85,50 @@ struct Instrument {
     Envelope pan;
     Envelope frequency;
     Envelope duty;
-    uint8_t waveTypes[4] = {0, 0, 0, 0};
+    uint8_t waveType = 0; // the upload's 3 reserved bytes after it aren't kept
 };
 
+#define POINT_POOL_SIZE (128 * 4 * 12) // envelope points shared by all 128 patches: a full bank in the 12-point format
+#define PATCH_MAX_SIZE (4 * (4 + 255 * sizeof(Point)) + 4) // largest upload in the variable-length format
+
+// Laid out largest-first so the whole voice packs into 92 bytes on the Pico. Amplitudes are
+// 1.15 fixed point, where a MIDI value v maps to v * 257 (the old v / 127.5).
 struct ChannelInfo {
-    // current status fields
-    double position = 0.0;
-    WaveType wavetype = WaveType::None;
-    double duty = 0.5;
-    unsigned int frequency = 0;
-    double amplitude = 1.0;
-    float pan = 0.0;
-    // fade fields
-    double fadeInit = 0.0;
-    int64_t fadeStart = 0;
-    int64_t fadeLength = 0;
-    int fadeDirection = -1;
-    // sound 2.0 (probably irrelevant here)
-    double customWave[512];
-    int customWaveSize;
-    InterpolationMode interpolation;
-    bool isLowFreq = false;
-    uint8_t note = 0;
     // instrument fields
     Instrument * inst = NULL;
+    // current status fields
+    uint32_t increment = 0; // base wave increment, 16.16 fixed point
+    // fade fields
+    uint32_t fadeStart = 0; // low 32 bits of the start time, 0 = not fading
+    uint32_t fadeLength = 0;
+    uint32_t level[4] = {0, 0, 0, 0}; // envelope values, 16.16 fixed point, stepped by the segment slopes
+    int32_t slope[4] = {0, 0, 0, 0}; // of each envelope's current segment, in 16.16 units per tick, rounded down
+    uint16_t amplitude = 0x7FFF;
+    uint16_t levelRem[4] = {0, 0, 0, 0}; // what level leaves out, in 1/(segment length) of a 16.16 unit
+    uint16_t slopeRem[4] = {0, 0, 0, 0}; // what slope leaves out, in the same units
+    uint16_t fadeInit = 0;
+    int16_t bend = 0; // pitch bend, in 1/256 semitones
     uint16_t ticks[4] = {0, 0, 0, 0};
     uint8_t points[4] = {0, 0, 0, 0};
-    uint8_t typeIndex = 0;
+    WaveType wavetype = WaveType::None;
+    uint8_t duty = 127;
+    uint8_t pan = 64; // MIDI pan value
+    uint8_t note = 0;
+    int8_t fadeDirection = -1;
+    bool isLowFreq = false;
     bool release = false;
+    uint8_t phase = 0; // control ticks since the envelopes last stepped
+};
+
+#define AMPLITUDE(v) ((uint16_t)((v) * 257))
+
+// What to do when a note arrives in poly mode and every voice is busy.
+enum class StealPolicy : uint8_t {
+    None, // drop the new note
+    Oldest, // take the voice that started earliest
+    Quietest, // take the voice with the lowest current volume
+    SameNote, // retrigger a voice already playing this note on the channel, or else the oldest
+    ReleasedFirst // take the oldest voice that was already released, or else the oldest
 };
 
 struct MidiPacket {
@@ -119,27 +138,109 @@ struct MidiPacket {
     uint8_t param2;
 };
 
+// Events passed from the USB core to the bus core. The channel message types
+// use the MIDI status nibble so they can be converted directly.
+enum class EventType : uint8_t {
+    NoteOff = 0x8,
+    NoteOn = 0x9,
+    PolyAftertouch = 0xA,
+    ControlChange = 0xB,
+    ProgramChange = 0xC,
+    Aftertouch = 0xD,
+    PitchBend = 0xE,
+    PatchLoaded = 0xF,
+    BankCommand = 0x10, // param1: 0 = commit the patches to flash, 1 = revert to flash
+    PatchBlock = 0x11, // param1: first patch, param2: count; the patches are in hex_storage
+    PicHashes = 0x12 // param1: 0 = erase the saved PIC row hashes, 1 = save them and reboot
+};
+
+// Reply to a patch block upload.
+enum class BlockStatus : uint8_t {
+    OK,
+    BadChecksum, // the CRC didn't match, or the block was too short to have one
+    TooLarge, // the block didn't fit in the receive buffer
+    NoRoom, // the patches didn't fit in the point pool
+    Malformed // the patch data didn't match its header
+};
+
+struct VoiceEvent {
+    EventType type;
+    uint8_t channel;
+    uint8_t param1;
+    uint8_t param2;
+    uint32_t time;
+};
+
+struct Statistics {
+    uint32_t ringFull = 0; // number of times USB reads stalled on a full event ring
+    uint32_t ringHighWater = 0; // most events ever waiting in the ring
+    uint32_t voiceSteals = 0; // notes that took over a busy voice
+    uint32_t voiceDrops = 0; // notes that were dropped for lack of a voice
+    uint32_t suppressedWrites = 0; // commands dropped because the chip already had that value
+    uint32_t tickOverruns = 0; // control ticks that finished after the next one was due
+    uint32_t ticksSkipped = 0; // control ticks dropped to catch up after an overrun
+    uint32_t tickMax = 0; // longest control tick, in microseconds
+    // note events by time from USB to bus: <256 us, then doubling up to >=16 ms
+    uint32_t noteLatency[LATENCY_BINS] = {0};
+    uint32_t patchRejects = 0; // uploaded patches that were malformed or didn't fit in the point pool
+    uint32_t untimedNotes = 0; // note events left out of noteLatency because too many were waiting in one tick
+};
+
 extern char usb_serial[];
 ChannelInfo channels[MAX_CHANNELS];
 uint8_t typeconv[9] = {0, 5, 4, 2, 3, 1, 6, 0, 6};
-const double freqMultiplier = (65536.0 * CLOCKS_PER_LOOP) / 8000000.0;
 uint8_t midiChannels[16][128];
 int midiPrograms[16] = {0};
 uint8_t midiDuty[16] = {128};
+int16_t midiBend[16] = {0};
 uint8_t midiUsedChannels[MAX_CHANNELS] = {0xFF};
+uint16_t midiVoices[16] = {0}; // bitmask of the voices mapped in midiChannels, per MIDI channel
+StealPolicy midiStealPolicy[16];
+uint16_t freeVoices = 0xFFFF; // bitmask of voices with no note and no instrument running
+uint16_t voiceSerial[MAX_CHANNELS] = {0}; // note-on order, for finding the oldest voice
+uint8_t voiceChannel[MAX_CHANNELS] = {0}; // MIDI channel of the last note played on the voice
+uint8_t voiceLevel[MAX_CHANNELS] = {0}; // last volume written to the voice
+uint16_t nextSerial = 0;
 bool midiMode = true;
-uint8_t command_queue[MAX_CHANNELS][4][2];
-bool command_updates[4] = {false};
-mutex_t command_queue_lock;
-bool changed = false;
+// command_queue and dirtyChips are only touched by core 1
+static uint8_t command_queue[MAX_CHANNELS][4][2];
+static uint16_t dirtyChips = 0; // bitmask of chips with anything pending in command_queue
+static uint8_t chip_state[MAX_CHANNELS][4][2]; // last command sent in each slot of each chip, 0xFF = unknown
+// Bumped by core 0 whenever the chips lose their state (a PIC flash or reset),
+// so core 1 forgets chip_state. Only core 0 writes it, so a plain load and
+// store is enough to count; core 1 compares it with the last count it saw.
+std::atomic<uint8_t> chipResets(0);
+static uint8_t chipResetsSeen = 0;
+std::atomic<uint8_t> controlDiv(1); // control ticks per 10 ms envelope step, set over SysEx
+std::atomic<bool> expressMode(false); // flush note events as they arrive instead of on the tick
+#define PENDING_NOTES 16
+static uint32_t pendingNotes[PENDING_NOTES]; // arrival times of note events not yet on the bus
+static uint8_t pendingNoteCount = 0;
+SPSCRing<VoiceEvent, 1024> events;
+SPSCRing<uint32_t, 64> midi_output;
+hal_mutex_t bus_lock; // held by core 1 while flushing, and by core 0 to flash or reset the PICs
+std::atomic<bool> patch_pending(false); // core 1 has yet to store the upload in hex_storage
+uint8_t patchFormat = 0; // second command byte of the instrument upload in progress
+uint8_t blockPackIndex = 0, blockPackHigh = 0; // position in the current 7-in-8 group of a patch or PIC block, and its top bits
+bool blockOverflow = false; // the patch or PIC block being received didn't fit in hex_storage
+bool blockAckPending = false; // core 1 has a patch block to store, and the sender is waiting to hear how it went
+std::atomic<uint8_t> blockStatus(0); // BlockStatus of the last patch block core 1 stored
+bool ringStalled = false;
+Statistics stats;
 uint8_t freq_lsb[MAX_CHANNELS] = {0};
-char hex_storage[0x4000];
+uint8_t freq_msb[MAX_CHANNELS] = {0};
+alignas(4) char hex_storage[0x4000]; // raw SysEx data of instrument uploads, or the unpacked data of a patch or PIC block
 uint16_t hex_storage_size = 0;
 uint8_t inSysEx = 0;
 uint16_t sysExSize;
 uint8_t version_major, version_minor;
 bool stereo = false, dualChannel = false;
 Instrument patches[128];
+// Envelope points of every patch, packed in patch order with no gaps: each
+// patch's volume, pan, frequency and duty points in turn, from patchStart.
+Point pointPool[POINT_POOL_SIZE];
+uint16_t patchStart[128] = {0};
+uint16_t pointPoolUsed = 0;
 
 /*
  * Base64 encoding/decoding (RFC1341)
@@ -158,9 +259,12 @@ static const uint8_t base64_table[65] =
  * @len: Length of the data to be decoded
  * @out: Pointer to output variable
  * @out_len: Length of output buffer
+ * @out_size: Set to the number of bytes decoded
  * Returns: 0 on success, non-0 on error
+ *
+ * out may be src - 1 or before, to decode in place.
  */
-int base64_decode(const uint8_t *src, size_t len, uint8_t *out, size_t out_len) {
+int base64_decode(const uint8_t *src, size_t len, uint8_t *out, size_t out_len, size_t *out_size) {
     static uint8_t dtable[256];
     static uint8_t dtable_done = 0;
 	uint8_t *pos, block[4], tmp;
@@ -192,728 +296,1743 @@ int base64_decode(const uint8_t *src, size_t len, uint8_t *out, size_t out_len)
 			count = 0;
 		}
 	}
+	*out_size = pos - out;
 	return 0;
 }
 
 template<typename T> static T min(T a, T b) {return a < b ? a : b;}
 template<typename T> static T max(T a, T b) {return a > b ? a : b;}
 
-void writeWaveType(uint8_t c, WaveType type, uint8_t duty = 128) {
-    command_queue[c][0][0] = COMMAND_WAVE_TYPE | typeconv[(int)type];
-    if (type == WaveType::Square) command_queue[c][0][1] = duty;
-    if (dualChannel) {
-        command_queue[c+8][0][0] = COMMAND_WAVE_TYPE | typeconv[(int)type];
-        if (type == WaveType::Square) command_queue[c+8][0][1] = duty;
+// iterates c over the voices currently holding a note on a MIDI channel
+#define foreach_voice(c, channel) for (uint16_t _m = midiVoices[channel], c = 0; _m; _m >>= 1, c++) if ((_m & 1) && c < NUM_CHANNELS)
+
+static void mapVoice(uint8_t channel, uint8_t note, uint8_t c) {
+    midiChannels[channel][note] = c;
+    midiVoices[channel] |= 1 << c;
+}
+
+static void unmapVoice(uint8_t channel, uint8_t note) {
+    uint8_t c = midiChannels[channel][note];
+    if (c < MAX_CHANNELS) midiVoices[channel] &= ~(1 << c);
+    midiChannels[channel][note] = 0xFF;
+}
+
+// Must be called whenever a voice's midiUsedChannels entry or instrument changes.
+static void updateFreeVoice(uint8_t c) {
+    if (midiUsedChannels[c] == 0xFF && channels[c].inst == NULL) freeVoices |= 1 << c;
+    else freeVoices &= ~(1 << c);
+}
+
+// Picks a busy voice to take over according to the channel's steal policy.
+static uint8_t findVictim(uint8_t channel, uint8_t note) {
+    StealPolicy policy = midiStealPolicy[channel];
+    uint8_t best = 0xFF;
+    if (policy == StealPolicy::None) return 0xFF;
+    if (policy == StealPolicy::SameNote) {
+        for (int c = 0; c < NUM_CHANNELS; c++)
+            if (voiceChannel[c] == channel && channels[c].note == note) return c;
+    } else if (policy == StealPolicy::Quietest) {
+        for (int c = 0; c < NUM_CHANNELS; c++)
+            if (best == 0xFF || voiceLevel[c] < voiceLevel[best]) best = c;
+        return best;
+    } else if (policy == StealPolicy::ReleasedFirst) {
+        for (int c = 0; c < NUM_CHANNELS; c++)
+            if (midiUsedChannels[c] == 0xFF || channels[c].inst == NULL)
+                if (best == 0xFF || (uint16_t)(nextSerial - voiceSerial[c]) > (uint16_t)(nextSerial - voiceSerial[best])) best = c;
+        if (best != 0xFF) return best;
     }
-    command_updates[0] = true;
-    changed = true;
+    for (int c = 0; c < NUM_CHANNELS; c++)
+        if (best == 0xFF || (uint16_t)(nextSerial - voiceSerial[c]) > (uint16_t)(nextSerial - voiceSerial[best])) best = c;
+    return best;
 }
 
-void writeFrequency(uint8_t c, uint16_t freq) {
-    freq = (uint16_t)floor(freq * freqMultiplier + 0.5);
-    command_queue[c][1][0] = COMMAND_FREQUENCY | ((freq >> 8) & 0x3F);
-    command_queue[c][1][1] = freq & 0xFF;
-    if (dualChannel) {
-        command_queue[c+8][1][0] = COMMAND_FREQUENCY | ((freq >> 8) & 0x3F);
-        command_queue[c+8][1][1] = freq & 0xFF;
+// Takes the lowest free voice for a poly note, or steals one if there are none.
+static uint8_t allocateVoice(uint8_t channel, uint8_t note) {
+    uint16_t avail = freeVoices & ((1 << NUM_CHANNELS) - 1);
+    uint8_t c;
+    if (avail) c = __builtin_ctz(avail);
+    else {
+        c = findVictim(channel, note);
+        if (c == 0xFF) {
+            stats.voiceDrops++;
+            return 0xFF;
+        }
+        stats.voiceSteals++;
+        if (midiUsedChannels[c] != 0xFF && midiChannels[midiUsedChannels[c]][channels[c].note] == c)
+            unmapVoice(midiUsedChannels[c], channels[c].note);
     }
-    command_updates[1] = true;
-    changed = true;
+    freeVoices &= ~(1 << c);
+    voiceSerial[c] = nextSerial++;
+    voiceChannel[c] = channel;
+    return c;
+}
+
+// Queues a command for a chip, unless the chip already holds that value. A
+// pending command that would be undone by this one is cancelled too.
+static void queueCommand(uint8_t c, uint8_t slot, uint8_t cmd, uint8_t arg = 0) {
+    bool twoByte = slot == 1 || cmd == (COMMAND_WAVE_TYPE | 1);
+    if (chip_state[c][slot][0] == cmd && (!twoByte || chip_state[c][slot][1] == arg)) {
+        stats.suppressedWrites++;
+        command_queue[c][slot][0] = 0xFF;
+        if (command_queue[c][0][0] == 0xFF && command_queue[c][1][0] == 0xFF && command_queue[c][2][0] == 0xFF && command_queue[c][3][0] == 0xFF)
+            dirtyChips &= ~(1 << c);
+        return;
+    }
+    command_queue[c][slot][0] = cmd;
+    command_queue[c][slot][1] = arg;
+    dirtyChips |= 1 << c;
+}
+
+void writeWaveType(uint8_t c, WaveType type, uint8_t duty = 128) {
+    uint8_t cmd = COMMAND_WAVE_TYPE | typeconv[(int)type];
+    queueCommand(c, 0, cmd, duty);
+    if (dualChannel) queueCommand(c+8, 0, cmd, duty);
+}
+
+// Converts a frequency in Hz to a 16.16 wave increment. This is only used for
+// the direct frequency CCs, so the 64-bit divide doesn't matter.
+static uint32_t hzToIncrement(uint16_t freq) {
+    return (((uint64_t)freq * 65536 * CLOCKS_PER_LOOP) << 16) / 8000000;
+}
+
+// Scales a 16.16 increment by 2^(offset / 3072), where offset is in 1/256
+// semitones, using pitchTable with linear interpolation between 1/16 semitones.
+static uint32_t pitchScale(uint32_t increment, int32_t offset) {
+    int32_t idx = offset >> 4;
+    uint32_t frac = offset & 15;
+    int32_t octave = idx >= 0 ? idx / 192 : -((191 - idx) / 192);
+    uint32_t step = idx - octave * 192;
+    if (octave > 15) return 0xFFFFFFFF;
+    else if (octave < -31) return 0;
+    uint32_t r = pitchTable[step] + (((pitchTable[step+1] - pitchTable[step]) * frac) >> 4);
+    uint64_t v = ((uint64_t)increment * r + (1 << 29)) >> 30;
+    if (octave >= 0) v <<= octave;
+    else v >>= -octave;
+    return v > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)v;
+}
+
+void writeFrequency(uint8_t c, uint32_t increment) {
+    uint32_t rounded = (increment + 0x8000) >> 16;
+    uint16_t freq = rounded > 0x3FFF ? 0x3FFF : rounded;
+    queueCommand(c, 1, COMMAND_FREQUENCY | ((freq >> 8) & 0x3F), freq & 0xFF);
+    if (dualChannel) queueCommand(c+8, 1, COMMAND_FREQUENCY | ((freq >> 8) & 0x3F), freq & 0xFF);
+}
+
+// Finds the PIC volume level for a volume in 7.16 fixed point.
+static uint8_t volumeLevel(uint32_t vol) {
+    uint8_t lo = 0, hi = 63;
+    while (lo < hi) {
+        uint8_t mid = (lo + hi + 1) / 2;
+        if (vol >= volumeSteps[mid-1]) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
 }
 
 void writeVolume(uint8_t c, uint8_t vol) {
+    if (vol > 127) vol = 127;
+    voiceLevel[c] = vol;
     if (dualChannel) {
-        command_queue[c][2][0] = COMMAND_VOLUME | (uint8_t)floor(13.0 * log(vol * min(channels[c].pan + 1.0f, 1.0f) + 1) + 0.5);
-        command_queue[c+8][2][0] = COMMAND_VOLUME | (uint8_t)floor(13.0 * log(vol * min(1.0f - channels[c].pan, 1.0f) + 1) + 0.5);
+        queueCommand(c, 2, COMMAND_VOLUME | volumeLevel(vol * panLaw[0][channels[c].pan]));
+        queueCommand(c+8, 2, COMMAND_VOLUME | volumeLevel(vol * panLaw[1][channels[c].pan]));
     } else {
-        command_queue[c][2][0] = COMMAND_VOLUME | (uint8_t)floor(13.0 * log(vol + 1) + 0.5);
+        queueCommand(c, 2, COMMAND_VOLUME | volumeLaw[vol]);
     }
-    command_updates[2] = true;
-    changed = true;
 }
 
 void write_data(uint8_t c, uint8_t data) {
-    gpio_put(6, data & 0x80);
-    gpio_put(7, data & 0x40);
-    gpio_put(8, data & 0x20);
-    gpio_put(9, data & 0x10);
-    gpio_put(10, data & 0x08);
-    gpio_put(11, data & 0x04);
-    gpio_put(12, data & 0x02);
-    gpio_put(13, data & 0x01);
+    hal_gpio_put(6, data & 0x80);
+    hal_gpio_put(7, data & 0x40);
+    hal_gpio_put(8, data & 0x20);
+    hal_gpio_put(9, data & 0x10);
+    hal_gpio_put(10, data & 0x08);
+    hal_gpio_put(11, data & 0x04);
+    hal_gpio_put(12, data & 0x02);
+    hal_gpio_put(13, data & 0x01);
     sleep_us_pic(channels[c].isLowFreq ? 16 : 1);
-    gpio_put(14, true);
+    hal_gpio_put(14, true);
     sleep_us_pic(channels[c].isLowFreq ? 16 : 1);
-    gpio_put(14, false);
+    hal_gpio_put(14, false);
     sleep_us_pic(channels[c].isLowFreq ? 48 : 3);
 }
 
-static int htob(const char **str, const char *end) {
-    int n = 0;
-    if (*str >= end) return -1;
-    else if (**str >= '0' && **str <= '9') n += *(*str)++ - '0';
-    else if (**str >= 'A' && **str <= 'F') n += *(*str)++ - 'A' + 10;
-    else if (**str >= 'a' && **str <= 'f') n += *(*str)++ - 'a' + 10;
-    else return -1;
-    n <<= 4;
-    if (*str >= end) return -1;
-    else if (**str >= '0' && **str <= '9') n += *(*str)++ - '0';
-    else if (**str >= 'A' && **str <= 'F') n += *(*str)++ - 'A' + 10;
-    else if (**str >= 'a' && **str <= 'f') n += *(*str)++ - 'a' + 10;
-    else return -1;
-    return n;
-}
-
-int loadhex(const char *data, size_t size) {
-    uint16_t program[0x800];
-    struct {uint16_t start, end;} program_extents[16];
-    uint8_t max_extent = 0;
-    const char *end = data + size;
-    uint16_t addr_hi = 0;
-    memset(program, 0, 0x800);
-    gpio_put(PICO_DEFAULT_LED_PIN, false);
-    while (data < end && *data) {
-        if (*data++ != ':') continue;
-        uint8_t bc = htob(&data, end);
-        if (bc == -1) return -3;
-        bc >>= 1;
-        uint16_t addr_h = htob(&data, end);
-        if (addr_h == -1) return -4;
-        uint16_t addr = htob(&data, end);
-        if (addr == -1) return -5;
-        addr |= addr_h << 8;
-        addr >>= 1;
-        uint8_t rec = htob(&data, end);
-        if (rec == -1) return -6;
-        switch (rec) {
-            case 0: {
-                for (int i = 0; i < bc; i++) {
-                    if (addr_hi == 0) {
-                        int l = htob(&data, end);
-                        if (l == -1) return -7;
-                        int h = htob(&data, end);
-                        if (h == -1) return -8;
-                        if (addr + i < 0x800) program[addr + i] = h << 8 | l;
-                    } else {htob(&data, end); htob(&data, end);}
-                }
-                bool found = false;
-                for (int i = 0; i < max_extent; i++) {if (program_extents[i].end == addr) {program_extents[i].end += bc; found = true; break;}}
-                if (!found && max_extent < 16) program_extents[max_extent++] = {addr, (uint16_t)(addr + bc)};
-                break;
-            }
-            case 1: {
-                // execute programming
-                // collapse extents over the same rows
-                bool loop;
-                do {
-                    loop = false;
-                    for (int i = 0; i < max_extent; i++) {
-                        for (int j = 0; j < max_extent; j++) {
-                            if ((program_extents[i].end & 0x7F0) == (program_extents[j].start & 0x7F0)) {
-                                program_extents[i].end = program_extents[j].end;
-                                for (int k = j + 1; k < max_extent; k++) program_extents[k-1] = program_extents[k];
-                                max_extent--;
-                                loop = true;
-                            } else if ((program_extents[j].end & 0x7F0) == (program_extents[i].start & 0x7F0)) {
-                                program_extents[j].end = program_extents[i].end;
-                                for (int k = i + 1; k < max_extent; k++) program_extents[k-1] = program_extents[k];
-                                max_extent--;
-                                loop = true;
-                            }
-                        }
-                    }
-                } while (loop);
-                // flip all chips into bootloader mode
-                gpio_put(PIN_DATA, true);
-                sleep_us(1);
-                gpio_put(PIN_CLOCK, true);
-                sleep_us(1);
-                gpio_put(PIN_CLOCK, false);
-                sleep_us(1);
-                gpio_put(PIN_DATA, false);
-                sleep_us(1);
-                for (int i = 0; i < NUM_CHANNELS; i++) {
-                    gpio_put(PIN_STROBE, true);
-                    sleep_us(1);
-                    gpio_put(PIN_STROBE, false);
-                    gpio_put(PIN_CLOCK, true);
-                    sleep_us(1);
-                    gpio_put(PIN_CLOCK, false);
-                    sleep_us(1);
-                }
-                gpio_put(PIN_STROBE, true);
-                sleep_us(1);
-                gpio_put(PIN_STROBE, false);
-                channels[0].isLowFreq = true; // run slower for safety
-                write_data(0, 0xFF); // system command
-                write_data(0, 0x01); // enter bootloader
-                for (int i = 0; i < max_extent; i++) {
-                    for (uint16_t addr = program_extents[i].start & 0x7F0; addr < program_extents[i].end; addr += 0x10) {
-                        uint8_t len = min(program_extents[i].end - addr, 0x10);
-                        if (addr < 0x200) continue; // don't overwrite bootloader
-                        write_data(0, len << 1);
-                        write_data(0, addr >> 7);
-                        write_data(0, addr << 1);
-                        write_data(0, 0); // write data
-                        sleep_ms(5); // wait for erase
-                        for (int j = addr; j < addr + len; j++) {
-                            write_data(0, program[j] & 0xFF);
-                            write_data(0, program[j] >> 8);
-                        }
-                        sleep_ms(5); // wait for write
-                        write_data(0, 0); // checksum is ignored
+/*
+ * The PIC firmware can be flashed two ways. SysEx 00 00 takes the HEX file as
+ * text, and it's flashed as it arrives, without holding the file or the program
+ * image in RAM. Each record is read in as its hex digits come in and checked
+ * against its checksum, and the words it carries are gathered into a 16-word row
+ * buffer. Once the records move on to another row, the buffered row is sent to
+ * the chips' bootloaders straight away, and a reply goes back to the host so it
+ * knows how far along the flash is. This relies on the records coming in address
+ * order, as the toolchain writes them; a row that comes back after it was sent
+ * would have to be erased again, so it's reported as an error.
+ *
+ * SysEx 08 00 takes rows the host has already put together, in packed binary
+ * blocks with a CRC, which is less than half the size of the HEX text. Each
+ * block is checked whole before any of it is written, so a block that's
+ * rejected can just be sent again, and an empty block ends the flash.
+ *
+ * Either way, a CRC-32 of each row written is kept, and the table is saved to
+ * the flash sector below the patch bank log once the flash finishes. Before
+ * sending any rows, the host can send SysEx 0A 00 with a hash for each row of
+ * the new image, and the reply says which of them differ from what the chips
+ * were last given, so a small change only costs the rows it touches. The saved
+ * table is erased as soon as the chips go into their bootloaders, so if a flash
+ * never finishes, every row is sent the next time. Flash can only be written
+ * from core 1, so both of these are handed to it as events.
+ */
+
+#define PIC_ROW_WORDS 16
+#define PIC_FLASH_WORDS 0x800
+#define PIC_BOOTLOADER_WORDS 0x200 // rows below this hold the bootloader and are never written
+#define PIC_ROWS (PIC_FLASH_WORDS / PIC_ROW_WORDS)
+#define PIC_HASH_FLASH_OFFSET (HAL_FLASH_SIZE - 0x10000 - HAL_FLASH_SECTOR_SIZE) // just below the patch bank log
+#define PIC_HASH_MAGIC 0x48435350 // "PSCH"
+#define PIC_FLASH_TIMEOUT 10000000 // how long a flash can go without a row before it's given up, in us
+
+// Replies to the PIC flash (SysEx 00 00, 08 00 and 0A 00), as the byte after the command number.
+enum class FlashStatus : uint8_t {
+    Progress, // a row (HEX) or block (binary) was written, or a manifest was compared
+    Done, // all rows were written, and the device is rebooting if there were any
+    BadRecord, // a record wasn't valid HEX, the file ended without an end record, or a block's rows were malformed
+    BadChecksum, // a record's checksum or a block's CRC didn't match
+    OutOfOrder, // a record went back to a row that was already written
+    TooLarge // a block didn't fit in hex_storage
+};
+
+// The rows last written to the chips, as kept in flash.
+struct PicHashes {
+    uint32_t magic;
+    uint32_t known[PIC_ROWS / 32]; // bitmap of rows with a hash
+    uint32_t hashes[PIC_ROWS]; // CRC-32 of each row's word count and words
+    uint32_t crc; // CRC-32 of known and hashes
+};
+
+struct HexLoader {
+    uint8_t record[5 + 255]; // the record being read in, as binary
+    uint16_t recordSize; // bytes of it read so far
+    int8_t nibble; // high digit of the byte being read, -1 = none
+    bool inRecord; // between a ':' and the end of its record
+    bool finished; // the end record was seen or there was an error, so the rest is ignored
+    uint16_t addrHi; // upper address from the last type 4 record
+    uint16_t row; // word address of the row being gathered, 0xFFFF = none
+    uint8_t rowWords; // words up to the last one given in the row
+    uint8_t rowData[PIC_ROW_WORDS * 2]; // little endian
+    uint8_t rowsSeen[PIC_FLASH_WORDS / PIC_ROW_WORDS / 8]; // bitmap of rows already sent
+};
+
+static HexLoader hexLoader;
+std::atomic<bool> picFlashing(false); // the chips are in their bootloaders, so core 1 must stay off the bus
+static uint16_t picRowsWritten = 0;
+static uint8_t picCommand; // the SysEx command that's flashing the chips
+static uint64_t picLastRow; // when the last row was written
+static PicHashes picHashes; // written by core 0 while flashing, saved by core 1 afterwards
+
+void sendSysEx(const uint8_t * data, size_t len);
+void flushMidiOutput();
+
+static uint32_t picRowHash(const uint8_t * data, uint8_t words) {
+    return psgCRC32(psgCRC32(0, &words, 1), data, words * 2);
+}
+
+static void loadPicHashes() {
+    memcpy(&picHashes, hal_flash_read(PIC_HASH_FLASH_OFFSET), sizeof(picHashes));
+    if (picHashes.magic != PIC_HASH_MAGIC || psgCRC32(0, (const uint8_t*)picHashes.known, sizeof(picHashes.known) + sizeof(picHashes.hashes)) != picHashes.crc)
+        memset(&picHashes, 0, sizeof(picHashes));
+}
+
+// Only core 1 can write to flash, so these are called from there.
+static void erasePicHashes() {
+    hal_flash_erase(PIC_HASH_FLASH_OFFSET, HAL_FLASH_SECTOR_SIZE);
+}
+
+// Saves the table a page at a time, so it doesn't need a buffer its size.
+static void savePicHashes() {
+    uint8_t page[HAL_FLASH_PAGE_SIZE];
+    picHashes.magic = PIC_HASH_MAGIC;
+    picHashes.crc = psgCRC32(0, (const uint8_t*)picHashes.known, sizeof(picHashes.known) + sizeof(picHashes.hashes));
+    erasePicHashes();
+    for (size_t offset = 0; offset < sizeof(picHashes); offset += HAL_FLASH_PAGE_SIZE) {
+        memset(page, 0xFF, HAL_FLASH_PAGE_SIZE);
+        memcpy(page, (const uint8_t*)&picHashes + offset, min(sizeof(picHashes) - offset, (size_t)HAL_FLASH_PAGE_SIZE));
+        hal_flash_program(PIC_HASH_FLASH_OFFSET + offset, page, HAL_FLASH_PAGE_SIZE);
+    }
+}
+
+static void sendFlashStatus(uint8_t command, FlashStatus status) {
+    const uint8_t msg[] = {0xF0, 0x00, 0x46, 0x71, command, 0x00, (uint8_t)status, (uint8_t)(picRowsWritten & 0x7F), (uint8_t)(picRowsWritten >> 7), 0xF7};
+    sendSysEx(msg, sizeof(msg));
+    flushMidiOutput();
+}
+
+static void picEnterBootloader() {
+    hal_mutex_enter(&bus_lock);
+    picFlashing = true;
+    chipResets = chipResets.load() + 1;
+    hal_gpio_put(PICO_DEFAULT_LED_PIN, false);
+    // flip all chips into bootloader mode
+    hal_gpio_put(PIN_DATA, true);
+    hal_sleep_us(1);
+    hal_gpio_put(PIN_CLOCK, true);
+    hal_sleep_us(1);
+    hal_gpio_put(PIN_CLOCK, false);
+    hal_sleep_us(1);
+    hal_gpio_put(PIN_DATA, false);
+    hal_sleep_us(1);
+    for (int i = 0; i < NUM_CHANNELS; i++) {
+        hal_gpio_put(PIN_STROBE, true);
+        hal_sleep_us(1);
+        hal_gpio_put(PIN_STROBE, false);
+        hal_gpio_put(PIN_CLOCK, true);
+        hal_sleep_us(1);
+        hal_gpio_put(PIN_CLOCK, false);
+        hal_sleep_us(1);
+    }
+    hal_gpio_put(PIN_STROBE, true);
+    hal_sleep_us(1);
+    hal_gpio_put(PIN_STROBE, false);
+    channels[0].isLowFreq = true; // run slower for safety
+    write_data(0, 0xFF); // system command
+    write_data(0, 0x01); // enter bootloader
+    hal_mutex_exit(&bus_lock);
+}
+
+// Sends one row to the bootloaders for a command, putting the chips in them
+// first if needed. Words past the end of a short row are left erased.
+static void picWriteRow(uint8_t command, uint16_t addr, const uint8_t * data, uint8_t words) {
+    if (addr < PIC_BOOTLOADER_WORDS) return; // don't overwrite bootloader
+    picCommand = command;
+    if (!picFlashing) {
+        picRowsWritten = 0;
+        picEnterBootloader();
+        // the saved hashes have to go before any row changes, or a flash that
+        // doesn't finish would leave them vouching for rows that aren't there, so
+        // this can't be dropped; the packet that got here was only read with room
+        // in the ring, but wait for core 1 to make some if it ever isn't
+        while (!events.push({EventType::PicHashes, 0, 0, 0, (uint32_t)hal_time_us()})) {
+            hal_event_signal();
+            hal_sleep_us(100);
+        }
+        hal_event_signal();
+    }
+    hal_mutex_enter(&bus_lock);
+    write_data(0, words << 1);
+    write_data(0, addr >> 7);
+    write_data(0, addr << 1);
+    write_data(0, 0); // write data
+    hal_sleep_ms(5); // wait for erase
+    for (int j = 0; j < words * 2; j++) write_data(0, data[j]);
+    hal_sleep_ms(5); // wait for write
+    write_data(0, 0); // checksum is ignored
+    hal_mutex_exit(&bus_lock);
+    picRowsWritten++;
+    picLastRow = hal_time_us();
+    uint8_t row = addr / PIC_ROW_WORDS;
+    picHashes.hashes[row] = picRowHash(data, words);
+    picHashes.known[row / 32] |= 1u << (row % 32);
+}
+
+// Ends the flash. If the chips were put in their bootloaders, they're sent the
+// end code so they reset, and the device reboots to start over with them; if
+// all went well, core 1 saves the row hashes first and does the reboot itself.
+// If no rows needed writing, the chips are left alone.
+static void picFinish(uint8_t command, FlashStatus status) {
+    if (picFlashing) {
+        hal_mutex_enter(&bus_lock);
+        write_data(0, 0);
+        write_data(0, 0);
+        write_data(0, 0);
+        write_data(0, 1);
+        write_data(0, 0xFF);
+        hal_mutex_exit(&bus_lock);
+    }
+    sendFlashStatus(command, status);
+    if (picFlashing && status == FlashStatus::Done && events.push({EventType::PicHashes, 0, 1, 0, (uint32_t)hal_time_us()})) {
+        hal_event_signal();
+    } else if (picFlashing) {
+        hal_sleep_ms(5); // let the reply go out
+        hal_reboot_watchdog();
+    }
+}
+
+// Gives up on a flash whose host has stopped sending rows, so the chips don't
+// sit in their bootloaders until someone power cycles the board. There's no
+// status for this, but the host has most likely gone anyway.
+void picCheckTimeout() {
+    if (!picFlashing || hal_time_us() - picLastRow < PIC_FLASH_TIMEOUT) return;
+    if (picCommand == 0x00) hexLoader.finished = true;
+    picFinish(picCommand, FlashStatus::BadRecord);
+}
+
+static void hexFinish(FlashStatus status) {
+    hexLoader.finished = true;
+    picFinish(0x00, status);
+}
+
+// Sends the buffered row, if there is one.
+static void hexWriteRow() {
+    uint16_t addr = hexLoader.row;
+    if (addr == 0xFFFF) return;
+    hexLoader.row = 0xFFFF;
+    hexLoader.rowsSeen[addr / PIC_ROW_WORDS / 8] |= 1 << (addr / PIC_ROW_WORDS % 8);
+    if (addr < PIC_BOOTLOADER_WORDS) return;
+    picWriteRow(0x00, addr, hexLoader.rowData, hexLoader.rowWords);
+    sendFlashStatus(0x00, FlashStatus::Progress);
+}
+
+static void hexRecord() {
+    const uint8_t * record = hexLoader.record;
+    uint8_t sum = 0;
+    for (int i = 0; i < hexLoader.recordSize; i++) sum += record[i];
+    if (sum != 0) {
+        hexFinish(FlashStatus::BadChecksum);
+        return;
+    }
+    uint8_t bc = record[0];
+    uint16_t addr = (record[1] << 8 | record[2]) >> 1;
+    switch (record[3]) {
+        case 0:
+            if (hexLoader.addrHi != 0) break; // config words are left alone
+            for (int i = 0; i < bc / 2; i++) {
+                uint16_t word = addr + i;
+                if (word >= PIC_FLASH_WORDS) break;
+                uint16_t row = word & ~(PIC_ROW_WORDS - 1);
+                if (row != hexLoader.row) {
+                    hexWriteRow();
+                    if (hexLoader.rowsSeen[row / PIC_ROW_WORDS / 8] & (1 << (row / PIC_ROW_WORDS % 8))) {
+                        hexFinish(FlashStatus::OutOfOrder);
+                        return;
                     }
+                    hexLoader.row = row;
+                    hexLoader.rowWords = 0;
+                    memset(hexLoader.rowData, 0, sizeof(hexLoader.rowData));
                 }
-                // send end code
-                write_data(0, 0);
-                write_data(0, 0);
-                write_data(0, 0);
-                write_data(0, 1);
-                write_data(0, 0xFF);
-                // notify host
-                MidiPacket p = {0x0F, 0xFF, 0, 0};
-                tud_midi_packet_write((uint8_t*)&p);
-                sleep_ms(5); // is this needed?
-                // reset
-                //(*((volatile uint32_t*)(PPB_BASE + 0x0ED0C))) = 0x5FA0004;
-                // we should be done by now, but just in case:
-                watchdog_enable(1, 1);
-                while (true);
+                hexLoader.rowData[(word - row) * 2] = record[4 + i*2];
+                hexLoader.rowData[(word - row) * 2 + 1] = record[5 + i*2];
+                if (word - row >= hexLoader.rowWords) hexLoader.rowWords = word - row + 1;
             }
-            case 4: {
-                int haddr_h = htob(&data, end);
-                if (haddr_h == -1) return -9;
-                int haddr = htob(&data, end);
-                if (haddr == -1) return -10;
-                addr_hi = (haddr_h << 8) | haddr;
+            break;
+        case 1:
+            hexWriteRow();
+            hexFinish(FlashStatus::Done);
+            break;
+        case 4:
+            hexLoader.addrHi = record[4] << 8 | record[5];
+            break;
+        case 2: case 3: case 5: break;
+        default: hexFinish(FlashStatus::BadRecord); break;
+    }
+}
+
+static void hexStart() {
+    memset(&hexLoader, 0, sizeof(hexLoader));
+    hexLoader.nibble = -1;
+    hexLoader.row = 0xFFFF;
+}
+
+// Reads one character of the HEX file.
+static void hexChar(char c) {
+    if (hexLoader.finished) return;
+    if (c == ':') {
+        if (hexLoader.inRecord) {
+            hexFinish(FlashStatus::BadRecord);
+            return;
+        }
+        hexLoader.inRecord = true;
+        hexLoader.recordSize = 0;
+        hexLoader.nibble = -1;
+        return;
+    } else if (!hexLoader.inRecord) return; // line endings and anything else between records
+    int8_t n;
+    if (c >= '0' && c <= '9') n = c - '0';
+    else if (c >= 'A' && c <= 'F') n = c - 'A' + 10;
+    else if (c >= 'a' && c <= 'f') n = c - 'a' + 10;
+    else {
+        hexFinish(FlashStatus::BadRecord);
+        return;
+    }
+    if (hexLoader.nibble < 0) {
+        hexLoader.nibble = n;
+        return;
+    }
+    hexLoader.record[hexLoader.recordSize++] = hexLoader.nibble << 4 | n;
+    hexLoader.nibble = -1;
+    if (hexLoader.recordSize >= 5 && hexLoader.recordSize == hexLoader.record[0] + 5) {
+        hexLoader.inRecord = false;
+        hexRecord();
+    }
+}
+
+// Called at the end of the SysEx; a file that stops before its end record
+// still has to take the chips out of their bootloaders.
+static void hexEnd() {
+    if (!hexLoader.finished) hexFinish(FlashStatus::BadRecord);
+}
+
+// Writes a binary block of rows whose CRC has already been checked: the row
+// count, 3 reserved bytes, then for each row its word address (2 bytes), word
+// count (1 byte) and words, all little endian. A block with no rows ends the flash.
+static void loadPicBlock(const uint8_t * data, size_t size) {
+    uint8_t count = data[0];
+    size_t pos = 4;
+    int i;
+    for (i = 0; i < count; i++) {
+        if (pos + 3 > size) break;
+        uint16_t addr = data[pos] | (data[pos+1] << 8);
+        uint8_t words = data[pos+2];
+        if (addr % PIC_ROW_WORDS || addr >= PIC_FLASH_WORDS || words == 0 || words > PIC_ROW_WORDS) break;
+        pos += 3 + words * 2;
+    }
+    if (i < count || pos != size) {
+        // the host doesn't send a rejected block again, so don't leave the
+        // chips waiting in their bootloaders for the rest
+        picFinish(0x08, FlashStatus::BadRecord);
+        return;
+    }
+    if (count == 0) {
+        picFinish(0x08, FlashStatus::Done);
+        return;
+    }
+    for (pos = 4; pos < size; pos += 3 + data[pos+2] * 2)
+        picWriteRow(0x08, data[pos] | (data[pos+1] << 8), data + pos + 3, data[pos+2]);
+    sendFlashStatus(0x08, FlashStatus::Progress);
+}
+
+// Compares a manifest whose CRC has already been checked against the saved
+// hashes: the row count, 3 reserved bytes, then for each row its word address
+// (2 bytes) and hash (4 bytes), little endian. The reply has a bit set for
+// each row that has to be sent, 7 rows to a byte.
+static void loadPicManifest(const uint8_t * data, size_t size) {
+    uint8_t msg[8 + (PIC_ROWS + 6) / 7] = {0xF0, 0x00, 0x46, 0x71, 0x0A, 0x00, (uint8_t)FlashStatus::Progress};
+    uint8_t count = data[0];
+    if (size != 4 + count * 6u) {
+        sendFlashStatus(0x0A, FlashStatus::BadRecord);
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        const uint8_t * entry = data + 4 + i * 6;
+        uint16_t addr = entry[0] | (entry[1] << 8);
+        uint32_t hash = entry[2] | (entry[3] << 8) | (entry[4] << 16) | ((uint32_t)entry[5] << 24);
+        if (addr % PIC_ROW_WORDS || addr >= PIC_FLASH_WORDS) {
+            sendFlashStatus(0x0A, FlashStatus::BadRecord);
+            return;
+        }
+        uint8_t row = addr / PIC_ROW_WORDS;
+        if (addr >= PIC_BOOTLOADER_WORDS && (!(picHashes.known[row / 32] & (1u << (row % 32))) || picHashes.hashes[row] != hash))
+            msg[7 + row / 7] |= 1 << (row % 7);
+    }
+    msg[sizeof(msg) - 1] = 0xF7;
+    sendSysEx(msg, sizeof(msg));
+}
+
+// Divides, rounding towards minus infinity.
+static int64_t floorDiv(int64_t a, int32_t b) {
+    return a / b - (a % b < 0);
+}
+
+// Finds envelope e (volume, pan, frequency, duty) of a patch in pointPool.
+static const Point * envelopePoints(const Instrument * inst, int e) {
+    uint16_t offset = patchStart[inst - patches];
+    if (e > 0) offset += inst->volume.npoints;
+    if (e > 1) offset += inst->pan.npoints;
+    if (e > 2) offset += inst->frequency.npoints;
+    return &pointPool[offset];
+}
+
+// Sets a voice's envelope level to its exact value `offset` ticks on from point
+// p, and works out the slope of the segment from p to the next point, so the
+// tick only has to divide when it reaches a point. Slopes are rounded down, and
+// the remainder of the division is kept alongside them, so levels can be stepped
+// exactly.
+static void setLevel(ChannelInfo * info, int e, const Envelope * env, uint8_t p, int32_t offset) {
+    const Point * points = envelopePoints(info->inst, e);
+    int32_t dx = p + 1 < env->npoints ? points[p+1].x - points[p].x : 0;
+    info->level[e] = (uint32_t)points[p].y << 16;
+    info->levelRem[e] = 0;
+    info->slope[e] = 0;
+    info->slopeRem[e] = 0;
+    if (dx > 0) {
+        int64_t dy = ((int64_t)points[p+1].y - points[p].y) * 65536;
+        int64_t slope = floorDiv(dy, dx);
+        info->slopeRem[e] = dy - slope * dx;
+        // only a one-tick segment can be this steep, and it never accumulates
+        info->slope[e] = slope > INT32_MAX ? INT32_MAX : slope < INT32_MIN ? INT32_MIN : (int32_t)slope;
+        if (offset != 0) {
+            int64_t whole = floorDiv(dy * offset, dx);
+            info->level[e] += (uint32_t)whole;
+            info->levelRem[e] = dy * offset - whole * dx;
+        }
+    }
+}
+
+// Puts every envelope of a voice back at its first point.
+static void startEnvelopes(ChannelInfo * info) {
+    const Envelope * envs[4] = {&info->inst->volume, &info->inst->pan, &info->inst->frequency, &info->inst->duty};
+    for (int e = 0; e < 4; e++) {
+        info->points[e] = 0;
+        info->ticks[e] = 0;
+        if (envs[e]->npoints == 0) {
+            info->level[e] = 0;
+            info->levelRem[e] = 0;
+            info->slope[e] = 0;
+            info->slopeRem[e] = 0;
+        } else setLevel(info, e, envs[e], 0, -(int32_t)envelopePoints(info->inst, e)[0].x);
+    }
+    info->phase = 0;
+}
+
+// Replaces patch n. The pool is kept compact by moving the points of the
+// patches after it up or down to fit the new ones exactly. Returns false,
+// leaving the old patch in place, if the new points don't fit.
+static bool storePatch(uint8_t n, const Envelope * envs, const Point * const * points, const uint8_t * waveTypes) {
+    Envelope * dest[4] = {&patches[n].volume, &patches[n].pan, &patches[n].frequency, &patches[n].duty};
+    uint16_t start = patchStart[n];
+    uint16_t end = n < 127 ? patchStart[n+1] : pointPoolUsed;
+    uint16_t size = 0;
+    for (int e = 0; e < 4; e++) size += envs[e].npoints;
+    if (pointPoolUsed - (end - start) + size > POINT_POOL_SIZE) return false;
+    if (start + size != end) {
+        memmove(&pointPool[start + size], &pointPool[end], (pointPoolUsed - end) * sizeof(Point));
+        for (int i = n + 1; i < 128; i++) patchStart[i] += start + size - end;
+        pointPoolUsed += start + size - end;
+    }
+    for (int e = 0; e < 4; e++) {
+        *dest[e] = envs[e];
+        if (envs[e].npoints) memcpy(&pointPool[start], points[e], envs[e].npoints * sizeof(Point));
+        start += envs[e].npoints;
+    }
+    patches[n].waveType = waveTypes[0];
+    // the old points are gone, so voices playing this patch start it over
+    for (int c = 0; c < NUM_CHANNELS; c++)
+        if (channels[c].inst == &patches[n]) startEnvelopes(&channels[c]);
+    return true;
+}
+
+// Reads a patch into slot n and returns the number of bytes it took up, or 0
+// if it's malformed or doesn't fit. Format 0 is the fixed 212-byte layout with
+// room for 12 points in each envelope; format 1 gives each envelope its 4 header
+// bytes followed by only the points it uses.
+static size_t parsePatch(uint8_t n, const uint8_t * data, size_t size, uint8_t format) {
+    Envelope envs[4];
+    const Point * points[4];
+    size_t pos = 0;
+    for (int e = 0; e < 4; e++) {
+        const uint8_t * header;
+        if (format == 0) {
+            points[e] = (const Point*)(data + e * 52);
+            header = data + e * 52 + 48;
+            pos += 52;
+        } else {
+            if (pos + 4 > size) return 0;
+            header = data + pos;
+            points[e] = (const Point*)(header + 4);
+            pos += 4 + header[0] * sizeof(Point);
+        }
+        envs[e].npoints = header[0];
+        envs[e].sustain = header[1];
+        envs[e].loopStart = header[2];
+        envs[e].loopEnd = header[3];
+        if (format == 0 && envs[e].npoints > 12) return 0;
+    }
+    if (pos + 4 > size) return 0;
+    if (!storePatch(n, envs, points, data + pos)) return 0;
+    return pos + 4;
+}
+
+// Empties every patch, so a whole bank can be stored without the old one
+// taking up pool space part of the way through.
+static void clearPatches() {
+    for (int i = 0; i < 128; i++) {
+        patches[i] = Instrument();
+        patchStart[i] = 0;
+    }
+    pointPoolUsed = 0;
+}
+
+static void loadDefaultPatches() {
+    clearPatches();
+    for (uint8_t i = 0; i < 128; i++) {
+        // a one-point duty envelope holds each program's default duty
+        Envelope envs[4];
+        Point duty = {0, i == 0 ? (uint16_t)64 : (uint16_t)i};
+        const Point * points[4] = {NULL, NULL, NULL, &duty};
+        uint8_t waveTypes[4] = {i % 8 == 0 ? (uint8_t)5 : (uint8_t)(i % 8), 0, 0, 0};
+        envs[3].npoints = (i == 0 || i % 8 == 5) ? 0 : 1;
+        envs[3].sustain = 0;
+        storePatch(i, envs, points, waveTypes);
+    }
+}
+
+/*
+ * The bank is kept in a log at the end of flash. Each commit appends a record
+ * holding all 128 patches in the variable-length upload format, starting on a
+ * page boundary, and the newest record with a good CRC is loaded at boot. The
+ * log wraps around once it reaches the end, erasing sectors only as it moves
+ * into them, so every sector wears at the same rate. A record's header is
+ * programmed after the rest of it, so a commit cut short by a power loss is
+ * never seen and the previous bank stays in place.
+ */
+
+#define BANK_FLASH_SIZE 0x10000
+#define BANK_FLASH_OFFSET (HAL_FLASH_SIZE - BANK_FLASH_SIZE)
+#define BANK_MAGIC 0x42475350 // "PSGB"
+#define BANK_MAX_SIZE (128 * 20 + POINT_POOL_SIZE * sizeof(Point))
+
+struct BankHeader {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t size; // bytes of patch data after the header
+    uint32_t crc; // CRC-32 of the patch data
+};
+
+static uint32_t bankHead = 0; // offset in the log where the next record goes
+static uint32_t bankSequence = 0; // sequence number of the newest record, 0 = none
+static uint32_t bankSize = 0, bankCRC = 0; // size and CRC of the newest record
+
+// Gathers a record a page at a time, so it never has to be held in RAM whole.
+struct BankWriter {
+    uint32_t offset; // in the log
+    uint32_t crc;
+    uint16_t fill;
+    bool program; // false to only work out the CRC
+    uint8_t page[HAL_FLASH_PAGE_SIZE];
+};
+
+static void bankFlushPage(BankWriter * w) {
+    if (w->program) {
+        if (w->offset % HAL_FLASH_SECTOR_SIZE == 0) hal_flash_erase(BANK_FLASH_OFFSET + w->offset, HAL_FLASH_SECTOR_SIZE);
+        hal_flash_program(BANK_FLASH_OFFSET + w->offset, w->page, HAL_FLASH_PAGE_SIZE);
+    }
+    w->offset += HAL_FLASH_PAGE_SIZE;
+    w->fill = 0;
+    memset(w->page, 0xFF, HAL_FLASH_PAGE_SIZE);
+}
+
+static void bankWrite(BankWriter * w, const void * data, size_t size) {
+    const uint8_t * p = (const uint8_t*)data;
+    w->crc = psgCRC32(w->crc, p, size);
+    while (size) {
+        size_t n = min(size, (size_t)(HAL_FLASH_PAGE_SIZE - w->fill));
+        memcpy(w->page + w->fill, p, n);
+        w->fill += n;
+        p += n;
+        size -= n;
+        if (w->fill == HAL_FLASH_PAGE_SIZE) bankFlushPage(w);
+    }
+}
+
+static void bankWritePatches(BankWriter * w) {
+    for (int i = 0; i < 128; i++) {
+        const Envelope * envs[4] = {&patches[i].volume, &patches[i].pan, &patches[i].frequency, &patches[i].duty};
+        for (int e = 0; e < 4; e++) {
+            const uint8_t header[4] = {envs[e]->npoints, envs[e]->sustain, envs[e]->loopStart, envs[e]->loopEnd};
+            bankWrite(w, header, 4);
+            bankWrite(w, envelopePoints(&patches[i], e), envs[e]->npoints * sizeof(Point));
+        }
+        const uint8_t waveTypes[4] = {patches[i].waveType, 0, 0, 0};
+        bankWrite(w, waveTypes, 4);
+    }
+}
+
+// Writes the current patches to flash as the newest record. Does nothing if
+// they're the same as what's already there, to save wear.
+static void commitBank() {
+    BankWriter w;
+    uint32_t size = 128 * 20 + pointPoolUsed * sizeof(Point);
+    w.offset = 0;
+    w.crc = 0;
+    w.fill = 0;
+    w.program = false;
+    bankWritePatches(&w);
+    if (bankSequence && size == bankSize && w.crc == bankCRC) return;
+    uint32_t crc = w.crc;
+    // a commit that was cut short may have left pages programmed past the
+    // newest record; skip to a fresh sector rather than write over them
+    uint32_t head = bankHead;
+    if (head % HAL_FLASH_SECTOR_SIZE) {
+        const uint8_t * p = hal_flash_read(BANK_FLASH_OFFSET + head);
+        for (uint32_t i = 0; i < HAL_FLASH_SECTOR_SIZE - head % HAL_FLASH_SECTOR_SIZE; i++) {
+            if (p[i] != 0xFF) {
+                head += HAL_FLASH_SECTOR_SIZE - head % HAL_FLASH_SECTOR_SIZE;
                 break;
             }
-            default: return -11;
         }
-        htob(&data, end); // checksum
     }
-    return -12;
+    if (head + sizeof(BankHeader) + size > BANK_FLASH_SIZE) head = 0;
+    w.offset = head;
+    w.crc = 0;
+    w.fill = sizeof(BankHeader);
+    w.program = true;
+    memset(w.page, 0xFF, HAL_FLASH_PAGE_SIZE);
+    bankWritePatches(&w);
+    if (w.fill) bankFlushPage(&w);
+    BankHeader header = {BANK_MAGIC, bankSequence + 1, size, crc};
+    memset(w.page, 0xFF, HAL_FLASH_PAGE_SIZE);
+    memcpy(w.page, &header, sizeof(header));
+    hal_flash_program(BANK_FLASH_OFFSET + head, w.page, HAL_FLASH_PAGE_SIZE);
+    bankSequence++;
+    bankSize = size;
+    bankCRC = crc;
+    bankHead = w.offset;
 }
 
-void tud_midi_rx_cb(uint8_t itf) {
-    mutex_enter_blocking(&command_queue_lock);
-    while (tud_midi_available()) {
-        MidiPacket packet;
-        tud_midi_packet_read((uint8_t*)&packet);
-        if ((packet.usbcode & 0x0C) == 0x04) {
-            // sysex
-            if (inSysEx == 0) { // start
-                if (packet.command == 0xF0 && packet.param1 == 0x00 && packet.param2 == 0x46) inSysEx = 0xFE;
-                else inSysEx = 0xFF;
-            } else if (inSysEx == 0xFE) { // packet header
-                if (packet.command != 0x71) {
-                    inSysEx = 0xFF;
-                    continue;
-                }
-                inSysEx = packet.param1 + 1;
-                // ignore param2
-                if (inSysEx == 1 || inSysEx == 3) {
-                    memset(hex_storage, 0, 0x4000);
-                    hex_storage_size = 0;
-                } else if (inSysEx == 2) {
-                    // boot to bootloader
-                    reset_usb_boot(1 << PICO_DEFAULT_LED_PIN, 0); // no return
-                }
-            } else if (inSysEx == 1) {
-                // flash PIC chips - load HEX
-                uint8_t s = packet.usbcode & 0x03;
-                if (s != 1) hex_storage[hex_storage_size++] = packet.command;
-                if (s == 0 || s == 3) hex_storage[hex_storage_size++] = packet.param1;
-                if (s == 0) hex_storage[hex_storage_size++] = packet.param2;
-                if (s != 0) {
-                    inSysEx = 0;
-                    loadhex(hex_storage, hex_storage_size);
-                }
-            } else if (inSysEx == 3) {
-                // load instrument envelope
-                uint8_t s = packet.usbcode & 0x03;
-                if (s != 1) hex_storage[hex_storage_size++] = packet.command;
-                if (s == 0 || s == 3) hex_storage[hex_storage_size++] = packet.param1;
-                if (s == 0) hex_storage[hex_storage_size++] = packet.param2;
-                if (s != 0) {
-                    inSysEx = 0;
-                    base64_decode((const uint8_t*)hex_storage + 1, hex_storage_size - 1, (uint8_t*)&patches[hex_storage[0]], sizeof(Instrument) + 3);
+// Loads the newest good record in the log. Returns false if there isn't one,
+// or if it couldn't be read, in which case the patches are left empty.
+static bool loadBank() {
+    const BankHeader * best = NULL;
+    uint32_t bestOffset = 0;
+    for (uint32_t offset = 0; offset < BANK_FLASH_SIZE; offset += HAL_FLASH_PAGE_SIZE) {
+        const BankHeader * header = (const BankHeader*)hal_flash_read(BANK_FLASH_OFFSET + offset);
+        if (header->magic != BANK_MAGIC || header->size > BANK_MAX_SIZE || offset + sizeof(BankHeader) + header->size > BANK_FLASH_SIZE) continue;
+        if (best != NULL && (int32_t)(header->sequence - best->sequence) <= 0) continue;
+        if (psgCRC32(0, (const uint8_t*)(header + 1), header->size) != header->crc) continue;
+        best = header;
+        bestOffset = offset;
+    }
+    if (best == NULL) return false;
+    bankSequence = best->sequence;
+    bankSize = best->size;
+    bankCRC = best->crc;
+    bankHead = (bestOffset + sizeof(BankHeader) + best->size + HAL_FLASH_PAGE_SIZE - 1) / HAL_FLASH_PAGE_SIZE * HAL_FLASH_PAGE_SIZE;
+    clearPatches();
+    const uint8_t * data = (const uint8_t*)(best + 1);
+    size_t pos = 0;
+    for (int i = 0; i < 128; i++) {
+        size_t n = parsePatch(i, data + pos, best->size - pos, 1);
+        if (n == 0) return false;
+        pos += n;
+    }
+    return true;
+}
+
+// Stores count patches from slot first onwards, given back to back in the
+// variable-length format. Either all of them are stored or none are.
+static BlockStatus loadPatchBlock(uint8_t first, uint8_t count, const uint8_t * data, size_t size) {
+    if (count == 0 || first + count > 128) return BlockStatus::Malformed;
+    size_t pos = 0, points = 0;
+    for (int i = 0; i < count; i++) {
+        for (int e = 0; e < 4; e++) {
+            if (pos + 4 > size) return BlockStatus::Malformed;
+            points += data[pos];
+            pos += 4 + data[pos] * sizeof(Point);
+        }
+        pos += 4;
+    }
+    if (pos != size) return BlockStatus::Malformed;
+    uint16_t start = patchStart[first];
+    uint16_t end = first + count < 128 ? patchStart[first + count] : pointPoolUsed;
+    if (pointPoolUsed - (end - start) + points > POINT_POOL_SIZE) return BlockStatus::NoRoom;
+    // empty the slots first, so the pool never has to hold the old and new patches at once
+    Envelope envs[4];
+    const Point * none[4] = {NULL, NULL, NULL, NULL};
+    const uint8_t waveTypes[4] = {0, 0, 0, 0};
+    for (int i = first; i < first + count; i++) storePatch(i, envs, none, waveTypes);
+    pos = 0;
+    for (int i = first; i < first + count; i++) pos += parsePatch(i, data + pos, size - pos, 1);
+    return BlockStatus::OK;
+}
+
+void handleEvent(const VoiceEvent& ev) {
+    uint8_t channel = ev.channel;
+    switch (ev.type) {
+    case EventType::NoteOn: {
+        if (ev.param2) {
+            if (midiMode) {
+                if (midiChannels[channel][ev.param1] < NUM_CHANNELS) {
+                    uint8_t c = midiChannels[channel][ev.param1];
+                    channels[c].amplitude = AMPLITUDE(ev.param2);
+                    break;
                 }
-            } else { // unrecognized vendor/command
-                if (packet.usbcode & 0x03) inSysEx = 0;
+                uint8_t c = allocateVoice(channel, ev.param1);
+                if (c == 0xFF) break;
+                midiUsedChannels[c] = channel;
+                mapVoice(channel, ev.param1, c);
+                channels[c].amplitude = AMPLITUDE(ev.param2);
+                channels[c].increment = noteTable[ev.param1 & 0x7F];
+                channels[c].bend = midiBend[channel];
+                channels[c].wavetype = (WaveType)patches[midiPrograms[channel]].waveType;
+                channels[c].note = ev.param1;
+                channels[c].fadeStart = 0;
+                channels[c].inst = &patches[midiPrograms[channel]];
+                startEnvelopes(&channels[c]);
+                channels[c].release = false;
+                if (channels[c].wavetype == WaveType::Square) channels[c].duty = midiDuty[channel];
+                writeWaveType(c, channels[c].wavetype, midiDuty[channel]);
+            } else {
+                channels[channel].amplitude = AMPLITUDE(ev.param2);
+                channels[channel].increment = noteTable[ev.param1 & 0x7F];
+                channels[channel].fadeStart = 0; 
+                writeFrequency(channel, pitchScale(channels[channel].increment, channels[channel].bend));
+                writeVolume(channel, ev.param2);
             }
-            continue;
+            break;
         }
-        uint8_t channel = packet.command & 0x0F;
-        switch (packet.command & 0xF0) {
-        case 0x90: { // note on
-            if (packet.param2) {
-                if (midiMode) {
-                    if (midiChannels[channel][packet.param1] < NUM_CHANNELS) {
-                        uint8_t c = midiChannels[channel][packet.param1];
-                        channels[c].amplitude = packet.param2 / 127.5;
-                        break;
-                    }
-                    for (int c = 0; c < NUM_CHANNELS; c++) {
-                        if (midiUsedChannels[c] == 0xFF && channels[c].inst == NULL) {
-                            midiUsedChannels[c] = channel;
-                            midiChannels[channel][packet.param1] = c;
-                            uint16_t freq = (uint16_t)floor(pow(2.0, ((double)packet.param1 - 69.0) / 12.0) * 440.0 + 0.5);
-                            channels[c].amplitude = packet.param2 / 127.5;
-                            channels[c].frequency = freq;
-                            channels[c].wavetype = (WaveType)patches[midiPrograms[channel]].waveTypes[0];
-                            channels[c].note = packet.param1;
-                            channels[c].fadeStart = 0;
-                            channels[c].inst = &patches[midiPrograms[channel]];
-                            channels[c].points[0] = channels[c].points[1] = channels[c].points[2] = channels[c].points[3] = 0;
-                            channels[c].ticks[0] = channels[c].ticks[1] = channels[c].ticks[2] = channels[c].ticks[3] = 0;
-                            channels[c].release = false;
-                            if (channels[c].wavetype == WaveType::Square) channels[c].duty = midiDuty[channel] / 255.0;
-                            writeWaveType(c, channels[c].wavetype, midiDuty[channel]);
-                            break;
-                        }
-                    }
-                } else {
-                    uint16_t freq = (uint16_t)floor(pow(2.0, (packet.param1 - 69.0) / 12.0) * 440 + 0.5);
-                    channels[channel].amplitude = packet.param2 / 127.5;
-                    channels[channel].frequency = freq;
-                    channels[channel].fadeStart = 0; 
-                    writeFrequency(channel, freq);
-                    writeVolume(channel, packet.param2);
-                }
-                break;
-            } // fall through
-        } case 0x80: { // note off
-            if (packet.param2 == 0 || packet.param2 == 127) {
-                if (midiMode) {
-                    if (midiChannels[channel][packet.param1] < NUM_CHANNELS) {
-                        uint8_t c = midiChannels[channel][packet.param1];
-                        if (channels[c].inst == NULL) {
-                            channels[c].amplitude = 0;
-                            channels[c].fadeStart = 0;
-                            writeVolume(c, 0);
-                        } else {
-                            channels[c].release = true;
-                        }
-                        midiUsedChannels[c] = 0xFF;
+        [[fallthrough]];
+    } case EventType::NoteOff: {
+        if (ev.param2 == 0 || ev.param2 == 127) {
+            if (midiMode) {
+                if (midiChannels[channel][ev.param1] < NUM_CHANNELS) {
+                    uint8_t c = midiChannels[channel][ev.param1];
+                    if (channels[c].inst == NULL) {
+                        channels[c].amplitude = 0;
+                        channels[c].fadeStart = 0;
+                        writeVolume(c, 0);
+                    } else {
+                        channels[c].release = true;
                     }
-                    midiChannels[channel][packet.param1] = 0xFF;
-                } else {
-                    channels[channel].amplitude = 0;
-                    channels[channel].fadeStart = 0;
-                    writeVolume(channel, 0);
+                    midiUsedChannels[c] = 0xFF;
+                    updateFreeVoice(c);
                 }
+                unmapVoice(channel, ev.param1);
             } else {
-                if (midiMode) {
-                    if (midiChannels[channel][packet.param1] < NUM_CHANNELS) {
-                        uint8_t c = midiChannels[channel][packet.param1];
-                        channels[c].fadeInit = channels[c].amplitude;
-                        channels[c].fadeStart = time_us_64();
-                        channels[c].fadeDirection = -1;
-                        channels[c].fadeLength = (127 - packet.param2) * (1000000/64);
-                        channels[c].inst = NULL;
-                    }
-                    midiChannels[channel][packet.param1] = 0xFF;
-                } else {
-                    channels[channel].fadeInit = channels[channel].amplitude;
-                    channels[channel].fadeStart = time_us_64();
-                    channels[channel].fadeDirection = -1;
-                    channels[channel].fadeLength = (127 - packet.param2) * (1000000/64);
-                }
+                channels[channel].amplitude = 0;
+                channels[channel].fadeStart = 0;
+                writeVolume(channel, 0);
             }
-            break;
-        } case 0xA0: { // polyphony aftertouch (volume change per note)
+        } else {
             if (midiMode) {
-                if (midiChannels[channel][packet.param1] < NUM_CHANNELS) {
-                    uint8_t c = midiChannels[channel][packet.param1];
-                    channels[c].amplitude = packet.param2 / 127.5;
-                    if (channels[c].inst == NULL || channels[c].inst->volume.npoints == 0) writeVolume(c, packet.param2);
+                if (midiChannels[channel][ev.param1] < NUM_CHANNELS) {
+                    uint8_t c = midiChannels[channel][ev.param1];
+                    channels[c].fadeInit = channels[c].amplitude;
+                    channels[c].fadeStart = (uint32_t)hal_time_us() | 1;
+                    channels[c].fadeDirection = -1;
+                    channels[c].fadeLength = (127 - ev.param2) * (1000000/64);
+                    channels[c].inst = NULL;
                 }
+                unmapVoice(channel, ev.param1);
             } else {
-                // just change whole channel volume
-                channels[channel].amplitude = packet.param2 / 127.5;
-                writeVolume(channel, packet.param2);
+                channels[channel].fadeInit = channels[channel].amplitude;
+                channels[channel].fadeStart = (uint32_t)hal_time_us() | 1;
+                channels[channel].fadeDirection = -1;
+                channels[channel].fadeLength = (127 - ev.param2) * (1000000/64);
             }
-            break;
-        } case 0xB0: { // control change
-            switch (packet.param1) {
-            case 1: { // square duty
-                if (midiMode) {
-                    midiDuty[channel] = packet.param2 * 2;
-                    if ((WaveType)patches[midiPrograms[channel]].waveTypes[0] == WaveType::Square) {
-                        for (int i = 0; i < 128; i++) {
-                            if (midiChannels[channel][i] < NUM_CHANNELS) {
-                                uint16_t c = midiChannels[channel][i];
-                                channels[c].duty = packet.param2 / 127.5;
-                                if (channels[c].inst == NULL || channels[c].inst->duty.npoints == 0) writeWaveType(c, WaveType::Square, midiDuty[channel]);
-                            }
-                        }
-                    }
-                } else {
-                    channels[channel].duty = packet.param2 / 127.5;
-                    if (channels[channel].wavetype == WaveType::Square) writeWaveType(channel, WaveType::Square, packet.param2 * 2);
-                }
-                break;
-            } case 7: { // volume
-                if (midiMode) {
-                    for (int i = 0; i < 128; i++) {
-                        if (midiChannels[channel][i] < NUM_CHANNELS) {
-                            uint16_t c = midiChannels[channel][i];
-                            channels[c].amplitude = packet.param2 / 127.5;
-                            channels[c].fadeStart = 0;
-                            if (channels[c].inst == NULL || channels[c].inst->volume.npoints == 0) {
-                                writeVolume(c, packet.param2);
-                            }
-                        }
-                    }
-                } else {
-                    channels[channel].amplitude = packet.param2 / 127.5;
-                    channels[channel].fadeStart = 0;
-                    writeVolume(channel, packet.param2);
-                }
-                break;
-            } case 10: { // pan
-                if (midiMode) {
-                    for (int i = 0; i < 128; i++) {
-                        if (midiChannels[channel][i] < NUM_CHANNELS) {
-                            uint16_t c = midiChannels[channel][i];
-                            channels[c].pan = (packet.param2 - 64.0) / (packet.param2 > 64 ? 63.0 : 64.0);
-                            if (channels[c].inst == NULL || channels[c].inst->volume.npoints == 0) {
-                                writeVolume(c, channels[c].amplitude * 127.5);
-                            }
-                        }
-                    }
-                } else {
-                    channels[channel].pan = (packet.param2 - 64.0) / (packet.param2 > 64 ? 63.0 : 64.0);
-                    writeVolume(channel, channels[channel].amplitude * 127.5);
-                }
-                break;
-            } case 24: { // frequency (MSB)
-                uint16_t freq = freq_lsb[channel] | ((uint16_t)packet.param2 << 7);
-                channels[channel].frequency = freq;
-                channels[channel].inst = NULL;
-                writeFrequency(channel, freq);
-                break;
-            } case 56: { // frequency (LSB)
-                freq_lsb[channel] = packet.param2;
-                uint16_t freq = freq_lsb[channel] | (channels[channel].frequency & 0xFF00);
-                channels[channel].frequency = freq;
-                channels[channel].inst = NULL;
-                writeFrequency(channel, freq);
-                break;
-            } case 86: { // stereo mode
-                stereo = packet.param2 & 0x40;
-                dualChannel = packet.param2 & 0x20;
-                if (version_minor >= 1) gpio_put(18, stereo);
-                break;
-            } case 123: { // all notes off
-                //if (!(packet.param2 & 0x40)) break;
-                if (midiMode) {
-                    for (int i = 0; i < 128; i++) {
-                        if (midiChannels[channel][i] < NUM_CHANNELS) {
-                            uint8_t c = midiChannels[channel][i];
-                            channels[c].amplitude = 0;
-                            channels[c].inst = NULL;
-                            writeVolume(c, 0);
-                            midiUsedChannels[c] = 0xFF;
-                        }
-                        midiChannels[channel][i] = 0xFF;
+        }
+        break;
+    } case EventType::PolyAftertouch: { // volume change per note
+        if (midiMode) {
+            if (midiChannels[channel][ev.param1] < NUM_CHANNELS) {
+                uint8_t c = midiChannels[channel][ev.param1];
+                channels[c].amplitude = AMPLITUDE(ev.param2);
+                if (channels[c].inst == NULL || channels[c].inst->volume.npoints == 0) writeVolume(c, ev.param2);
+            }
+        } else {
+            // just change whole channel volume
+            channels[channel].amplitude = AMPLITUDE(ev.param2);
+            writeVolume(channel, ev.param2);
+        }
+        break;
+    } case EventType::ControlChange: {
+        switch (ev.param1) {
+        case 1: { // square duty
+            if (midiMode) {
+                midiDuty[channel] = ev.param2 * 2;
+                if ((WaveType)patches[midiPrograms[channel]].waveType == WaveType::Square) {
+                    foreach_voice(c, channel) {
+                        channels[c].duty = ev.param2 * 2;
+                        if (channels[c].inst == NULL || channels[c].inst->duty.npoints == 0) writeWaveType(c, WaveType::Square, midiDuty[channel]);
                     }
-                    for (int i = 0; i < 16; i++) midiUsedChannels[i] = 0xFF;
-                } else {
-                    channels[channel].amplitude = 0;
-                    writeVolume(channel, 0);
                 }
-                break;
-            } case 126: { // mono mode
-                midiMode = false;
-                break;
-            } case 127: { // poly mode
-                midiMode = true;
-                break;
-            }
+            } else {
+                channels[channel].duty = ev.param2 * 2;
+                if (channels[channel].wavetype == WaveType::Square) writeWaveType(channel, WaveType::Square, ev.param2 * 2);
             }
             break;
-        } case 0xC0: { // program (wave type) change
+        } case 7: { // volume
             if (midiMode) {
-                midiPrograms[channel] = packet.param1;
-                for (int i = 0; i < 128; i++) {
-                    if (midiChannels[channel][i] < NUM_CHANNELS) {
-                        uint16_t c = midiChannels[channel][i];
-                        channels[c].wavetype = (WaveType)patches[midiPrograms[channel]].waveTypes[0];
-                        channels[c].fadeStart = 0;
-                        channels[c].inst = &patches[midiPrograms[channel]];
-                        channels[c].points[0] = channels[c].points[1] = channels[c].points[2] = channels[c].points[3] = 0;
-                        channels[c].ticks[0] = channels[c].ticks[1] = channels[c].ticks[2] = channels[c].ticks[3] = 0;
-                        channels[c].release = false;
-                        if (channels[c].wavetype == WaveType::Square) channels[c].duty = midiDuty[channel] / 255.0;
-                        writeWaveType(c, channels[c].wavetype, midiDuty[channel]);
+                foreach_voice(c, channel) {
+                    channels[c].amplitude = AMPLITUDE(ev.param2);
+                    channels[c].fadeStart = 0;
+                    if (channels[c].inst == NULL || channels[c].inst->volume.npoints == 0) {
+                        writeVolume(c, ev.param2);
                     }
                 }
             } else {
-                WaveType type = (WaveType)((packet.param1) & 7);
-                if (type == WaveType::None) {
-                    type = WaveType::Square;
-                    channels[channel].duty = 0.5;
-                }
-                channels[channel].wavetype = type;
+                channels[channel].amplitude = AMPLITUDE(ev.param2);
                 channels[channel].fadeStart = 0;
-                writeWaveType(channel, type, channels[channel].duty * 255);
+                writeVolume(channel, ev.param2);
             }
             break;
-        } case 0xD0: { // aftertouch (volume change per channel)
+        } case 10: { // pan
             if (midiMode) {
-                for (int i = 0; i < 128; i++) {
-                    if (midiChannels[channel][i] < NUM_CHANNELS) {
-                        uint16_t c = midiChannels[channel][i];
-                        channels[c].amplitude = packet.param1 / 127.5;
-                        if (channels[c].inst == NULL || channels[c].inst->volume.npoints == 0) writeVolume(c, packet.param1);
+                foreach_voice(c, channel) {
+                    channels[c].pan = ev.param2;
+                    if (channels[c].inst == NULL || channels[c].inst->volume.npoints == 0) {
+                        writeVolume(c, (channels[c].amplitude * 255 + 0x8000) >> 16);
                     }
                 }
             } else {
-                channels[channel].amplitude = packet.param1 / 127.5;
-                writeVolume(channel, packet.param1);
+                channels[channel].pan = ev.param2;
+                writeVolume(channel, (channels[channel].amplitude * 255 + 0x8000) >> 16);
             }
             break;
-        } case 0xE0: { // pitch bend
-            double offset = ((packet.param1 | ((int)packet.param2 << 7)) - 8192) / 4096.0;
+        } case 24: { // frequency (MSB)
+            freq_msb[channel] = ev.param2;
+            channels[channel].increment = hzToIncrement(freq_lsb[channel] | ((uint16_t)freq_msb[channel] << 7));
+            channels[channel].inst = NULL;
+            updateFreeVoice(channel);
+            writeFrequency(channel, channels[channel].increment);
+            break;
+        } case 56: { // frequency (LSB)
+            freq_lsb[channel] = ev.param2;
+            channels[channel].increment = hzToIncrement(freq_lsb[channel] | ((uint16_t)freq_msb[channel] << 7));
+            channels[channel].inst = NULL;
+            updateFreeVoice(channel);
+            writeFrequency(channel, channels[channel].increment);
+            break;
+        } case 86: { // stereo mode
+            stereo = ev.param2 & 0x40;
+            dualChannel = ev.param2 & 0x20;
+            if (version_minor >= 1) hal_gpio_put(18, stereo);
+            break;
+        } case 87: { // voice steal policy
+            if (ev.param2 <= (uint8_t)StealPolicy::ReleasedFirst) midiStealPolicy[channel] = (StealPolicy)ev.param2;
+            break;
+        } case 123: { // all notes off
+            //if (!(ev.param2 & 0x40)) break;
             if (midiMode) {
-                for (int i = 0; i < 128; i++) {
-                    if (midiChannels[channel][i] < NUM_CHANNELS) {
-                        uint16_t c = midiChannels[channel][i];
-                        writeFrequency(c, channels[c].frequency * pow(2.0, offset / 12.0));
-                    }
+                foreach_voice(c, channel) {
+                    channels[c].amplitude = 0;
+                    channels[c].inst = NULL;
+                    writeVolume(c, 0);
                 }
+                memset(midiChannels[channel], 0xFF, 128);
+                midiVoices[channel] = 0;
+                for (int i = 0; i < 16; i++) midiUsedChannels[i] = 0xFF;
+                for (int i = 0; i < MAX_CHANNELS; i++) updateFreeVoice(i);
             } else {
-                writeFrequency(channel, channels[channel].frequency * pow(2.0, offset / 12.0));
+                channels[channel].amplitude = 0;
+                writeVolume(channel, 0);
             }
             break;
-        } case 0xF0: { // system commands
-            switch (channel) {
-            case 0x0F: { // reset
-                gpio_put(PIN_DATA, true);
-                sleep_us(1);
-                gpio_put(PIN_CLOCK, true);
-                sleep_us(1);
-                gpio_put(PIN_CLOCK, false);
-                sleep_us(1);
-                gpio_put(PIN_DATA, false);
-                sleep_us(1);
-                for (int i = 0; i < MAX_CHANNELS; i++) {
-                    gpio_put(PIN_STROBE, true);
-                    sleep_us(1);
-                    gpio_put(PIN_STROBE, false);
-                    write_data(i, 0xFF);
-                    gpio_put(PIN_CLOCK, true);
-                    sleep_us(1);
-                    gpio_put(PIN_CLOCK, false);
-                    sleep_us(1);
-                }
-                gpio_put(PIN_STROBE, true);
-                sleep_us(1);
-                gpio_put(PIN_STROBE, false);
-                // apparently this works to reset the chip?
-                (*((volatile uint32_t*)(PPB_BASE + 0x0ED0C))) = 0x5FA0004;
-                // we should be done by now, but just in case:
-                watchdog_enable(1, 1);
-                while (true);
+        } case 126: { // mono mode
+            midiMode = false;
+            break;
+        } case 127: { // poly mode
+            midiMode = true;
+            break;
+        }
+        }
+        break;
+    } case EventType::ProgramChange: { // wave type change
+        if (midiMode) {
+            midiPrograms[channel] = ev.param1;
+            foreach_voice(c, channel) {
+                channels[c].wavetype = (WaveType)patches[midiPrograms[channel]].waveType;
+                channels[c].fadeStart = 0;
+                channels[c].inst = &patches[midiPrograms[channel]];
+                startEnvelopes(&channels[c]);
+                channels[c].release = false;
+                if (channels[c].wavetype == WaveType::Square) channels[c].duty = midiDuty[channel];
+                writeWaveType(c, channels[c].wavetype, midiDuty[channel]);
             }
+        } else {
+            WaveType type = (WaveType)((ev.param1) & 7);
+            if (type == WaveType::None) {
+                type = WaveType::Square;
+                channels[channel].duty = 127;
             }
-            break;
+            channels[channel].wavetype = type;
+            channels[channel].fadeStart = 0;
+            writeWaveType(channel, type, channels[channel].duty);
         }
+        break;
+    } case EventType::Aftertouch: { // volume change per channel
+        if (midiMode) {
+            foreach_voice(c, channel) {
+                channels[c].amplitude = AMPLITUDE(ev.param1);
+                if (channels[c].inst == NULL || channels[c].inst->volume.npoints == 0) writeVolume(c, ev.param1);
+            }
+        } else {
+            channels[channel].amplitude = AMPLITUDE(ev.param1);
+            writeVolume(channel, ev.param1);
         }
-        //tud_midi_packet_write((const uint8_t*)&packet);
+        break;
+    } case EventType::PitchBend: {
+        int16_t bend = ((ev.param1 | ((int)ev.param2 << 7)) - 8192) / 16; // +/-2 semitones in 1/256 semitones
+        if (midiMode) {
+            midiBend[channel] = bend;
+            foreach_voice(c, channel) {
+                channels[c].bend = bend;
+                writeFrequency(c, pitchScale(channels[c].increment, bend));
+            }
+        } else {
+            channels[channel].bend = bend;
+            writeFrequency(channel, pitchScale(channels[channel].increment, bend));
+        }
+        break;
+    } case EventType::PatchLoaded: {
+        if (parsePatch(ev.param1, (const uint8_t*)hex_storage, PATCH_MAX_SIZE, ev.param2) == 0) stats.patchRejects++;
+        patch_pending = false;
+        break;
+    } case EventType::PatchBlock: {
+        blockStatus = (uint8_t)loadPatchBlock(ev.param1, ev.param2, (const uint8_t*)hex_storage + 4, hex_storage_size - 8);
+        patch_pending = false;
+        break;
+    } case EventType::BankCommand: {
+        if (ev.param1 == 0) commitBank();
+        else if (ev.param1 == 1 && !loadBank()) loadDefaultPatches();
+        break;
+    } case EventType::PicHashes: {
+        if (ev.param1 == 0) erasePicHashes();
+        else {
+            savePicHashes();
+            hal_sleep_ms(5); // let the reply go out
+            hal_reboot_watchdog();
+        }
+        break;
+    }
     }
-    mutex_exit(&command_queue_lock);
 }
 
-#define TIMER_PERIOD 10000
+void sendSysEx(const uint8_t * data, size_t len) {
+    // queue as USB-MIDI packets; flushMidiOutput sends them as the FIFO allows
+    uint8_t p[4];
+    while (len > 3) {
+        p[0] = 0x04; p[1] = data[0]; p[2] = data[1]; p[3] = data[2];
+        midi_output.push(*(uint32_t*)p);
+        data += 3; len -= 3;
+    }
+    p[0] = 0x04 + len; p[1] = data[0]; p[2] = len > 1 ? data[1] : 0; p[3] = len > 2 ? data[2] : 0;
+    midi_output.push(*(uint32_t*)p);
+}
 
-float processEnvelope(ChannelInfo * info, const Envelope * env, uint16_t * tick, uint8_t * point, bool release) {
-    if ((*point == env->sustain && !release) || *point + 1 >= env->npoints) return env->points[*point].y;
-    else if (++(*tick) >= env->points[*point+1].x) {
-        if (++(*point) == env->loopEnd && env->loopStart < 12 && !release) {
-            *point = env->loopStart;
-            *tick = env->points[*point].x;
-        }
-        return env->points[*point].y;
-    } else {
-        const Point a = env->points[*point], b = env->points[*point+1];
-        return a.y + (b.y - a.y) * ((float)(*tick - a.x) / (float)(b.x - a.x));
+void sendBlockAck(BlockStatus status) {
+    const uint8_t msg[] = {0xF0, 0x00, 0x46, 0x71, 0x07, 0x00, (uint8_t)status, 0xF7};
+    sendSysEx(msg, sizeof(msg));
+}
+
+// Replies to the last patch block once core 1 has stored it.
+static void sendPendingBlockAck() {
+    if (blockAckPending && !patch_pending) {
+        blockAckPending = false;
+        sendBlockAck((BlockStatus)blockStatus.load());
     }
 }
 
-void core2() {
-    while (true) {
-        int64_t time = time_us_64();
-        mutex_enter_blocking(&command_queue_lock);
-        for (int i = 0; i < NUM_CHANNELS; i++) {
-            ChannelInfo * info = &channels[i];
-            if (info->inst != NULL) {
-                if (info->inst->pan.npoints > 0 && stereo && dualChannel) {
-                    int8_t val = (int8_t)processEnvelope(info, &info->inst->pan, &info->ticks[1], &info->points[1], info->release);
-                    info->pan = (val - 64.0) / (val > 64 and 63.0 or 64.0);
+void flushMidiOutput() {
+    uint32_t p;
+    sendPendingBlockAck();
+    while (midi_output.peek(p) && hal_midi_write((uint8_t*)&p)) midi_output.pop(p);
+}
+
+// Gets the data bytes of a SysEx packet, leaving out the closing F7, and
+// returns how many there are.
+static uint8_t sysExData(const MidiPacket& packet, uint8_t bytes[3]) {
+    uint8_t s = packet.usbcode & 0x03;
+    bytes[0] = packet.command;
+    bytes[1] = packet.param1;
+    bytes[2] = packet.param2;
+    return s == 0 ? 3 : s - 1;
+}
+
+// Appends the data bytes of a SysEx packet to hex_storage, dropping anything
+// past the end of the buffer.
+static void storeSysExData(const MidiPacket& packet) {
+    uint8_t bytes[3];
+    uint8_t n = sysExData(packet, bytes);
+    for (int i = 0; i < n && hex_storage_size < sizeof(hex_storage); i++) hex_storage[hex_storage_size++] = bytes[i];
+}
+
+// Unpacks one byte of 7-in-8 block data into hex_storage. Each group of
+// up to 7 bytes comes after a byte holding their top bits, the first one's in bit 0.
+static void unpackBlockByte(uint8_t b) {
+    if (blockPackIndex == 0) blockPackHigh = b;
+    else if (hex_storage_size < sizeof(hex_storage)) hex_storage[hex_storage_size++] = b | (((blockPackHigh >> (blockPackIndex - 1)) & 1) << 7);
+    else blockOverflow = true;
+    blockPackIndex = (blockPackIndex + 1) % 8;
+}
+
+// Unpacks a packet of a block message (a patch block, PIC firmware rows or a
+// PIC row hash manifest) into hex_storage. Returns false until the message
+// ends; then it sets status to whether the block arrived whole, with its CRC
+// (the last 4 bytes) matching.
+static bool unpackBlockPacket(const MidiPacket& packet, BlockStatus * status) {
+    uint8_t s = packet.usbcode & 0x03;
+    if (s != 1) unpackBlockByte(packet.command);
+    if (s == 0 || s == 3) unpackBlockByte(packet.param1);
+    if (s == 0) unpackBlockByte(packet.param2);
+    if (s == 0) return false;
+    const uint8_t * data = (const uint8_t*)hex_storage;
+    if (blockOverflow) *status = BlockStatus::TooLarge;
+    else if (hex_storage_size < 8 || psgCRC32(0, data, hex_storage_size - 4) != (data[hex_storage_size-4] | (data[hex_storage_size-3] << 8) | (data[hex_storage_size-2] << 16) | ((uint32_t)data[hex_storage_size-1] << 24)))
+        *status = BlockStatus::BadChecksum;
+    else *status = BlockStatus::OK;
+    return true;
+}
+
+// Replies with the USB serial number string, so a host with several boards
+// attached can tell which MIDI ports belong to which one.
+void sendIdentity() {
+    uint8_t msg[6 + 32 + 1] = {0xF0, 0x00, 0x46, 0x71, 0x09, 0x00};
+    size_t len = 6;
+    for (const char * c = usb_serial; *c && len < sizeof(msg) - 1; c++) msg[len++] = *c & 0x7F;
+    msg[len++] = 0xF7;
+    sendSysEx(msg, len);
+}
+
+void sendStatistics() {
+    const uint32_t * values = (const uint32_t*)&stats;
+    const uint8_t count = sizeof(Statistics) / sizeof(uint32_t);
+    uint8_t msg[8 + count * 5] = {0xF0, 0x00, 0x46, 0x71, 0x03, 0x00, count};
+    for (int i = 0; i < count; i++)
+        for (int j = 0; j < 5; j++) msg[7 + i*5 + j] = (values[i] >> (j * 7)) & 0x7F;
+    msg[7 + count * 5] = 0xF7;
+    sendSysEx(msg, sizeof(msg));
+}
+
+void tud_midi_rx_cb([[maybe_unused]] uint8_t itf) {
+    bool pushed = false;
+    while (hal_midi_available()) {
+        // leave packets in the USB FIFO until core 1 has made room for them, or
+        // is done with the last upload if this packet would start or add to another
+        if (events.full() || (patch_pending && (inSysEx == 0xFE || inSysEx == 3 || inSysEx == 8 || inSysEx == 9 || inSysEx == 11))) {
+            if (!ringStalled) stats.ringFull++;
+            ringStalled = true;
+            break;
+        }
+        ringStalled = false;
+        MidiPacket packet;
+        hal_midi_read((uint8_t*)&packet);
+        if ((packet.usbcode & 0x0C) == 0x04) {
+            // sysex
+            if (inSysEx == 0) { // start
+                if (packet.command == 0xF0 && packet.param1 == 0x00 && packet.param2 == 0x46) inSysEx = 0xFE;
+                else inSysEx = 0xFF;
+            } else if (inSysEx == 0xFE) { // packet header
+                sendPendingBlockAck(); // before anything this command might send
+                if (packet.command != 0x71) {
+                    inSysEx = 0xFF;
+                    continue;
                 }
-                if (info->inst->volume.npoints > 0) {
-                    writeVolume(i, info->amplitude * processEnvelope(info, &info->inst->volume, &info->ticks[0], &info->points[0], info->release));
-                } else if (info->ticks[0] == 0) {
-                    writeVolume(i, info->amplitude * 127);
-                    info->ticks[0]++;
+                inSysEx = packet.param1 + 1;
+                // param2 is only used to pick the instrument format
+                if (inSysEx == 3) {
+                    if (packet.param2 > 1) inSysEx = 0xFF;
+                    patchFormat = packet.param2;
                 }
-                if (info->inst->frequency.npoints > 0) {
-                    writeFrequency(i, info->frequency * pow(2.0, (processEnvelope(info, &info->inst->frequency, &info->ticks[2], &info->points[2], info->release) - 0x8000) / 192.0));
-                } else if (info->ticks[2] == 0) {
-                    writeFrequency(i, info->frequency);
-                    info->ticks[2]++;
+                if (inSysEx == 1) {
+                    hexStart();
+                } else if (inSysEx == 3) {
+                    memset(hex_storage, 0, 0x4000);
+                    hex_storage_size = 0;
+                } else if (inSysEx == 8 || inSysEx == 9 || inSysEx == 11) {
+                    hex_storage_size = 0;
+                    blockPackIndex = 0;
+                    blockOverflow = false;
+                } else if (inSysEx == 2) {
+                    // boot to bootloader
+                    hal_reboot_bootloader();
+                } else if (inSysEx == 4) {
+                    sendStatistics();
+                } else if (inSysEx == 10) {
+                    sendIdentity();
                 }
-                if (info->inst->duty.npoints > 0 && info->wavetype == WaveType::Square) {
-                    writeWaveType(i, WaveType::Square, (uint8_t)processEnvelope(info, &info->inst->duty, &info->ticks[3], &info->points[3], info->release) * 2);
+            } else if (inSysEx == 1) {
+                // flash PIC chips - HEX is programmed as it arrives
+                uint8_t bytes[3];
+                uint8_t n = sysExData(packet, bytes);
+                for (int i = 0; i < n; i++) hexChar(bytes[i]);
+                if (packet.usbcode & 0x03) {
+                    inSysEx = 0;
+                    hexEnd();
                 }
-                if ((info->inst->volume.npoints > 0 && info->points[0] + 1 >= info->inst->volume.npoints && info->points[1] + 1 >= info->inst->pan.npoints && info->points[2] + 1 >= info->inst->frequency.npoints && (info->wavetype != WaveType::Square || info->points[3] + 1 >= info->inst->duty.npoints)) || (info->inst->volume.npoints == 0 && info->release)) {
-                    info->inst = NULL;
-                    writeWaveType(i, WaveType::None);
+            } else if (inSysEx == 3) {
+                // load instrument envelope
+                uint8_t s = packet.usbcode & 0x03;
+                storeSysExData(packet);
+                if (s != 0) {
+                    inSysEx = 0;
+                    // core 1 copies the patch in between ticks so it never sees half of one.
+                    // The patch is decoded over the text, which always stays ahead of it,
+                    // and whatever the parser might read past its end is cleared.
+                    uint8_t n = hex_storage[0] & 0x7F;
+                    size_t size;
+                    if (base64_decode((const uint8_t*)hex_storage + 1, hex_storage_size - 1, (uint8_t*)hex_storage, PATCH_MAX_SIZE + 3, &size) == 0) {
+                        if (size < PATCH_MAX_SIZE) memset(hex_storage + size, 0, PATCH_MAX_SIZE - size);
+                        patch_pending = true;
+                        events.push({EventType::PatchLoaded, 0, n, patchFormat, (uint32_t)hal_time_us()});
+                        pushed = true;
+                    }
                 }
-            } else if (info->fadeStart > 0) {
-                info->amplitude = info->fadeInit + (double)(time - info->fadeStart) / info->fadeLength * info->fadeDirection;
-                if (time - info->fadeStart >= info->fadeLength) {
-                    info->fadeInit = 0.0f;
-                    info->fadeStart = info->fadeLength = 0;
-                    info->amplitude = info->fadeDirection == 1 ? 1 : 0;
-                    if (midiMode && midiUsedChannels[i] != 0xFF) {
-                        midiChannels[midiUsedChannels[i]][info->note] = 0xFF;
-                        midiUsedChannels[i] = 0xFF;
+            } else if (inSysEx == 8 || inSysEx == 9 || inSysEx == 11) {
+                // patch block, PIC firmware rows or PIC row hash manifest, unpacked as it arrives
+                BlockStatus status;
+                if (unpackBlockPacket(packet, &status)) {
+                    uint8_t command = inSysEx;
+                    inSysEx = 0;
+                    const uint8_t * data = (const uint8_t*)hex_storage;
+                    if (command == 8) {
+                        if (status != BlockStatus::OK) sendBlockAck(status);
+                        else {
+                            patch_pending = true;
+                            blockAckPending = true;
+                            events.push({EventType::PatchBlock, 0, data[0], data[1], (uint32_t)hal_time_us()});
+                            pushed = true;
+                        }
+                    } else {
+                        // the PIC data is only written or compared once it's been checked
+                        uint8_t reply = command == 9 ? 0x08 : 0x0A;
+                        if (status == BlockStatus::TooLarge) sendFlashStatus(reply, FlashStatus::TooLarge);
+                        else if (status == BlockStatus::BadChecksum) sendFlashStatus(reply, FlashStatus::BadChecksum);
+                        else if (command == 9) loadPicBlock(data, hex_storage_size - 4);
+                        else loadPicManifest(data, hex_storage_size - 4);
                     }
                 }
-                writeVolume(i, info->amplitude * 127);
+            } else if (inSysEx == 7) {
+                // commit/revert the patch bank; core 1 does it between ticks since it owns the patches
+                if (packet.command <= 1) {
+                    events.push({EventType::BankCommand, 0, packet.command, 0, (uint32_t)hal_time_us()});
+                    pushed = true;
+                }
+                inSysEx = (packet.usbcode & 0x03) ? 0 : 0xFF;
+            } else if (inSysEx == 6) {
+                // express mode on/off
+                expressMode = packet.command != 0;
+                inSysEx = (packet.usbcode & 0x03) ? 0 : 0xFF;
+            } else if (inSysEx == 5) {
+                // set control rate, in multiples of 100 Hz
+                if (packet.command >= 1 && packet.command <= MAX_CONTROL_DIV) controlDiv = packet.command;
+                inSysEx = (packet.usbcode & 0x03) ? 0 : 0xFF;
+            } else { // unrecognized vendor/command
+                if (packet.usbcode & 0x03) inSysEx = 0;
+            }
+            continue;
+        }
+        if (packet.command >= 0x80 && packet.command < 0xF0) {
+            events.push({(EventType)(packet.command >> 4), (uint8_t)(packet.command & 0x0F), packet.param1, packet.param2, (uint32_t)hal_time_us()});
+            pushed = true;
+            uint32_t size = events.size();
+            if (size > stats.ringHighWater) stats.ringHighWater = size;
+        } else if (packet.command == 0xFF) { // reset
+            hal_mutex_enter(&bus_lock);
+            chipResets = chipResets.load() + 1;
+            hal_gpio_put(PIN_DATA, true);
+            hal_sleep_us(1);
+            hal_gpio_put(PIN_CLOCK, true);
+            hal_sleep_us(1);
+            hal_gpio_put(PIN_CLOCK, false);
+            hal_sleep_us(1);
+            hal_gpio_put(PIN_DATA, false);
+            hal_sleep_us(1);
+            for (int i = 0; i < MAX_CHANNELS; i++) {
+                hal_gpio_put(PIN_STROBE, true);
+                hal_sleep_us(1);
+                hal_gpio_put(PIN_STROBE, false);
+                write_data(i, 0xFF);
+                hal_gpio_put(PIN_CLOCK, true);
+                hal_sleep_us(1);
+                hal_gpio_put(PIN_CLOCK, false);
+                hal_sleep_us(1);
             }
+            hal_gpio_put(PIN_STROBE, true);
+            hal_sleep_us(1);
+            hal_gpio_put(PIN_STROBE, false);
+            hal_reboot();
         }
-        if (changed) {
-            changed = false;
-            gpio_put(PICO_DEFAULT_LED_PIN, false);
-            for (int n = 0; n < 4; n++) {
-                if (command_updates[n]) {
-                    command_updates[n] = false;
-                    gpio_put(PIN_DATA, true);
-                    sleep_us_sr(1);
-                    gpio_put(PIN_CLOCK, true);
-                    sleep_us_sr(1);
-                    gpio_put(PIN_CLOCK, false);
-                    sleep_us_sr(1);
-                    gpio_put(PIN_DATA, false);
-                    sleep_us_sr(1);
-                    for (int i = 0; i < MAX_CHANNELS; i++) {
-                        if (command_queue[i][n][0] != 0xFF) {
-                            gpio_put(PIN_STROBE, true);
-                            sleep_us_sr(1);
-                            gpio_put(PIN_STROBE, false);
-                            sleep_us_sr(1);
-                            write_data(i, command_queue[i][n][0]);
-                            if (n == 1 || command_queue[i][n][0] == (COMMAND_WAVE_TYPE | 1)) write_data(i, command_queue[i][n][1]);
-                            command_queue[i][n][0] = 0xFF;
-                        }
-                        gpio_put(PIN_CLOCK, true);
+        //tud_midi_packet_write((const uint8_t*)&packet);
+    }
+    if (pushed) hal_event_signal();
+    flushMidiOutput();
+}
+
+// Steps one envelope of a voice and returns its value in 16.16 fixed point,
+// rounded down. Within a segment the value is carried along by adding the
+// segment's slope each tick, with the remainder carried the way a line is
+// drawn, so it never drifts; it is set whenever a point is reached.
+static uint32_t processEnvelope(ChannelInfo * info, int e, const Envelope * env, bool advance, int32_t frac) {
+    const Point * points = envelopePoints(info->inst, e);
+    uint16_t * tick = &info->ticks[e];
+    uint8_t * point = &info->points[e];
+    uint32_t * level = &info->level[e];
+    uint16_t * rem = &info->levelRem[e];
+    bool release = info->release;
+    if ((*point == env->sustain && !release) || *point + 1 >= env->npoints) return (uint32_t)points[*point].y << 16;
+    else if (advance && ++(*tick) >= points[*point+1].x) {
+        if (++(*point) == env->loopEnd && env->loopStart < env->npoints && !release) {
+            *point = env->loopStart;
+            *tick = points[*point].x;
+        }
+        // the tick may have overshot a point that doesn't move forward in x
+        setLevel(info, e, env, *point, *tick - points[*point].x);
+        return (uint32_t)points[*point].y << 16;
+    } else {
+        int32_t dx = points[*point+1].x - points[*point].x;
+        if (dx <= 0) return *level;
+        // level can't leave 0-0xFFFF.FFFF, so wrapping arithmetic keeps it exact
+        if (advance) {
+            uint32_t r = (uint32_t)*rem + info->slopeRem[e];
+            *level += info->slope[e] + (r >= (uint32_t)dx);
+            *rem = r >= (uint32_t)dx ? r - dx : r;
+        }
+        if (frac == 0) return *level;
+        // part of the way to the next tick, only sampled at control rates above 100 Hz
+        return *level + (int32_t)floorDiv(*rem + ((int64_t)points[*point+1].y - points[*point].y) * frac, dx);
+    }
+}
+
+// Runs one step of a voice's instrument envelopes. When advance is false the
+// envelopes stay on the current tick and are sampled frac (0.16) of the way to the next.
+static void stepEnvelopes(uint8_t c, bool advance, int32_t frac) {
+    ChannelInfo * info = &channels[c];
+    if (info->inst->pan.npoints > 0 && stereo && dualChannel) {
+        info->pan = min(processEnvelope(info, 1, &info->inst->pan, advance, frac) >> 16, (uint32_t)127);
+    }
+    if (info->inst->volume.npoints > 0) {
+        writeVolume(c, (uint32_t)(((uint64_t)info->amplitude * processEnvelope(info, 0, &info->inst->volume, advance, frac)) >> 16) >> 15);
+    } else if (info->ticks[0] == 0) {
+        writeVolume(c, (info->amplitude * 127) >> 15);
+        info->ticks[0]++;
+    }
+    if (info->inst->frequency.npoints > 0) {
+        // envelope is in 1/16 semitones centered on 0x8000
+        int64_t env = (int64_t)processEnvelope(info, 2, &info->inst->frequency, advance, frac) - ((int64_t)0x8000 << 16);
+        int32_t offset = env >= 0 ? env >> 12 : -(-env >> 12);
+        writeFrequency(c, pitchScale(info->increment, offset + info->bend));
+    } else if (info->ticks[2] == 0) {
+        writeFrequency(c, pitchScale(info->increment, info->bend));
+        info->ticks[2]++;
+    }
+    if (info->inst->duty.npoints > 0 && info->wavetype == WaveType::Square) {
+        writeWaveType(c, WaveType::Square, (uint8_t)(processEnvelope(info, 3, &info->inst->duty, advance, frac) >> 16) * 2);
+    }
+    if ((info->inst->volume.npoints > 0 && info->points[0] + 1 >= info->inst->volume.npoints && info->points[1] + 1 >= info->inst->pan.npoints && info->points[2] + 1 >= info->inst->frequency.npoints && (info->wavetype != WaveType::Square || info->points[3] + 1 >= info->inst->duty.npoints)) || (info->inst->volume.npoints == 0 && info->release)) {
+        info->inst = NULL;
+        updateFreeVoice(c);
+        writeWaveType(c, WaveType::None);
+    }
+}
+
+// Whether an envelope still has somewhere to go on its own.
+static bool envelopeMoving(const Envelope * env, uint8_t point, bool release) {
+    return env->npoints > 0 && !(point == env->sustain && !release) && point + 1 < env->npoints;
+}
+
+// Whether a voice needs the periodic tick: an envelope that isn't parked on a
+// sustain or end point, or a fade.
+static bool voiceAnimating(const ChannelInfo * info) {
+    if (info->inst != NULL)
+        return envelopeMoving(&info->inst->volume, info->points[0], info->release) || envelopeMoving(&info->inst->pan, info->points[1], info->release) ||
+            envelopeMoving(&info->inst->frequency, info->points[2], info->release) || envelopeMoving(&info->inst->duty, info->points[3], info->release);
+    return info->fadeStart != 0;
+}
+
+// Sends everything pending in command_queue to the chips.
+static void flushBus() {
+    if (dirtyChips) {
+        // Walk a select bit up the shift register, stopping only at chips with
+        // something pending. The chips only take one command per rising edge on
+        // INT, so each pass sends every dirty chip its next command, and the
+        // passes repeat until nothing is left. The bit still has to be clocked
+        // out the far end afterwards, since the flash and reset code expect an
+        // empty register.
+        uint16_t dirty = dirtyChips;
+        dirtyChips = 0;
+        hal_mutex_enter(&bus_lock);
+        if (picFlashing) { // the chips are taking new firmware; these commands can only get in the way
+            hal_mutex_exit(&bus_lock);
+            return;
+        }
+        hal_gpio_put(PICO_DEFAULT_LED_PIN, false);
+        while (dirty) {
+            uint16_t next = 0;
+            hal_gpio_put(PIN_DATA, true);
+            sleep_us_sr(1);
+            hal_gpio_put(PIN_CLOCK, true);
+            sleep_us_sr(1);
+            hal_gpio_put(PIN_CLOCK, false);
+            sleep_us_sr(1);
+            hal_gpio_put(PIN_DATA, false);
+            sleep_us_sr(1);
+            for (int i = 0; i < MAX_CHANNELS; i++) {
+                if (dirty & (1 << i)) {
+                    int n = 0;
+                    while (n < 4 && command_queue[i][n][0] == 0xFF) n++;
+                    if (n < 4) {
+                        hal_gpio_put(PIN_STROBE, true);
                         sleep_us_sr(1);
-                        gpio_put(PIN_CLOCK, false);
+                        hal_gpio_put(PIN_STROBE, false);
                         sleep_us_sr(1);
+                        write_data(i, command_queue[i][n][0]);
+                        if (n == 1 || command_queue[i][n][0] == (COMMAND_WAVE_TYPE | 1)) write_data(i, command_queue[i][n][1]);
+                        chip_state[i][n][0] = command_queue[i][n][0];
+                        chip_state[i][n][1] = command_queue[i][n][1];
+                        command_queue[i][n][0] = 0xFF;
+                        for (n++; n < 4; n++) if (command_queue[i][n][0] != 0xFF) next |= 1 << i;
                     }
                 }
-                gpio_put(PIN_STROBE, true);
+                hal_gpio_put(PIN_CLOCK, true);
                 sleep_us_sr(1);
-                gpio_put(PIN_STROBE, false);
+                hal_gpio_put(PIN_CLOCK, false);
                 sleep_us_sr(1);
             }
-            gpio_put(PICO_DEFAULT_LED_PIN, true);
+            hal_gpio_put(PIN_STROBE, true);
+            sleep_us_sr(1);
+            hal_gpio_put(PIN_STROBE, false);
+            sleep_us_sr(1);
+            dirty = next;
         }
-        mutex_exit(&command_queue_lock);
-        int64_t period = time_us_64() - time;
-        if (period < TIMER_PERIOD) sleep_us(TIMER_PERIOD - period);
+        hal_gpio_put(PICO_DEFAULT_LED_PIN, true);
+        hal_mutex_exit(&bus_lock);
     }
 }
 
-int main() {
-    gpio_init(PICO_DEFAULT_LED_PIN); gpio_set_dir(PICO_DEFAULT_LED_PIN, true);
-    gpio_in(0);
-    gpio_in(1);
-    gpio_in(2);
-    gpio_in(3);
-    gpio_in(4);
-    gpio_in(5);
-    gpio_out(6);
-    gpio_out(7);
-    gpio_out(8);
-    gpio_out(9);
-    gpio_out(10);
-    gpio_out(11);
-    gpio_out(12);
-    gpio_out(13);
-    gpio_out(14);
-    gpio_out(PIN_STROBE);
-    gpio_out(PIN_DATA);
-    gpio_out(PIN_CLOCK);
+// Remembers when a note event arrived, so its latency can be binned once it has
+// made it onto the bus.
+static void notePending(const VoiceEvent& ev) {
+    if (ev.type != EventType::NoteOn && ev.type != EventType::NoteOff) return;
+    if (pendingNoteCount < PENDING_NOTES) pendingNotes[pendingNoteCount++] = ev.time;
+    else stats.untimedNotes++;
+}
+
+static void recordLatency() {
+    uint32_t now = hal_time_us();
+    for (int i = 0; i < pendingNoteCount; i++) {
+        uint32_t t = (now - pendingNotes[i]) >> 8;
+        stats.noteLatency[t ? min(32 - __builtin_clz(t), LATENCY_BINS - 1) : 0]++;
+    }
+    pendingNoteCount = 0;
+}
+
+// Runs one control tick, and returns whether any voice still needs another.
+bool core2_tick() {
+    VoiceEvent ev;
+    uint8_t resets = chipResets.load();
+    if (resets != chipResetsSeen) {
+        chipResetsSeen = resets;
+        memset(chip_state, 0xFF, sizeof(chip_state));
+    }
+    while (events.pop(ev)) {
+        handleEvent(ev);
+        notePending(ev);
+    }
+    int64_t time = hal_time_us();
+    uint8_t div = controlDiv;
+    bool animating = false;
+    for (int i = 0; i < NUM_CHANNELS; i++) {
+        ChannelInfo * info = &channels[i];
+        if (info->inst != NULL) {
+            bool advance = ++info->phase >= div;
+            if (advance) info->phase = 0;
+            int32_t frac = ((uint32_t)info->phase << 16) / div;
+            stepEnvelopes(i, advance, frac);
+        } else if (info->fadeStart != 0) {
+            // work in 64 us units so the 1.15 product fits in 32 bits
+            uint32_t elapsed = (uint32_t)time - info->fadeStart;
+            int32_t delta = ((elapsed >> 6) << 15) / max(info->fadeLength >> 6, (uint32_t)1);
+            info->amplitude = (uint16_t)max(min((int32_t)info->fadeInit + delta * info->fadeDirection, (int32_t)0x7FFF), (int32_t)0);
+            if (elapsed >= info->fadeLength) {
+                info->fadeInit = 0;
+                info->fadeStart = info->fadeLength = 0;
+                info->amplitude = info->fadeDirection == 1 ? 0x7FFF : 0;
+                if (midiMode && midiUsedChannels[i] != 0xFF) {
+                    if (midiChannels[midiUsedChannels[i]][info->note] == i) unmapVoice(midiUsedChannels[i], info->note);
+                    midiUsedChannels[i] = 0xFF;
+                    updateFreeVoice(i);
+                }
+            }
+            writeVolume(i, (info->amplitude * 127) >> 15);
+        }
+        if (voiceAnimating(info)) animating = true;
+    }
+    flushBus();
+    recordLatency();
+    return animating;
+}
+
+// Picks up events as soon as core 0 queues them and sends just the chips they
+// touch, without waiting for the next tick. A note-on gets the first step of
+// its envelopes written straight away, without advancing them; envelopes and
+// fades otherwise still only move on the tick.
+static void expressEvents() {
+    VoiceEvent ev;
+    bool any = false;
+    while (events.pop(ev)) {
+        handleEvent(ev);
+        notePending(ev);
+        if (midiMode && ev.type == EventType::NoteOn && ev.param2) {
+            uint8_t c = midiChannels[ev.channel][ev.param1];
+            if (c < NUM_CHANNELS && channels[c].inst != NULL) stepEnvelopes(c, false, 0);
+        }
+        any = true;
+    }
+    if (any) {
+        flushBus();
+        recordLatency();
+    }
+}
+
+// Sleeps until the given time, handling events as they come in express mode.
+static void core2_idle(uint64_t until) {
+    while (true) {
+        bool express = expressMode;
+        if (express) expressEvents();
+        uint64_t now = hal_time_us();
+        if (now >= until) return;
+        if (express) hal_event_wait_until(until);
+        else hal_wait_until(until);
+    }
+}
+
+// Waits out the rest of the control tick that started at `start` and was due
+// at `deadline`, and returns when the next one is due. Deadlines stay on a
+// fixed grid, so the rate doesn't drift with the length of each tick; if a tick
+// overruns by whole periods, those are skipped instead of run back to back.
+// With nothing animating, the tick is disarmed: core 1 sleeps until core 0
+// queues an event, and the next tick runs as soon as it does.
+// 10 ms doesn't divide evenly at every rate (300 Hz is 3333 1/3 us), so the
+// part of a microsecond each period leaves over is carried here, in 1/rate us,
+// and added to the deadline as it makes up whole ones. Every envelope step then
+// takes exactly ENVELOPE_PERIOD, whatever the rate.
+static uint32_t periodCarry = 0;
+
+static uint64_t addPeriods(uint64_t deadline, uint64_t n, uint8_t div) {
+    uint64_t carry = periodCarry + n * (ENVELOPE_PERIOD % div);
+    periodCarry = carry % div;
+    return deadline + n * (ENVELOPE_PERIOD / div) + carry / div;
+}
+
+uint64_t core2_wait(uint64_t deadline, uint64_t start, bool animating) {
+    uint8_t div = controlDiv;
+    uint32_t period = ENVELOPE_PERIOD / div;
+    uint64_t now = hal_time_us();
+    if (now - start > stats.tickMax) stats.tickMax = now - start;
+    if (!animating) {
+        uint64_t until = now + IDLE_TIMEOUT;
+        while (events.empty() && hal_time_us() < until) hal_event_wait_until(until);
+        return hal_time_us();
+    }
+    deadline = addPeriods(deadline, 1, div);
+    if (now < deadline) {
+        core2_idle(deadline);
+    } else {
+        uint32_t missed = (now - deadline) / period;
+        stats.tickOverruns++;
+        stats.ticksSkipped += missed;
+        deadline = addPeriods(deadline, missed, div);
+    }
+    return deadline;
+}
+
+void core2() {
+    uint64_t deadline = hal_time_us();
+    while (true) {
+        uint64_t start = hal_time_us();
+        bool animating = core2_tick();
+        deadline = core2_wait(deadline, start, animating);
+    }
+}
+
+void psg_init() {
+    hal_gpio_out(PICO_DEFAULT_LED_PIN);
+    hal_gpio_in(0);
+    hal_gpio_in(1);
+    hal_gpio_in(2);
+    hal_gpio_in(3);
+    hal_gpio_in(4);
+    hal_gpio_in(5);
+    hal_gpio_out(6);
+    hal_gpio_out(7);
+    hal_gpio_out(8);
+    hal_gpio_out(9);
+    hal_gpio_out(10);
+    hal_gpio_out(11);
+    hal_gpio_out(12);
+    hal_gpio_out(13);
+    hal_gpio_out(14);
+    hal_gpio_out(PIN_STROBE);
+    hal_gpio_out(PIN_DATA);
+    hal_gpio_out(PIN_CLOCK);
     // Check board version number (0-1 = major revision, 2-5 = minor revision)
     // major mismatch = do not run, minor mismatch = disable features
-    version_major = (gpio_get(0) ? 2 : 0) + (gpio_get(1) ? 1 : 0);
+    version_major = (hal_gpio_get(0) ? 2 : 0) + (hal_gpio_get(1) ? 1 : 0);
     if (version_major != BOARD_VERSION_MAJOR) {
         while (true) {
-            gpio_put(PICO_DEFAULT_LED_PIN, true);
-            sleep_ms(500);
-            gpio_put(PICO_DEFAULT_LED_PIN, false);
-            sleep_ms(500);
+            hal_gpio_put(PICO_DEFAULT_LED_PIN, true);
+            hal_sleep_ms(500);
+            hal_gpio_put(PICO_DEFAULT_LED_PIN, false);
+            hal_sleep_ms(500);
         }
     }
-    version_minor = (gpio_get(2) ? 8 : 0) + (gpio_get(3) ? 4 : 0) + (gpio_get(4) ? 2 : 0) + (gpio_get(5) ? 1 : 0);
-    gpio_put(PIN_DATA, false);
-    sleep_us(1);
+    version_minor = (hal_gpio_get(2) ? 8 : 0) + (hal_gpio_get(3) ? 4 : 0) + (hal_gpio_get(4) ? 2 : 0) + (hal_gpio_get(5) ? 1 : 0);
+    hal_gpio_put(PIN_DATA, false);
+    hal_sleep_us(1);
     for (int i = 0; i < 32; i++) {
-        gpio_put(PIN_CLOCK, true);
-        sleep_us(1);
-        gpio_put(PIN_CLOCK, false);
-        sleep_us(1);
-    }
-    gpio_put(PIN_STROBE, true);
-    sleep_us(1);
-    gpio_put(PIN_CLOCK, true);
-    sleep_us(1);
-    gpio_put(PIN_CLOCK, false);
-    sleep_us(1);
-    gpio_put(PIN_STROBE, false);
-    sleep_us(1);
-    mutex_init(&command_queue_lock);
+        hal_gpio_put(PIN_CLOCK, true);
+        hal_sleep_us(1);
+        hal_gpio_put(PIN_CLOCK, false);
+        hal_sleep_us(1);
+    }
+    hal_gpio_put(PIN_STROBE, true);
+    hal_sleep_us(1);
+    hal_gpio_put(PIN_CLOCK, true);
+    hal_sleep_us(1);
+    hal_gpio_put(PIN_CLOCK, false);
+    hal_sleep_us(1);
+    hal_gpio_put(PIN_STROBE, false);
+    hal_sleep_us(1);
+    hal_mutex_init(&bus_lock);
     for (int i = 0; i < MAX_CHANNELS; i++) {
         command_queue[i][0][0] = 0xFF;
         command_queue[i][1][0] = 0xFF;
         command_queue[i][2][0] = 0xFF;
         command_queue[i][3][0] = 0xFF;
     }
+    memset(chip_state, 0xFF, sizeof(chip_state)); // nothing is known about the chips at boot
     memset(midiChannels, 0xFF, 2048);
     memset(midiUsedChannels, 0xFF, MAX_CHANNELS);
-    for (uint8_t i = 0; i < 128; i++) {
-        patches[i] = {
-            { // volume
-                {{0, 127}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}},
-                0, 0xFF, 0xFF, 0xFF
-            },
-            { // pan
-                {{0, 64}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}},
-                0, 0xFF, 0xFF, 0xFF
-            },
-            { // frequency
-                {{0, 0x8000}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}},
-                0, 0xFF, 0xFF, 0xFF
-            },
-            { // duty
-                {{0, i == 0 ? (uint16_t)64 : (uint16_t)i}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}},
-                (i == 0 || i % 8 == 5) ? (uint8_t)0 : (uint8_t)1, 0, 0xFF, 0xFF
-            },
-            {i % 8 == 0 ? (uint8_t)5 : (uint8_t)(i % 8), 0, 0, 0} // waveTypes
-        };
-    }
+    for (int i = 0; i < 16; i++) midiStealPolicy[i] = StealPolicy::ReleasedFirst;
+    if (!loadBank()) loadDefaultPatches();
+    loadPicHashes();
     uint64_t serial = 0;
-    flash_get_unique_id((uint8_t*)&serial);
-    sprintf(usb_serial, "%016lx", serial);
+    hal_unique_id((uint8_t*)&serial);
+    sprintf(usb_serial, "%016lx", (unsigned long)(uint32_t)serial); // the low word, which is all %lx has ever printed on the Pico
     usb_serial[16] = ':';
+}
+
+#ifdef PSG_HOST
+// A voice of its own for stepping one envelope outside the tick, so tests can
+// check the compiled slopes against the original float code. The envelope is
+// loaded as patch 127's volume envelope.
+static ChannelInfo envelopeVoice;
+
+void psg_host_envelope_start(const uint16_t * points, uint8_t npoints, uint8_t sustain, uint8_t loopStart, uint8_t loopEnd) {
+    Envelope envs[4];
+    envs[0].npoints = npoints;
+    envs[0].sustain = sustain;
+    envs[0].loopStart = loopStart;
+    envs[0].loopEnd = loopEnd;
+    const Point * pts[4] = {(const Point*)points, NULL, NULL, NULL};
+    const uint8_t waveTypes[4] = {0, 0, 0, 0};
+    storePatch(127, envs, pts, waveTypes);
+    envelopeVoice.inst = &patches[127];
+    envelopeVoice.release = false;
+    startEnvelopes(&envelopeVoice);
+}
+
+uint32_t psg_host_envelope_step(bool release, bool advance, int32_t frac) {
+    envelopeVoice.release = release;
+    return processEnvelope(&envelopeVoice, 0, &envelopeVoice.inst->volume, advance, frac);
+}
+
+uint8_t psg_host_volume_level(uint8_t vol, uint8_t pan, bool right) {
+    return volumeLevel(vol * panLaw[right][pan]);
+}
+
+bool psg_host_events_waiting() {
+    return !events.empty();
+}
+#else
+int main() {
+    psg_init();
     tusb_init();
     multicore_launch_core1(core2);
-    gpio_put(PICO_DEFAULT_LED_PIN, true);
-    while (true) tud_task(); // tinyusb device task
+    multicore_lockout_victim_init(); // lets core 1 pause this core while it writes the patch bank to flash
+    hal_gpio_put(PICO_DEFAULT_LED_PIN, true);
+    while (true) {
+        tud_task(); // tinyusb device task
+        if (hal_midi_available()) tud_midi_rx_cb(0); // resume after a stall on the event ring
+        flushMidiOutput();
+        picCheckTimeout();
+    }
 }
+#endif
@@ -0,0 +1,663 @@
+/*
+ * pico-sound-driver/pic_emu.cpp
+ * PSG
+ *
+ * This file contains the PIC16LF1613 emulator: the enhanced mid-range core with
+ * its full instruction set, and the peripherals the channel firmware touches -
+ * the ports, the INT pin, OSCCON, the DAC, the watchdog and self-programming.
+ * The data bus and INT pin are inputs, and the DAC level is the output.
+ *
+ * Interrupts are taken at the next instruction boundary once INTF is set, and
+ * vectoring costs three cycles. Flash row erases and writes stall the core for
+ * PIC_FLASH_TIME, which is within the 2-5 ms the bootloader protocol allows.
+ *
+ * This code is licensed under the GPLv2 license.
+ * Copyright (c) 2022-2023 JackMacWindows.
+ */
+
+#include "pic_emu.h"
+#include <string.h>
+#include <string>
+
+// core registers, at the bottom of every bank
+#define REG_INDF0   0x00
+#define REG_INDF1   0x01
+#define REG_PCL     0x02
+#define REG_STATUS  0x03
+#define REG_FSR0L   0x04
+#define REG_BSR     0x08
+#define REG_WREG    0x09
+#define REG_PCLATH  0x0A
+#define REG_INTCON  0x0B
+// peripheral registers, as bank << 7 | offset
+#define REG_PORTA   0x00C
+#define REG_PORTC   0x00E
+#define REG_TRISA   0x08C
+#define REG_TRISC   0x08E
+#define REG_OPTION  0x095
+#define REG_PCON    0x096
+#define REG_OSCCON  0x099
+#define REG_LATA    0x10C
+#define REG_LATC    0x10E
+#define REG_DACCON0 0x118
+#define REG_DACCON1 0x119
+#define REG_PMADRL  0x191
+#define REG_PMADRH  0x192
+#define REG_PMDATL  0x193
+#define REG_PMDATH  0x194
+#define REG_PMCON1  0x195
+#define REG_PMCON2  0x196
+#define REG_WDTCON0 0x711
+
+#define STATUS_C  0x01
+#define STATUS_DC 0x02
+#define STATUS_Z  0x04
+#define INTCON_GIE  0x80
+#define INTCON_INTE 0x10
+#define INTCON_INTF 0x02
+
+PicEmu::PicEmu(const uint16_t * program) {
+    memcpy(this->program, program, sizeof(this->program));
+    now = 0;
+    cycleCount = interruptCount = 0;
+    reset(Reset::PowerOn);
+}
+
+uint8_t PicEmu::peek(uint16_t addr) const {
+    uint8_t off = addr & 0x7F;
+    if (off == REG_WREG) return w;
+    if (off < 0x0C || off >= 0x70) return ram[off];
+    return ram[addr & 0xFFF];
+}
+
+// Puts the registers in their reset state. RAM is only filled on power-on;
+// PCON keeps a record of what caused the reset, which the firmware checks.
+void PicEmu::reset(Reset kind) {
+    if (kind == Reset::PowerOn) {
+        memset(ram, 0, sizeof(ram));
+        for (unsigned i = 0; i < sizeof(ram); i++) if ((i & 0x7F) >= 0x20) ram[i] = picPowerOnByte(i);
+        ram[REG_PCON] = 0x1C;
+        w = 0;
+        pinsA = pinsC = 0;
+    } else if (kind == Reset::Watchdog) ram[REG_PCON] &= ~0x10;
+    else if (kind == Reset::Instruction) ram[REG_PCON] &= ~0x04;
+    else if (kind == Reset::StackOverflow) ram[REG_PCON] |= 0x80;
+    else if (kind == Reset::StackUnderflow) ram[REG_PCON] |= 0x40;
+    ram[REG_STATUS] = (ram[REG_STATUS] & 0x07) | (kind == Reset::Watchdog ? 0x08 : 0x18);
+    ram[REG_BSR] = 0;
+    ram[REG_PCLATH] = 0;
+    ram[REG_INTCON] &= 0x01;
+    ram[REG_TRISA] = 0x3F;
+    ram[REG_TRISC] = 0x3F;
+    ram[REG_OPTION] = 0xFF;
+    ram[REG_OSCCON] = 0x38; // 500 kHz
+    ram[REG_DACCON0] = 0;
+    ram[REG_DACCON1] = 0;
+    ram[REG_PMCON1] = 0x80;
+    ram[REG_WDTCON0] = 0x04; // WDTPS from the config bits, off
+    for (int i = 0; i < PIC_LATCH_WORDS; i++) latches[i] = 0x3FFF;
+    unlock = 0;
+    sp = 0;
+    pc = 0;
+    wdtDeadline = 0;
+    sleeping = false;
+    updateClock();
+}
+
+// Works out the instruction cycle time from OSCCON. The 4x PLL is taken to
+// give 32 MHz with either of the top two HFINTOSC settings, which is what the
+// firmware (and the driver's increment maths) expect from 0xF8.
+void PicEmu::updateClock() {
+    static const uint32_t ircfHz[16] = {31000, 31000, 31250, 31250, 62500, 125000, 250000, 500000,
+        125000, 250000, 500000, 1000000, 2000000, 4000000, 8000000, 16000000};
+    uint8_t osccon = ram[REG_OSCCON];
+    uint8_t ircf = (osccon >> 3) & 0x0F;
+    uint32_t hz = (osccon & 0x80) && ircf >= 14 ? 32000000 : ircfHz[ircf];
+    tcy = 4000000000u / hz;
+}
+
+// Turns an FSR value into a traditional data address, or 0xFFFF if it points
+// into program memory or at nothing. Pointing an FSR at INDF reads as nothing.
+static uint16_t fsrAddress(uint16_t fsr) {
+    uint16_t addr = 0xFFFF;
+    if (fsr < 0x1000) addr = fsr;
+    else if (fsr >= 0x2000 && fsr < 0x2000 + 32 * 80) {
+        uint16_t linear = fsr - 0x2000;
+        addr = (linear / 80) << 7 | (0x20 + linear % 80);
+    }
+    if ((addr & 0x7F) <= REG_INDF1) return 0xFFFF;
+    return addr;
+}
+
+uint8_t PicEmu::readIndirect(uint16_t fsr) {
+    if (fsr >= 0x8000) { // the low byte of a program word, which takes an extra cycle
+        extraCycle = true;
+        fsr &= 0x7FFF;
+        return fsr < PIC_PROGRAM_WORDS ? program[fsr] & 0xFF : 0xFF;
+    }
+    uint16_t addr = fsrAddress(fsr);
+    return addr == 0xFFFF ? 0 : read(addr);
+}
+
+void PicEmu::writeIndirect(uint16_t fsr, uint8_t value) {
+    if (fsr >= 0x8000) return;
+    uint16_t addr = fsrAddress(fsr);
+    if (addr != 0xFFFF) write(addr, value);
+}
+
+uint8_t PicEmu::read(uint16_t addr) {
+    uint8_t off = addr & 0x7F;
+    if (off == REG_INDF0 || off == REG_INDF1)
+        return readIndirect(ram[REG_FSR0L + off*2] | ram[REG_FSR0L + off*2 + 1] << 8);
+    if (off == REG_WREG) return w;
+    if (off < 0x0C || off >= 0x70) return ram[off];
+    switch (addr) {
+        case REG_PORTA: return ((pinsA & ram[REG_TRISA]) | (ram[REG_LATA] & ~ram[REG_TRISA])) & 0x3F;
+        case REG_PORTC: return ((pinsC & ram[REG_TRISC]) | (ram[REG_LATC] & ~ram[REG_TRISC])) & 0x3F;
+        case REG_PMCON2: return 0;
+        default: return ram[addr];
+    }
+}
+
+void PicEmu::write(uint16_t addr, uint8_t value) {
+    uint8_t off = addr & 0x7F;
+    if (off == REG_INDF0 || off == REG_INDF1) {
+        writeIndirect(ram[REG_FSR0L + off*2] | ram[REG_FSR0L + off*2 + 1] << 8, value);
+        return;
+    }
+    if (off < 0x0C) {
+        switch (off) {
+            case REG_PCL: pc = (ram[REG_PCLATH] << 8 | value) & (PIC_PROGRAM_WORDS - 1); break;
+            case REG_STATUS: ram[off] = (ram[off] & 0x18) | (value & 0x07); break;
+            case REG_BSR: ram[off] = value & 0x1F; break;
+            case REG_PCLATH: ram[off] = value & 0x7F; break;
+            case REG_WREG: w = value; break;
+            default: ram[off] = value; break;
+        }
+        return;
+    }
+    if (off >= 0x70) {
+        ram[off] = value;
+        return;
+    }
+    switch (addr) {
+        case REG_PORTA: ram[REG_LATA] = value; break;
+        case REG_PORTC: ram[REG_LATC] = value; break;
+        case REG_OSCCON:
+            ram[addr] = value;
+            updateClock();
+            break;
+        case REG_WDTCON0:
+            if ((value & 1) && !(ram[addr] & 1)) wdtDeadline = now + PIC_WDT_PERIOD;
+            else if (!(value & 1)) wdtDeadline = 0; // turning it off clears it
+            ram[addr] = value;
+            break;
+        case REG_PMCON1:
+            ram[addr] = (value & 0x7F) | 0x80 | (ram[addr] & 0x03); // WR and RD can only be set
+            if (value & 0x01) { // RD
+                uint16_t pmadr = (ram[REG_PMADRH] << 8 | ram[REG_PMADRL]) & 0x7FFF;
+                uint16_t word = (value & 0x40) || pmadr >= PIC_PROGRAM_WORDS ? 0x3FFF : program[pmadr];
+                ram[REG_PMDATL] = word & 0xFF;
+                ram[REG_PMDATH] = word >> 8;
+                ram[addr] &= ~0x01;
+            }
+            if (value & 0x02) flashOperation();
+            break;
+        case REG_PMCON2:
+            if (value == 0x55) unlock = 1;
+            else if (value == 0xAA && unlock == 1) unlock = 2;
+            else unlock = 0;
+            break;
+        default: ram[addr] = value; break;
+    }
+}
+
+// Carries out a self-programming operation once WR has been set.
+void PicEmu::flashOperation() {
+    uint8_t con = ram[REG_PMCON1];
+    bool unlocked = unlock == 2;
+    unlock = 0;
+    ram[REG_PMCON1] &= ~0x02;
+    if (!unlocked || !(con & 0x04)) return; // needs the unlock sequence and WREN
+    if (con & 0x40) return; // configuration space can't be changed from software
+    uint16_t pmadr = (ram[REG_PMADRH] << 8 | ram[REG_PMADRL]) & 0x7FFF;
+    uint16_t row = pmadr & ~(PIC_LATCH_WORDS - 1);
+    if (con & 0x10) { // FREE: erase the row
+        if (row < PIC_PROGRAM_WORDS) for (int i = 0; i < PIC_LATCH_WORDS; i++) program[row + i] = 0x3FFF;
+        now += PIC_FLASH_TIME;
+        return;
+    }
+    latches[pmadr % PIC_LATCH_WORDS] = (ram[REG_PMDATH] << 8 | ram[REG_PMDATL]) & 0x3FFF;
+    if (con & 0x20) return; // LWLO: only load the latch
+    if (row < PIC_PROGRAM_WORDS) for (int i = 0; i < PIC_LATCH_WORDS; i++) program[row + i] &= latches[i];
+    for (int i = 0; i < PIC_LATCH_WORDS; i++) latches[i] = 0x3FFF;
+    now += PIC_FLASH_TIME;
+}
+
+bool PicEmu::push(uint16_t addr) {
+    if (sp == PIC_STACK_DEPTH) {
+        reset(Reset::StackOverflow);
+        return false;
+    }
+    stack[sp++] = addr;
+    return true;
+}
+
+bool PicEmu::pop(uint16_t * addr) {
+    if (sp == 0) {
+        reset(Reset::StackUnderflow);
+        return false;
+    }
+    *addr = stack[--sp];
+    return true;
+}
+
+void PicEmu::setInputs(uint8_t porta, uint8_t portc) {
+    bool rising = (ram[REG_OPTION] & 0x40) != 0;
+    bool was = pinsA & 0x04, is = porta & 0x04;
+    if (was != is && is == rising) ram[REG_INTCON] |= INTCON_INTF;
+    pinsA = porta;
+    pinsC = portc;
+}
+
+void PicEmu::setZ(uint8_t result) {
+    if (result == 0) ram[REG_STATUS] |= STATUS_Z;
+    else ram[REG_STATUS] &= ~STATUS_Z;
+}
+
+void PicEmu::setFlags(bool c, bool dc, uint8_t result) {
+    ram[REG_STATUS] = (ram[REG_STATUS] & ~(STATUS_C | STATUS_DC | STATUS_Z)) | (c ? STATUS_C : 0) | (dc ? STATUS_DC : 0) | (result == 0 ? STATUS_Z : 0);
+}
+
+unsigned PicEmu::step() {
+    uint8_t& intcon = ram[REG_INTCON];
+    if ((intcon & (INTCON_GIE | INTCON_INTE | INTCON_INTF)) == (INTCON_GIE | INTCON_INTE | INTCON_INTF)) {
+        interruptCount++;
+        if (!push(pc)) return 1;
+        shadow[0] = ram[REG_STATUS];
+        shadow[1] = w;
+        shadow[2] = ram[REG_BSR];
+        shadow[3] = ram[REG_PCLATH];
+        memcpy(shadow + 4, ram + REG_FSR0L, 4);
+        intcon &= ~INTCON_GIE;
+        pc = 4;
+        return 3;
+    }
+    uint16_t op = program[pc];
+    pc = (pc + 1) & (PIC_PROGRAM_WORDS - 1);
+    unsigned cycles = 1;
+    extraCycle = false;
+    uint8_t status = ram[REG_STATUS];
+    bool carry = status & STATUS_C;
+    uint8_t f = op & 0x7F;
+    bool d = op & 0x80;
+    uint8_t k = op & 0xFF;
+    uint16_t addr = bankAddress(f);
+    // stores a byte-oriented result in f or W, and notes a jump from writing PCL
+    auto store = [&](uint8_t r) {
+        if (d) {
+            write(addr, r);
+            if (f == REG_PCL) cycles = 2;
+        } else w = r;
+    };
+    switch (op >> 12) {
+    case 0:
+        switch ((op >> 8) & 0x0F) {
+        case 0x0:
+            if (op & 0x80) { // MOVWF
+                write(addr, w);
+                if (f == REG_PCL) cycles = 2;
+            } else if (op == 0x0000) { // NOP
+            } else if (op == 0x0001) { // RESET
+                reset(Reset::Instruction);
+            } else if (op == 0x0008) { // RETURN
+                pop(&pc);
+                cycles = 2;
+            } else if (op == 0x0009) { // RETFIE
+                if (pop(&pc)) {
+                    ram[REG_STATUS] = shadow[0];
+                    w = shadow[1];
+                    ram[REG_BSR] = shadow[2];
+                    ram[REG_PCLATH] = shadow[3];
+                    memcpy(ram + REG_FSR0L, shadow + 4, 4);
+                    intcon |= INTCON_GIE;
+                }
+                cycles = 2;
+            } else if (op == 0x000A) { // CALLW
+                if (push(pc)) pc = (ram[REG_PCLATH] << 8 | w) & (PIC_PROGRAM_WORDS - 1);
+                cycles = 2;
+            } else if (op == 0x000B) { // BRW
+                pc = (pc + w) & (PIC_PROGRAM_WORDS - 1);
+                cycles = 2;
+            } else if ((op & 0xFFF0) == 0x0010) { // MOVIW/MOVWI with ++FSRn, --FSRn, FSRn++, FSRn--
+                uint8_t n = (op >> 2) & 1, mode = op & 3;
+                uint16_t fsr = ram[REG_FSR0L + n*2] | ram[REG_FSR0L + n*2 + 1] << 8;
+                if (mode == 0) fsr++;
+                else if (mode == 1) fsr--;
+                if (op & 0x08) writeIndirect(fsr, w);
+                else {
+                    w = readIndirect(fsr);
+                    setZ(w);
+                }
+                if (mode == 2) fsr++;
+                else if (mode == 3) fsr--;
+                ram[REG_FSR0L + n*2] = fsr & 0xFF;
+                ram[REG_FSR0L + n*2 + 1] = fsr >> 8;
+            } else if ((op & 0xFFE0) == 0x0020) { // MOVLB
+                ram[REG_BSR] = op & 0x1F;
+            } else if (op == 0x0062) { // OPTION
+                ram[REG_OPTION] = w;
+            } else if (op == 0x0063) { // SLEEP
+                sleeping = true;
+                ram[REG_STATUS] = (ram[REG_STATUS] & ~0x08) | 0x10;
+                if (wdtDeadline) wdtDeadline = now + PIC_WDT_PERIOD;
+            } else if (op == 0x0064) { // CLRWDT
+                ram[REG_STATUS] |= 0x18;
+                if (wdtDeadline) wdtDeadline = now + PIC_WDT_PERIOD;
+            } else if (op == 0x0065) { // TRIS PORTA
+                ram[REG_TRISA] = w;
+            } else if (op == 0x0067) { // TRIS PORTC
+                ram[REG_TRISC] = w;
+            }
+            break;
+        case 0x1: // CLRF, CLRW
+            if (d) write(addr, 0);
+            else w = 0;
+            ram[REG_STATUS] |= STATUS_Z;
+            break;
+        case 0x2: { // SUBWF
+            uint8_t a = read(addr);
+            uint8_t r = a - w;
+            setFlags(a >= w, (a & 0x0F) >= (w & 0x0F), r);
+            store(r);
+            break;
+        }
+        case 0x3: { // DECF
+            uint8_t r = read(addr) - 1;
+            setZ(r);
+            store(r);
+            break;
+        }
+        case 0x4: { // IORWF
+            uint8_t r = read(addr) | w;
+            setZ(r);
+            store(r);
+            break;
+        }
+        case 0x5: { // ANDWF
+            uint8_t r = read(addr) & w;
+            setZ(r);
+            store(r);
+            break;
+        }
+        case 0x6: { // XORWF
+            uint8_t r = read(addr) ^ w;
+            setZ(r);
+            store(r);
+            break;
+        }
+        case 0x7: { // ADDWF
+            uint8_t a = read(addr);
+            unsigned r = a + w;
+            setFlags(r > 0xFF, (a & 0x0F) + (w & 0x0F) > 0x0F, r);
+            store(r);
+            break;
+        }
+        case 0x8: { // MOVF
+            uint8_t r = read(addr);
+            setZ(r);
+            store(r);
+            break;
+        }
+        case 0x9: { // COMF
+            uint8_t r = ~read(addr);
+            setZ(r);
+            store(r);
+            break;
+        }
+        case 0xA: { // INCF
+            uint8_t r = read(addr) + 1;
+            setZ(r);
+            store(r);
+            break;
+        }
+        case 0xB: { // DECFSZ
+            uint8_t r = read(addr) - 1;
+            store(r);
+            if (r == 0) {
+                pc = (pc + 1) & (PIC_PROGRAM_WORDS - 1);
+                cycles = 2;
+            }
+            break;
+        }
+        case 0xC: { // RRF
+            uint8_t a = read(addr);
+            ram[REG_STATUS] = (ram[REG_STATUS] & ~STATUS_C) | (a & 1);
+            store(a >> 1 | (carry ? 0x80 : 0));
+            break;
+        }
+        case 0xD: { // RLF
+            uint8_t a = read(addr);
+            ram[REG_STATUS] = (ram[REG_STATUS] & ~STATUS_C) | (a >> 7);
+            store(a << 1 | (carry ? 1 : 0));
+            break;
+        }
+        case 0xE: { // SWAPF
+            uint8_t a = read(addr);
+            store(a << 4 | a >> 4);
+            break;
+        }
+        case 0xF: { // INCFSZ
+            uint8_t r = read(addr) + 1;
+            store(r);
+            if (r == 0) {
+                pc = (pc + 1) & (PIC_PROGRAM_WORDS - 1);
+                cycles = 2;
+            }
+            break;
+        }
+        }
+        break;
+    case 1: { // BCF, BSF, BTFSC, BTFSS
+        uint8_t bit = 1 << ((op >> 7) & 7);
+        uint8_t a = read(addr);
+        switch ((op >> 10) & 3) {
+            case 0: write(addr, a & ~bit); break;
+            case 1: write(addr, a | bit); break;
+            case 2:
+                if (!(a & bit)) {
+                    pc = (pc + 1) & (PIC_PROGRAM_WORDS - 1);
+                    cycles = 2;
+                }
+                break;
+            case 3:
+                if (a & bit) {
+                    pc = (pc + 1) & (PIC_PROGRAM_WORDS - 1);
+                    cycles = 2;
+                }
+                break;
+        }
+        if (f == REG_PCL && (op >> 11 & 1) == 0) cycles = 2;
+        break;
+    }
+    case 2: { // CALL, GOTO
+        uint16_t target = ((ram[REG_PCLATH] & 0x78) << 8 | (op & 0x7FF)) & (PIC_PROGRAM_WORDS - 1);
+        if (!(op & 0x800) && !push(pc)) return 1;
+        pc = target;
+        cycles = 2;
+        break;
+    }
+    case 3:
+        switch ((op >> 8) & 0x0F) {
+        case 0x0: // MOVLW
+            w = k;
+            break;
+        case 0x1:
+            if (op & 0x80) ram[REG_PCLATH] = op & 0x7F; // MOVLP
+            else { // ADDFSR
+                uint8_t n = (op >> 6) & 1;
+                uint16_t fsr = ram[REG_FSR0L + n*2] | ram[REG_FSR0L + n*2 + 1] << 8;
+                fsr += (int8_t)((op & 0x3F) << 2) >> 2;
+                ram[REG_FSR0L + n*2] = fsr & 0xFF;
+                ram[REG_FSR0L + n*2 + 1] = fsr >> 8;
+            }
+            break;
+        case 0x2: case 0x3: { // BRA
+            int16_t offset = op & 0x1FF;
+            if (offset & 0x100) offset -= 0x200;
+            pc = (pc + offset) & (PIC_PROGRAM_WORDS - 1);
+            cycles = 2;
+            break;
+        }
+        case 0x4: // RETLW
+            w = k;
+            pop(&pc);
+            cycles = 2;
+            break;
+        case 0x5: { // LSLF
+            uint8_t a = read(addr);
+            uint8_t r = a << 1;
+            ram[REG_STATUS] = (ram[REG_STATUS] & ~STATUS_C) | (a >> 7);
+            setZ(r);
+            store(r);
+            break;
+        }
+        case 0x6: { // LSRF
+            uint8_t a = read(addr);
+            uint8_t r = a >> 1;
+            ram[REG_STATUS] = (ram[REG_STATUS] & ~STATUS_C) | (a & 1);
+            setZ(r);
+            store(r);
+            break;
+        }
+        case 0x7: { // ASRF
+            uint8_t a = read(addr);
+            uint8_t r = (a >> 1) | (a & 0x80);
+            ram[REG_STATUS] = (ram[REG_STATUS] & ~STATUS_C) | (a & 1);
+            setZ(r);
+            store(r);
+            break;
+        }
+        case 0x8: // IORLW
+            w |= k;
+            setZ(w);
+            break;
+        case 0x9: // ANDLW
+            w &= k;
+            setZ(w);
+            break;
+        case 0xA: // XORLW
+            w ^= k;
+            setZ(w);
+            break;
+        case 0xB: { // SUBWFB
+            uint8_t a = read(addr);
+            unsigned b = w + (carry ? 0 : 1);
+            uint8_t r = a - b;
+            setFlags(a >= b, (a & 0x0F) >= (w & 0x0F) + (carry ? 0 : 1), r);
+            store(r);
+            break;
+        }
+        case 0xC: { // SUBLW
+            uint8_t r = k - w;
+            setFlags(k >= w, (k & 0x0F) >= (w & 0x0F), r);
+            w = r;
+            break;
+        }
+        case 0xD: { // ADDWFC
+            uint8_t a = read(addr);
+            unsigned r = a + w + carry;
+            setFlags(r > 0xFF, (a & 0x0F) + (w & 0x0F) + carry > 0x0F, r);
+            store(r);
+            break;
+        }
+        case 0xE: { // ADDLW
+            unsigned r = w + k;
+            setFlags(r > 0xFF, (w & 0x0F) + (k & 0x0F) > 0x0F, r);
+            w = r;
+            break;
+        }
+        case 0xF: { // MOVIW k[n], MOVWI k[n]
+            uint8_t n = (op >> 6) & 1;
+            uint16_t fsr = ram[REG_FSR0L + n*2] | ram[REG_FSR0L + n*2 + 1] << 8;
+            fsr += (int8_t)((op & 0x3F) << 2) >> 2;
+            if (op & 0x80) writeIndirect(fsr, w);
+            else {
+                w = readIndirect(fsr);
+                setZ(w);
+            }
+            break;
+        }
+        }
+        break;
+    }
+    if (extraCycle) cycles++;
+    return cycles;
+}
+
+void PicEmu::runUntil(uint64_t time) {
+    while (now < time) {
+        if (wdtDeadline && now >= wdtDeadline) {
+            if (sleeping) {
+                sleeping = false; // the watchdog only wakes the chip from sleep
+                wdtDeadline = now + PIC_WDT_PERIOD;
+            } else reset(Reset::Watchdog);
+        }
+        if (sleeping) {
+            if ((ram[REG_INTCON] & (INTCON_INTE | INTCON_INTF)) != (INTCON_INTE | INTCON_INTF)) {
+                now = wdtDeadline && wdtDeadline < time ? wdtDeadline : time;
+                continue;
+            }
+            sleeping = false;
+        }
+        unsigned cycles = step();
+        cycleCount += cycles;
+        now += (uint64_t)cycles * tcy;
+    }
+}
+
+uint8_t picPowerOnByte(uint16_t addr) {
+    uint32_t x = (addr + 1) * 0x9E3779B1u;
+    return (x ^ (x >> 15)) >> 24;
+}
+
+static int hexDigit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    else if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    else if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    else return -1;
+}
+
+bool picLoadHex(std::istream& in, uint16_t program[PIC_PROGRAM_WORDS]) {
+    for (int i = 0; i < PIC_PROGRAM_WORDS; i++) program[i] = 0x3FFF;
+    uint16_t addrHi = 0;
+    std::string line;
+    while (std::getline(in, line) && line != "UF2") {
+        while (!line.empty() && (line.back() == '\r' || line.back() == ' ')) line.pop_back();
+        if (line.empty()) continue;
+        if (line[0] != ':' || line.size() < 11 || line.size() % 2 == 0) return false;
+        uint8_t record[260];
+        size_t size = (line.size() - 1) / 2;
+        if (size > sizeof(record)) return false;
+        uint8_t sum = 0;
+        for (size_t i = 0; i < size; i++) {
+            int hi = hexDigit(line[1 + i*2]), lo = hexDigit(line[2 + i*2]);
+            if (hi < 0 || lo < 0) return false;
+            record[i] = hi << 4 | lo;
+            sum += record[i];
+        }
+        if (sum != 0 || size != record[0] + 5u) return false;
+        uint16_t addr = (record[1] << 8 | record[2]) >> 1;
+        switch (record[3]) {
+            case 0:
+                if (addrHi != 0) break; // configuration words
+                for (int i = 0; i < record[0] / 2; i++)
+                    if (addr + i < PIC_PROGRAM_WORDS) program[addr + i] = (record[4 + i*2] | record[5 + i*2] << 8) & 0x3FFF;
+                break;
+            case 1: return true;
+            case 4: addrHi = record[4] << 8 | record[5]; break;
+            default: break;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,86 @@
+/*
+ * pico-sound-driver/pic_emu.h
+ * PSG
+ *
+ * This file contains an instruction-level emulator of the PIC16LF1613 channel
+ * chips, which runs the PIC firmware itself (as built from PSG.X) so that what a
+ * chip would output can be worked out on a computer with no board attached. Time
+ * is kept in nanoseconds and every instruction takes its real number of cycles
+ * at the clock selected in OSCCON, so the DAC is written at the same moments as
+ * on the chip.
+ *
+ * This code is licensed under the GPLv2 license.
+ * Copyright (c) 2022-2023 JackMacWindows.
+ */
+
+#ifndef PIC_EMU_H
+#define PIC_EMU_H
+
+#include <stdint.h>
+#include <istream>
+
+#define PIC_PROGRAM_WORDS 0x800
+#define PIC_LATCH_WORDS 16 // words in a flash row, and in the write latches
+#define PIC_STACK_DEPTH 16
+#define PIC_WDT_PERIOD 4000000 // ns; 1:128 from the WDTCPS config bits
+#define PIC_FLASH_TIME 2000000 // ns the CPU stalls for a row erase or write
+
+class PicEmu {
+public:
+    // Starts the chip from a power-on reset with the given program memory.
+    explicit PicEmu(const uint16_t * program);
+    // Runs every instruction that starts before the given time.
+    void runUntil(uint64_t time);
+    // Sets the levels on the input pins, as they are from now on. A rising
+    // edge on RA2 sets INTF (with INTEDG set, as the firmware does).
+    void setInputs(uint8_t porta, uint8_t portc);
+    uint8_t dac() const {return ram[0x119];} // DAC1CON1
+    bool dacEnabled() const {return ram[0x118] & 0x80;}
+    uint64_t time() const {return now;}
+    uint64_t cycles() const {return cycleCount;}
+    uint64_t interrupts() const {return interruptCount;}
+    uint8_t peek(uint16_t addr) const; // a data memory location, without side effects
+private:
+    enum class Reset {PowerOn, Instruction, Watchdog, StackOverflow, StackUnderflow};
+
+    uint16_t program[PIC_PROGRAM_WORDS];
+    uint8_t ram[32 * 128]; // banked data memory; core registers and common RAM live in bank 0
+    uint16_t stack[PIC_STACK_DEPTH];
+    uint8_t sp; // entries on the stack
+    uint16_t pc;
+    uint8_t w;
+    uint8_t shadow[8]; // STATUS, WREG, BSR, PCLATH, FSR0L/H, FSR1L/H, saved on interrupt
+    uint8_t pinsA, pinsC; // input pin levels
+    uint16_t latches[PIC_LATCH_WORDS];
+    uint8_t unlock; // 0x55 then 0xAA written to PMCON2
+    uint32_t tcy; // ns per instruction cycle
+    uint64_t now; // ns
+    uint64_t wdtDeadline; // 0 = watchdog off
+    uint64_t cycleCount, interruptCount;
+    bool sleeping;
+    bool extraCycle; // the current instruction read program memory through an FSR
+
+    void reset(Reset kind);
+    void updateClock();
+    uint16_t bankAddress(uint8_t f) const {return (ram[0x08] & 0x1F) << 7 | f;}
+    uint8_t read(uint16_t addr);
+    void write(uint16_t addr, uint8_t value);
+    uint8_t readIndirect(uint16_t fsr);
+    void writeIndirect(uint16_t fsr, uint8_t value);
+    void flashOperation();
+    bool push(uint16_t addr); // false if the stack overflowed and the chip reset
+    bool pop(uint16_t * addr);
+    void setZ(uint8_t value);
+    void setFlags(bool c, bool dc, uint8_t result);
+    unsigned step(); // runs one instruction and returns its cycle count
+};
+
+// What's in general purpose RAM at power-on. It's undefined on a real chip; this
+// is a fixed scramble of the address so that runs are repeatable.
+uint8_t picPowerOnByte(uint16_t addr);
+
+// Reads the program memory out of an Intel HEX file, or the HEX half of a
+// combined firmware.bin. Words not in the file are left erased.
+bool picLoadHex(std::istream& in, uint16_t program[PIC_PROGRAM_WORDS]);
+
+#endif
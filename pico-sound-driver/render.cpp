@@ -0,0 +1,118 @@
+/*
+ * pico-sound-driver/render.cpp
+ * PSG
+ *
+ * This file contains a renderer that plays a bus trace from psg-host (or a logic
+ * analyzer capture in the same format) into emulated PIC chips, and writes what
+ * they output to a WAV file. Each chip runs the real PIC firmware, and sees the
+ * shift register, data bus and clock the same way its pins are wired on the
+ * board, so commands the chip would miss or take late are missed or late here.
+ *
+ * Usage: psg-render [-c chip] [-r rate-hz] [-d extra-ms] [-s] <pic.hex|firmware.bin> <trace.csv> <output.wav>
+ *
+ * By default the DAC is sampled every 70 cycles at 32 MHz, the rate the firmware
+ * writes it at, so with -c each sample is exactly the value the chip had in its
+ * DAC at that moment, as 8-bit unsigned PCM. Without -c, every chip is mixed
+ * into 16-bit PCM. -s prints each chip's wave, volume and increment at the end.
+ *
+ * This code is licensed under the GPLv2 license.
+ * Copyright (c) 2022-2023 JackMacWindows.
+ */
+
+#include "chip_render.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Reads a trace into the splitter, and returns the time of the last transition in it.
+static bool readTrace(std::istream& in, BusSplitter& bus, uint64_t * last) {
+    std::string line;
+    if (!std::getline(in, line)) return false; // header
+    *last = 0;
+    while (std::getline(in, line)) {
+        unsigned long long time;
+        unsigned pin, value;
+        if (sscanf(line.c_str(), "%llu,%u,%u", &time, &pin, &value) != 3) continue;
+        bus.gpio(time, pin, value != 0);
+        *last = time * 1000;
+    }
+    bus.finish();
+    return true;
+}
+
+int main(int argc, const char * argv[]) {
+    int only = -1;
+    unsigned rate = 0;
+    uint64_t extra = 100;
+    bool showState = false;
+    std::vector<const char *> files;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-c" && i + 1 < argc) only = std::stoi(argv[++i]);
+        else if (arg == "-r" && i + 1 < argc) rate = std::stoul(argv[++i]);
+        else if (arg == "-d" && i + 1 < argc) extra = std::stoull(argv[++i]);
+        else if (arg == "-s") showState = true;
+        else files.push_back(argv[i]);
+    }
+    if (files.size() != 3 || only >= CHIPS) {
+        std::cerr << "Usage: " << argv[0] << " [-c chip] [-r rate-hz] [-d extra-ms] [-s] <pic.hex|firmware.bin> <trace.csv> <output.wav>\n";
+        return 1;
+    }
+    std::ifstream hex(files[0]);
+    static uint16_t program[PIC_PROGRAM_WORDS];
+    if (!hex.is_open() || !picLoadHex(hex, program)) {
+        std::cerr << "Could not read PIC firmware\n";
+        return 2;
+    }
+    std::ifstream traceIn(files[1]);
+    BusSplitter bus;
+    uint64_t last;
+    if (!traceIn.is_open() || !readTrace(traceIn, bus, &last)) {
+        std::cerr << "Could not read trace file\n";
+        return 2;
+    }
+    std::ofstream out(files[2], std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "Could not open output file\n";
+        return 2;
+    }
+
+    std::vector<std::unique_ptr<ChipEmulator>> chips;
+    for (int i = 0; i < CHIPS; i++) chips.emplace_back(new ChipEmulator(bus.states, i, program));
+    uint64_t end = last + extra * 1000000;
+    uint32_t wavRate = rate ? rate : CHIP_SAMPLE_RATE;
+    int bits = only >= 0 ? 8 : 16;
+    writeWAVHeader(out, wavRate, 1, bits, 0);
+    uint32_t samples = 0;
+    int16_t peak = 0;
+    for (uint64_t time = 0; time <= end; time = rate ? (uint64_t)samples * 1000000000 / rate : (uint64_t)samples * CHIP_SAMPLE_PERIOD) {
+        if (only >= 0) out.put((char)chips[only]->sampleAt(time));
+        else {
+            int mix = 0;
+            for (int i = 0; i < CHIPS; i++) mix += ((int)chips[i]->sampleAt(time) - 128) * 16;
+            int16_t sample = mix > 32767 ? 32767 : (mix < -32768 ? -32768 : mix);
+            if (abs(sample) > peak) peak = abs(sample);
+            writeLE(out, (uint16_t)sample, 2);
+        }
+        samples++;
+    }
+
+    out.seekp(0);
+    writeWAVHeader(out, wavRate, 1, bits, samples);
+    out.close();
+    std::cout << "Samples:          " << samples << " at " << wavRate << " Hz\n";
+    if (only < 0) std::cout << "Peak:             " << peak << "\n";
+    for (int i = 0; i < CHIPS; i++) {
+        if (only >= 0 && i != only) continue;
+        if (showState || only >= 0) {
+            const PicEmu& pic = chips[i]->emulator();
+            std::cout << "Chip " << i << (i < 10 ? ":          " : ":         ") << "wave " << (int)pic.peek(0x70) << ", volume " << (int)pic.peek(0x71)
+                << ", increment " << (pic.peek(0x72) << 8 | pic.peek(0x73)) << ", " << pic.interrupts() << " interrupts\n";
+        }
+    }
+    return 0;
+}
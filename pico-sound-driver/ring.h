@@ -0,0 +1,59 @@
+/*
+ * pico-sound-driver/ring.h
+ * PSG
+ *
+ * This file contains a lock-free single-producer/single-consumer ring buffer,
+ * used to hand events from the USB core to the bus core without either side
+ * ever waiting on the other. Only plain atomic loads and stores are used, which
+ * the Cortex-M0+ supports without any library help.
+ *
+ * This code is licensed under the GPLv2 license.
+ * Copyright (c) 2022-2023 JackMacWindows.
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+#include <atomic>
+
+template<typename T, uint32_t N> class SPSCRing {
+    static_assert((N & (N - 1)) == 0, "ring size must be a power of 2");
+    T buffer[N];
+    std::atomic<uint32_t> head{0}; // written by producer
+    std::atomic<uint32_t> tail{0}; // written by consumer
+public:
+    // producer side
+    bool full() const {
+        return head.load(std::memory_order_relaxed) - tail.load(std::memory_order_acquire) >= N;
+    }
+    bool push(const T& item) {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) >= N) return false;
+        buffer[h & (N - 1)] = item;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+    // consumer side
+    bool pop(T& item) {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)) return false;
+        item = buffer[t & (N - 1)];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+    bool peek(T& item) const {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)) return false;
+        item = buffer[t & (N - 1)];
+        return true;
+    }
+    bool empty() const {
+        return tail.load(std::memory_order_relaxed) == head.load(std::memory_order_acquire);
+    }
+    uint32_t size() const {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+};
+
+#endif
@@ -0,0 +1,119 @@
+/*
+ * pico-sound-driver/tables.h
+ * PSG
+ *
+ * This file contains the precomputed fixed-point lookup tables the control path
+ * uses in place of floating-point math. The tables were generated with the
+ * formulas noted above each one.
+ *
+ * This code is licensed under the GPLv2 license.
+ * Copyright (c) 2022-2023 JackMacWindows.
+ */
+
+#ifndef TABLES_H
+#define TABLES_H
+
+#include <stdint.h>
+
+// PIC wave increment for each MIDI note, in 16.16 fixed point:
+// round(440 * 2^((n - 69) / 12) * (65536 * CLOCKS_PER_LOOP / 8000000) * 65536)
+static const uint32_t noteTable[128] = {
+    307254, 325525, 344881, 365389, 387116, 410135, 434523, 460361,
+    487736, 516738, 547465, 580019, 614509, 651049, 689763, 730778,
+    774233, 820271, 869047, 920723, 975472, 1033477, 1094930, 1160038,
+    1229018, 1302099, 1379526, 1461556, 1548465, 1640542, 1738093, 1841446,
+    1950944, 2066953, 2189860, 2320076, 2458035, 2604198, 2759051, 2923113,
+    3096930, 3281083, 3476187, 3682892, 3901888, 4133906, 4379721, 4640153,
+    4916070, 5208395, 5518103, 5846226, 6193861, 6562167, 6952374, 7365783,
+    7803775, 8267812, 8759442, 9280305, 9832141, 10416790, 11036205, 11692452,
+    12387721, 13124334, 13904747, 14731566, 15607551, 16535624, 17518883, 18560610,
+    19664282, 20833581, 22072410, 23384904, 24775443, 26248667, 27809494, 29463133,
+    31215102, 33071248, 35037767, 37121221, 39328564, 41667162, 44144820, 46769808,
+    49550885, 52497334, 55618988, 58926265, 62430203, 66142496, 70075534, 74242442,
+    78657127, 83334323, 88289640, 93539615, 99101770, 104994668, 111237976, 117852530,
+    124860407, 132284993, 140151068, 148484884, 157314255, 166668647, 176579280, 187079231,
+    198203541, 209989337, 222475952, 235705061, 249720813, 264569985, 280302135, 296969768,
+    314628509, 333337294, 353158561, 374158462, 396407082, 419978673, 444951905, 471410122
+};
+
+// 2^(i / 192) in 2.30 fixed point, one entry per 1/16 semitone across an octave
+static const uint32_t pitchTable[193] = {
+    1073741824, 1077625190, 1081522600, 1085434106, 1089359758, 1093299609, 1097253708, 1101222108,
+    1105204861, 1109202018, 1113213631, 1117239753, 1121280436, 1125335733, 1129405696, 1133490379,
+    1137589835, 1141704118, 1145833280, 1149977377, 1154136461, 1158310587, 1162499809, 1166704183,
+    1170923762, 1175158602, 1179408758, 1183674286, 1187955240, 1192251678, 1196563654, 1200891225,
+    1205234447, 1209593378, 1213968073, 1218358590, 1222764986, 1227187318, 1231625645, 1236080024,
+    1240550512, 1245037169, 1249540052, 1254059221, 1258594735, 1263146652, 1267715031, 1272299933,
+    1276901417, 1281519543, 1286154371, 1290805962, 1295474376, 1300159674, 1304861917, 1309581167,
+    1314317484, 1319070932, 1323841571, 1328629463, 1333434672, 1338257260, 1343097290, 1347954824,
+    1352829926, 1357722660, 1362633090, 1367561278, 1372507291, 1377471191, 1382453044, 1387452915,
+    1392470869, 1397506971, 1402561287, 1407633882, 1412724824, 1417834178, 1422962010, 1428108389,
+    1433273380, 1438457051, 1443659470, 1448880704, 1454120821, 1459379890, 1464657980, 1469955159,
+    1475271496, 1480607060, 1485961921, 1491336149, 1496729814, 1502142985, 1507575735, 1513028133,
+    1518500250, 1523992158, 1529503929, 1535035634, 1540587345, 1546159135, 1551751076, 1557363241,
+    1562995704, 1568648537, 1574321815, 1580015611, 1585730000, 1591465055, 1597220853, 1602997467,
+    1608794974, 1614613448, 1620452965, 1626313602, 1632195435, 1638098541, 1644022996, 1649968878,
+    1655936265, 1661925233, 1667935861, 1673968228, 1680022412, 1686098492, 1692196547, 1698316657,
+    1704458901, 1710623359, 1716810113, 1723019241, 1729250827, 1735504949, 1741781691, 1748081133,
+    1754403359, 1760748450, 1767116489, 1773507559, 1779921743, 1786359126, 1792819790, 1799303821,
+    1805811301, 1812342318, 1818896955, 1825475297, 1832077432, 1838703444, 1845353420, 1852027447,
+    1858725612, 1865448001, 1872194703, 1878965806, 1885761398, 1892581567, 1899426403, 1906295993,
+    1913190429, 1920109800, 1927054196, 1934023707, 1941018425, 1948038440, 1955083844, 1962154730,
+    1969251188, 1976373312, 1983521194, 1990694927, 1997894606, 2005120323, 2012372174, 2019650252,
+    2026954652, 2034285470, 2041642801, 2049026741, 2056437387, 2063874834, 2071339180, 2078830522,
+    2086348957, 2093894584, 2101467502, 2109067808, 2116695602, 2124350982, 2132034050, 2139744905,
+    2147483648
+};
+
+// PIC volume level for each MIDI volume: floor(13 * ln(v + 1) + 0.5)
+static const uint8_t volumeLaw[128] = {
+    0, 9, 14, 18, 21, 23, 25, 27, 29, 30, 31, 32, 33, 34, 35, 36,
+    37, 38, 38, 39, 40, 40, 41, 41, 42, 42, 43, 43, 44, 44, 45, 45,
+    45, 46, 46, 47, 47, 47, 48, 48, 48, 49, 49, 49, 49, 50, 50, 50,
+    51, 51, 51, 51, 52, 52, 52, 52, 53, 53, 53, 53, 53, 54, 54, 54,
+    54, 54, 55, 55, 55, 55, 55, 56, 56, 56, 56, 56, 56, 57, 57, 57,
+    57, 57, 57, 58, 58, 58, 58, 58, 58, 58, 59, 59, 59, 59, 59, 59,
+    59, 60, 60, 60, 60, 60, 60, 60, 61, 61, 61, 61, 61, 61, 61, 61,
+    61, 62, 62, 62, 62, 62, 62, 62, 62, 62, 63, 63, 63, 63, 63, 63
+};
+
+// Smallest volume in 7.16 fixed point that reaches each PIC volume level 1-63,
+// ceil(65536 * (exp((level - 0.5) / 13) - 1)), for looking up fractional
+// (panned) volumes on the same curve as volumeLaw
+static const uint32_t volumeSteps[63] = {
+    2570, 8016, 13897, 20248, 27108, 34515, 42515, 51155,
+    60485, 70562, 81444, 93196, 105888, 119595, 134398, 150384,
+    167649, 186294, 206430, 228176, 251661, 277024, 304415, 333996,
+    365942, 400442, 437701, 477940, 521396, 568326, 619009, 673744,
+    732856, 796695, 865638, 940094, 1020503, 1107342, 1201124, 1302404,
+    1411783, 1529908, 1657479, 1795249, 1944035, 2104719, 2278250, 2465657,
+    2668048, 2886623, 3122675, 3377601, 3652911, 3950234, 4271331, 4618102,
+    4992601, 5397045, 5833827, 6305534, 6814959, 7365116, 7959264
+};
+
+// Gain of the left and right chips for each MIDI pan value, in 0.16 fixed point:
+// left = min(pan + 1, 1), right = min(1 - pan, 1), pan = (p - 64) / (p > 64 ? 63 : 64)
+static const uint32_t panLaw[2][128] = {
+    {
+        0, 1024, 2048, 3072, 4096, 5120, 6144, 7168, 8192, 9216, 10240, 11264, 12288, 13312, 14336, 15360,
+        16384, 17408, 18432, 19456, 20480, 21504, 22528, 23552, 24576, 25600, 26624, 27648, 28672, 29696, 30720, 31744,
+        32768, 33792, 34816, 35840, 36864, 37888, 38912, 39936, 40960, 41984, 43008, 44032, 45056, 46080, 47104, 48128,
+        49152, 50176, 51200, 52224, 53248, 54272, 55296, 56320, 57344, 58368, 59392, 60416, 61440, 62464, 63488, 64512,
+        65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536,
+        65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536,
+        65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536,
+        65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536
+    },
+    {
+        65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536,
+        65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536,
+        65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536,
+        65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536, 65536,
+        65536, 64496, 63455, 62415, 61375, 60335, 59294, 58254, 57214, 56174, 55133, 54093, 53053, 52013, 50972, 49932,
+        48892, 47852, 46811, 45771, 44731, 43691, 42650, 41610, 40570, 39530, 38489, 37449, 36409, 35369, 34328, 33288,
+        32248, 31208, 30167, 29127, 28087, 27047, 26006, 24966, 23926, 22886, 21845, 20805, 19765, 18725, 17684, 16644,
+        15604, 14564, 13523, 12483, 11443, 10403, 9362, 8322, 7282, 6242, 5201, 4161, 3121, 2081, 1040, 0
+    }
+};
+
+#endif
@@ -0,0 +1,22 @@
+# Renders a checked-in MIDI file with psg-wav twice: with the chips' output
+# worked out directly, and with -e, running the PIC firmware in the emulator.
+# The two have to give the same samples, or the fast path has drifted from
+# what the firmware does.
+#
+# Run by ctest as: cmake -DWAV=... -DFIRMWARE=... -DMIDI=... -DOUTPUT=... -P emulate.cmake
+
+foreach(mode direct emulated)
+    if (mode STREQUAL "emulated")
+        set(args -e ${FIRMWARE})
+    else()
+        set(args)
+    endif()
+    execute_process(COMMAND ${WAV} ${args} -d 30 ${MIDI} ${OUTPUT}-${mode}.wav RESULT_VARIABLE result OUTPUT_QUIET)
+    if (NOT result EQUAL 0)
+        message(FATAL_ERROR "psg-wav (${mode}) failed: ${result}")
+    endif()
+endforeach()
+execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${OUTPUT}-direct.wav ${OUTPUT}-emulated.wav RESULT_VARIABLE result)
+if (NOT result EQUAL 0)
+    message(FATAL_ERROR "psg-wav gives different samples with -e ${FIRMWARE}")
+endif()
@@ -0,0 +1,165 @@
+/*
+ * pico-sound-driver/tests/envelope.cpp
+ * PSG
+ *
+ * This file contains a test of the compiled envelopes: it steps a set of
+ * envelopes through the firmware's processEnvelope, alongside the float version
+ * it replaced, and checks that they agree on every tick and at sub-tick samples
+ * like the ones faster control rates take, through sustain, loops and release.
+ *
+ * The compiled values are the exact ones rounded down to 1/65536, so their
+ * integer part, which volume, pan and duty use as is, must match the exact
+ * value's on every sample, however long the segment. Rounded slopes on their
+ * own don't manage this: a slope like 1/3 lands a hair under the whole numbers
+ * it passes through, and truncates a step low.
+ *
+ * Samples where the float code went below 0 or above 65535 (extrapolating
+ * before an envelope's first point) aren't compared, since converting those
+ * back to integers was undefined.
+ *
+ * This code is licensed under the GPLv2 license.
+ * Copyright (c) 2022-2023 JackMacWindows.
+ */
+
+#include "hal_host.h"
+#include <math.h>
+#include <stdio.h>
+#include <vector>
+
+#define SUBSAMPLES 4 // sub-tick samples per tick, as at a control rate of 400 Hz
+#define TOLERANCE (1.0 / 64)
+#define MAX_SEGMENT 400 // longest segment in the made-up instruments
+
+struct Point {
+    uint16_t x, y;
+};
+
+// The envelope layout the float code used, with room for 12 points.
+struct Envelope {
+    Point points[12];
+    uint8_t npoints;
+    uint8_t sustain;
+    uint8_t loopStart;
+    uint8_t loopEnd;
+};
+
+// The float processEnvelope from before the slopes were compiled. It also says
+// whether it interpolated, so the exact value can be worked out alongside.
+static float processEnvelope(const Envelope * env, uint16_t * tick, uint8_t * point, bool release, bool advance, float frac, bool * interpolated) {
+    *interpolated = false;
+    if ((*point == env->sustain && !release) || *point + 1 >= env->npoints) return env->points[*point].y;
+    else if (advance && ++(*tick) >= env->points[*point+1].x) {
+        if (++(*point) == env->loopEnd && env->loopStart < 12 && !release) {
+            *point = env->loopStart;
+            *tick = env->points[*point].x;
+        }
+        return env->points[*point].y;
+    } else {
+        const Point a = env->points[*point], b = env->points[*point+1];
+        // between the ticks of a zero-length segment this divided by zero; the firmware holds the point's value
+        if (a.x == b.x) return a.y;
+        *interpolated = true;
+        return a.y + (b.y - a.y) * (((float)(*tick - a.x) + frac) / (float)(b.x - a.x));
+    }
+}
+
+static int64_t floorDiv(int64_t a, int64_t b) {
+    return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
+
+struct Case {
+    const char * name;
+    std::vector<Point> points;
+    uint8_t sustain, loopStart, loopEnd;
+    int releaseTick; // -1 = never
+    int ticks;
+};
+
+static unsigned failures = 0;
+static unsigned long samples = 0;
+static double maxError = 0;
+
+static void run(const Case& c) {
+    Envelope env = {};
+    for (size_t i = 0; i < c.points.size(); i++) env.points[i] = c.points[i];
+    env.npoints = c.points.size();
+    env.sustain = c.sustain;
+    env.loopStart = c.loopStart;
+    env.loopEnd = c.loopEnd;
+    psg_host_envelope_start((const uint16_t*)c.points.data(), env.npoints, env.sustain, env.loopStart, env.loopEnd);
+    uint16_t tick = 0;
+    uint8_t point = 0;
+    unsigned errors = 0;
+    for (int t = 0; t < c.ticks; t++) {
+        bool release = c.releaseTick >= 0 && t >= c.releaseTick;
+        for (int s = 0; s < SUBSAMPLES; s++) {
+            // the first sample of each tick moves the envelope on, and the rest are taken in between
+            bool advance = s == 0 && t > 0;
+            bool interpolated;
+            float expected = processEnvelope(&env, &tick, &point, release, advance, (float)s / SUBSAMPLES, &interpolated);
+            uint32_t value = psg_host_envelope_step(release, advance, s * 65536 / SUBSAMPLES);
+            if (expected < 0 || expected > 65535) continue;
+            double error = fabs(value / 65536.0 - expected);
+            if (error > maxError) maxError = error;
+            int64_t exact = (int64_t)expected;
+            if (interpolated) {
+                const Point a = env.points[point], b = env.points[point+1];
+                int64_t dx = (b.x - a.x) * SUBSAMPLES;
+                exact = floorDiv((int64_t)a.y * dx + ((int64_t)b.y - a.y) * ((tick - a.x) * SUBSAMPLES + s), dx);
+            }
+            samples++;
+            if (error > TOLERANCE || (int64_t)(value >> 16) != exact) {
+                if (errors++ < 5) printf("%s: tick %d sample %d: got %.5f, float code gave %.5f, exact %lld\n", c.name, t, s, value / 65536.0, expected, (long long)exact);
+            }
+        }
+    }
+    if (errors) {
+        printf("%s: %u samples wrong\n", c.name, errors);
+        failures++;
+    }
+}
+
+int main() {
+    psg_init();
+    std::vector<Case> cases = {
+        {"ramp", {{0, 0}, {100, 127}}, 0xFF, 0xFF, 0xFF, -1, 150},
+        {"thirds", {{0, 0}, {9, 3}, {12, 7}, {19, 0}}, 0xFF, 0xFF, 0xFF, -1, 30},
+        {"falling thirds", {{0, 127}, {3, 126}, {9, 124}, {30, 117}}, 0xFF, 0xFF, 0xFF, -1, 40},
+        {"sustain", {{0, 0}, {20, 127}, {40, 100}, {140, 0}}, 2, 0xFF, 0xFF, 80, 200},
+        {"early release", {{0, 0}, {20, 127}, {40, 100}, {140, 0}}, 2, 0xFF, 0xFF, 10, 200},
+        {"loop", {{0, 0}, {10, 127}, {30, 60}, {50, 127}, {80, 0}}, 0xFF, 1, 3, 200, 300},
+        {"loop with sustain", {{0, 0}, {7, 90}, {20, 33}, {27, 90}, {33, 0}}, 1, 1, 3, 150, 200},
+        {"zero length segment", {{0, 10}, {5, 50}, {5, 90}, {20, 0}}, 0xFF, 0xFF, 0xFF, -1, 30},
+        {"late start", {{10, 50}, {40, 100}}, 0xFF, 0xFF, 0xFF, -1, 60},
+        {"long segment", {{0, 0}, {180, 255}, {360, 1}}, 0xFF, 0xFF, 0xFF, -1, 400},
+        {"frequency", {{0, 0x8000}, {50, 0x8300}, {130, 0x7000}, {1000, 0x7010}}, 0xFF, 0xFF, 0xFF, -1, 1100},
+    };
+    // and a batch of made-up instruments
+    uint32_t seed = 1;
+    auto random = [&seed](uint32_t n) {
+        seed = seed * 1103515245 + 12345;
+        return (seed >> 16) % n;
+    };
+    for (int i = 0; i < 200; i++) {
+        Case c;
+        c.name = "random";
+        int n = 2 + random(11);
+        uint16_t x = random(4);
+        for (int j = 0; j < n; j++) {
+            c.points.push_back({x, (uint16_t)random(256)});
+            x += random(MAX_SEGMENT + 1);
+        }
+        c.sustain = random(3) == 0 ? random(n) : 0xFF;
+        c.loopStart = c.loopEnd = 0xFF;
+        if (n > 2 && random(2)) {
+            c.loopStart = random(n - 2);
+            c.loopEnd = c.loopStart + 1 + random(n - 1 - c.loopStart);
+        }
+        c.releaseTick = random(2) ? random(x + 1) : -1;
+        c.ticks = x * 2 + 10;
+        run(c);
+    }
+    for (const Case& c : cases) run(c);
+    printf("%lu samples, largest difference from the float code %.5f\n", samples, maxError);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,50 @@
+# Runs the programmer's fleet mode (-a) against the mock boards in
+# mock-portmidi.cpp: one that flashes normally, one that reports a block as
+# corrupted and has to be sent it again, one that rejects every block, and one
+# running firmware from before binary blocks, which has to be sent the HEX file
+# instead. All but the third should end up with the new PIC and Pico firmware,
+# and the third should be sent the empty block that ends a flash, resetting its
+# chips, and then be left alone after its PIC flash fails.
+#
+# The drives the boards turn into are made under a fake root, whose mount
+# table says they're mounted on ROOT/drive.
+#
+# Run by ctest as: cmake -DPROGRAMMER=... -DFIRMWARE=... -DROOT=... -P fleet.cmake
+
+file(REMOVE_RECURSE ${ROOT})
+file(MAKE_DIRECTORY ${ROOT}/dev/disk/by-id ${ROOT}/proc/self ${ROOT}/drive)
+file(WRITE ${ROOT}/proc/self/mountinfo "36 25 0:0 / ${ROOT}/drive rw,noatime - vfat /dev/sda1 rw\n")
+
+execute_process(COMMAND ${CMAKE_COMMAND} -E env
+        PSG_MOCK_BOARDS=ok,corrupt,reject,hex PSG_MOCK_IMAGE=${FIRMWARE} PSG_FAKE_ROOT=${ROOT}
+        ${PROGRAMMER} -a -b 2 ${FIRMWARE}
+    WORKING_DIRECTORY ${ROOT} RESULT_VARIABLE result OUTPUT_VARIABLE output ERROR_VARIABLE output)
+message("${output}")
+if (NOT result EQUAL 8)
+    message(FATAL_ERROR "programmer exited with ${result}, not 8 for a failed board")
+endif()
+foreach(expected
+        "Found 4 boards"
+        "00000000b0a2d000  OK                    OK \\(PSGv1\\.2\\.1\\)"
+        "00000000b0a2d001  OK                    OK \\(PSGv1\\.2\\.1\\)"
+        "00000000b0a2d002  malformed data        skipped"
+        "mock board 00000000b0a2d002: flash ended"
+        "00000000b0a2d003  OK                    OK \\(PSGv1\\.2\\.1\\)")
+    if (NOT output MATCHES "${expected}")
+        message(FATAL_ERROR "programmer output doesn't have \"${expected}\"")
+    endif()
+endforeach()
+
+# the drive has to hold the UF2 part of the firmware file, which is its end
+file(READ ${FIRMWARE} image HEX)
+file(READ ${ROOT}/drive/firmware.uf2 uf2 HEX)
+string(LENGTH "${image}" imageLength)
+string(LENGTH "${uf2}" uf2Length)
+if (uf2Length EQUAL 0 OR uf2Length GREATER imageLength)
+    message(FATAL_ERROR "firmware.uf2 wasn't written")
+endif()
+math(EXPR offset "${imageLength} - ${uf2Length}")
+string(SUBSTRING "${image}" ${offset} -1 tail)
+if (NOT tail STREQUAL uf2)
+    message(FATAL_ERROR "firmware.uf2 isn't the UF2 part of ${FIRMWARE}")
+endif()
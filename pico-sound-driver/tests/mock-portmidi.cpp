@@ -0,0 +1,290 @@
+/*
+ * pico-sound-driver/tests/mock-portmidi.cpp
+ * PSG
+ *
+ * This file contains a stand-in for PortMidi that plays a set of PSG boards,
+ * so the programmer's fleet mode can be run with no hardware. Each board has an
+ * output and an input port, listed in a different order from each other (and
+ * with another device in between), and answers identify requests, PIC manifests
+ * and PIC blocks the way the firmware does. It checks each block's CRC, and when
+ * a flash finishes, that it was sent exactly the rows of the image.
+ *
+ * The boards are set with PSG_MOCK_BOARDS, a comma-separated list with one word
+ * for each board:
+ *   ok      flashes normally
+ *   corrupt reports the first block it's sent as corrupted
+ *   reject  rejects every block of rows as malformed
+ *   hex     runs firmware from before binary blocks, which ignores manifests
+ *           and blocks and only takes the whole HEX file with 00 00
+ * PSG_MOCK_IMAGE names the firmware file the rows have to match. Each board
+ * says on stderr when the empty block that ends a flash reaches it.
+ *
+ * Sending a board into the Pico bootloader (SysEx 01 00) takes it off the port
+ * list and makes a drive for it under PSG_FAKE_ROOT/dev/disk/by-id, as the
+ * programmer expects. It comes back, one revision newer, once something has
+ * been written to PSG_FAKE_ROOT/drive/firmware.uf2.
+ *
+ * This code is licensed under the GPLv2 license.
+ * Copyright (c) 2022-2023 JackMacWindows.
+ */
+
+#include <portmidi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "psg-flash.h"
+
+struct MockBoard {
+    std::string serial;
+    std::string behavior;
+    int revision = 0;
+    bool bootloader = false;
+    bool corrupted = false; // whether a "corrupt" board has thrown away its block yet
+    PSGPicRows rows; // written since the flash started
+    std::map<uint16_t, uint32_t> hashes; // of the rows written by the last flash
+    std::deque<uint8_t> replies;
+};
+
+struct MockStream {
+    int board; // -1 for the other device
+    bool output;
+};
+
+static std::vector<MockBoard> boards;
+static std::vector<PmDeviceInfo> devices;
+static std::vector<MockStream> deviceStreams;
+static std::vector<std::string> deviceNames;
+static PSGPicRows image;
+static std::mutex mockLock;
+
+static std::string fakeRoot() {
+    const char * root = getenv("PSG_FAKE_ROOT");
+    return root ? root : "";
+}
+
+static void loadBoards() {
+    std::stringstream list(getenv("PSG_MOCK_BOARDS") ? getenv("PSG_MOCK_BOARDS") : "ok");
+    std::string behavior;
+    while (std::getline(list, behavior, ',')) {
+        MockBoard board;
+        char serial[17];
+        snprintf(serial, sizeof(serial), "%016x", 0xB0A2D000 + (unsigned)boards.size());
+        board.serial = serial;
+        board.behavior = behavior;
+        boards.push_back(board);
+    }
+    if (getenv("PSG_MOCK_IMAGE")) {
+        std::ifstream in(getenv("PSG_MOCK_IMAGE"), std::ios::binary);
+        std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        psgHexToRows(data, image); // stops at the end record, before any UF2 data
+    }
+}
+
+static void addDevice(int board, bool output) {
+    deviceNames.push_back(board < 0 ? "Midi Through Port-0" : "PSG MIDI " + std::to_string(board));
+    devices.push_back({1, "Mock", NULL, !output, output, 0});
+    deviceStreams.push_back({board, output});
+}
+
+PmError Pm_Initialize(void) {
+    std::lock_guard<std::mutex> lock(mockLock);
+    if (boards.empty()) loadBoards();
+    for (MockBoard& board : boards) {
+        if (board.bootloader && std::ifstream(fakeRoot() + "/drive/firmware.uf2").good()) {
+            board.bootloader = false;
+            board.revision++;
+        }
+    }
+    devices.clear();
+    deviceStreams.clear();
+    deviceNames.clear();
+    for (size_t i = 0; i < boards.size(); i++) if (!boards[i].bootloader) addDevice(i, true);
+    addDevice(-1, true);
+    addDevice(-1, false);
+    for (size_t i = boards.size(); i > 0; i--) if (!boards[i-1].bootloader) addDevice(i - 1, false);
+    for (size_t i = 0; i < devices.size(); i++) devices[i].name = deviceNames[i].c_str();
+    return pmNoError;
+}
+
+PmError Pm_Terminate(void) {
+    return pmNoError;
+}
+
+const char *Pm_GetErrorText(PmError errnum) {
+    return errnum == pmInvalidDeviceId ? "invalid device ID" : "mock error";
+}
+
+int Pm_CountDevices(void) {
+    std::lock_guard<std::mutex> lock(mockLock);
+    return devices.size();
+}
+
+const PmDeviceInfo *Pm_GetDeviceInfo(PmDeviceID id) {
+    std::lock_guard<std::mutex> lock(mockLock);
+    return id >= 0 && id < (int)devices.size() ? &devices[id] : NULL;
+}
+
+static PmError openStream(PortMidiStream **stream, PmDeviceID id, bool output) {
+    std::lock_guard<std::mutex> lock(mockLock);
+    if (id < 0 || id >= (int)devices.size() || deviceStreams[id].output != output) return pmInvalidDeviceId;
+    *stream = new MockStream(deviceStreams[id]);
+    return pmNoError;
+}
+
+PmError Pm_OpenInput(PortMidiStream **stream, PmDeviceID inputDevice, void *, int32_t, PmTimeProcPtr, void *) {
+    return openStream(stream, inputDevice, false);
+}
+
+PmError Pm_OpenOutput(PortMidiStream **stream, PmDeviceID outputDevice, void *, int32_t, PmTimeProcPtr, void *, int32_t) {
+    return openStream(stream, outputDevice, true);
+}
+
+PmError Pm_SetFilter(PortMidiStream *, int32_t) {
+    return pmNoError;
+}
+
+PmError Pm_Close(PortMidiStream *stream) {
+    delete (MockStream*)stream;
+    return pmNoError;
+}
+
+// Hands out replies 4 bytes to an event, the way PortMidi delivers SysEx.
+int Pm_Read(PortMidiStream *stream, PmEvent *buffer, int32_t length) {
+    std::lock_guard<std::mutex> lock(mockLock);
+    MockStream * s = (MockStream*)stream;
+    if (length < 1 || s->board < 0 || boards[s->board].replies.empty()) return 0;
+    std::deque<uint8_t>& replies = boards[s->board].replies;
+    buffer->message = 0;
+    buffer->timestamp = 0;
+    for (int i = 0; i < 4 && !replies.empty(); i++) {
+        uint8_t b = replies.front();
+        replies.pop_front();
+        buffer->message |= b << (i * 8);
+        if (b == 0xF7) break;
+    }
+    return 1;
+}
+
+PmError Pm_Poll(PortMidiStream *stream) {
+    std::lock_guard<std::mutex> lock(mockLock);
+    MockStream * s = (MockStream*)stream;
+    return s->board >= 0 && !boards[s->board].replies.empty() ? (PmError)pmGotData : pmNoData;
+}
+
+static void reply(MockBoard& board, std::vector<uint8_t> msg) {
+    board.replies.insert(board.replies.end(), msg.begin(), msg.end());
+}
+
+static void flashStatus(MockBoard& board, uint8_t command, PSGFlashStatus status) {
+    reply(board, {0xF0, 0x00, 0x46, 0x71, command, 0x00, (uint8_t)status, (uint8_t)(board.rows.size() & 0x7F), (uint8_t)(board.rows.size() >> 7), 0xF7});
+}
+
+// Unpacks a block sent 7 bytes to 8, and checks and strips its CRC.
+static bool unpackBlock(const uint8_t * msg, size_t size, std::vector<uint8_t>& data) {
+    for (size_t i = 0; i < size; i += 8)
+        for (size_t j = 1; j < 8 && i + j < size; j++) data.push_back(msg[i+j] | ((msg[i] >> (j - 1)) & 1) << 7);
+    if (data.size() < 8) return false;
+    size_t end = data.size() - 4;
+    uint32_t crc = data[end] | data[end+1] << 8 | data[end+2] << 16 | (uint32_t)data[end+3] << 24;
+    data.resize(end);
+    return psgCRC32(0, data.data(), data.size()) == crc;
+}
+
+static void picManifest(MockBoard& board, const std::vector<uint8_t>& data) {
+    std::vector<uint8_t> msg = {0xF0, 0x00, 0x46, 0x71, 0x0A, 0x00, PSG_FLASH_PROGRESS};
+    msg.resize(7 + (PSG_PIC_FLASH_WORDS / PSG_PIC_ROW_WORDS + 6) / 7);
+    for (size_t pos = 4; pos + 6 <= data.size(); pos += 6) {
+        uint16_t addr = data[pos] | data[pos+1] << 8;
+        uint32_t hash = data[pos+2] | data[pos+3] << 8 | data[pos+4] << 16 | (uint32_t)data[pos+5] << 24;
+        unsigned row = addr / PSG_PIC_ROW_WORDS;
+        if (!board.hashes.count(addr) || board.hashes[addr] != hash) msg[7 + row / 7] |= 1 << (row % 7);
+    }
+    msg.push_back(0xF7);
+    reply(board, msg);
+}
+
+// Takes a whole HEX file, replying as firmware from before binary blocks does:
+// with its progress after each row and how it ended.
+static void picHex(MockBoard& board, const uint8_t * msg, size_t size) {
+    PSGPicRows rows;
+    bool ok = psgHexToRows(std::string((const char*)msg, size), rows);
+    board.rows.clear();
+    for (const auto& row : rows) {
+        board.rows.insert(row);
+        flashStatus(board, 0x00, PSG_FLASH_PROGRESS);
+    }
+    flashStatus(board, 0x00, ok && rows == image ? PSG_FLASH_DONE : PSG_FLASH_BAD_RECORD);
+    board.rows.clear();
+}
+
+static void picBlock(MockBoard& board, const std::vector<uint8_t>& data) {
+    if (data[0] == 0) {
+        fprintf(stderr, "mock board %s: flash ended\n", board.serial.c_str());
+        // every row the programmer meant to send has to have arrived intact
+        bool ok = true;
+        for (const auto& row : board.rows) ok = ok && image.count(row.first) && image.at(row.first) == row.second;
+        if (ok) for (const auto& row : board.rows) board.hashes[row.first] = psgPicRowHash(row.second);
+        for (const auto& row : image) ok = ok && board.hashes.count(row.first) && board.hashes[row.first] == psgPicRowHash(row.second);
+        flashStatus(board, 0x08, ok ? PSG_FLASH_DONE : PSG_FLASH_BAD_RECORD);
+        board.rows.clear();
+        return;
+    }
+    if (board.behavior == "reject") {
+        flashStatus(board, 0x08, PSG_FLASH_BAD_RECORD);
+        return;
+    }
+    size_t pos = 4;
+    for (int i = 0; i < data[0]; i++) {
+        if (pos + 3 > data.size()) break;
+        uint16_t addr = data[pos] | data[pos+1] << 8;
+        uint8_t words = data[pos+2];
+        if (pos + 3 + words * 2 > data.size()) break;
+        board.rows[addr] = std::vector<uint8_t>(data.begin() + pos + 3, data.begin() + pos + 3 + words * 2);
+        pos += 3 + words * 2;
+    }
+    flashStatus(board, 0x08, pos == data.size() ? PSG_FLASH_PROGRESS : PSG_FLASH_BAD_RECORD);
+}
+
+PmError Pm_WriteSysEx(PortMidiStream *stream, PmTimestamp, unsigned char *msg) {
+    std::lock_guard<std::mutex> lock(mockLock);
+    MockStream * s = (MockStream*)stream;
+    if (s->board < 0 || !s->output) return pmBadPtr;
+    MockBoard& board = boards[s->board];
+    size_t size = 0;
+    while (msg[size] != 0xF7) size++;
+    if (size < 6 || msg[1] != 0x00 || msg[2] != 0x46 || msg[3] != 0x71 || msg[5] != 0x00) return pmNoError;
+    switch (msg[4]) {
+        case 0x00:
+            if (board.behavior == "hex") picHex(board, msg + 6, size - 6);
+            break;
+        case 0x01: {
+            board.bootloader = true;
+            std::string drive = fakeRoot() + "/dev/disk/by-id/usb-RPI_RP2_" + board.serial + "-0:0";
+            std::ofstream(drive).put(0);
+            std::ofstream(drive + "-part1").put(0);
+            break;
+        } case 0x08: case 0x0A: {
+            if (board.behavior == "hex") break;
+            std::vector<uint8_t> data;
+            if (!unpackBlock(msg + 6, size - 6, data) || (msg[4] == 0x08 && board.behavior == "corrupt" && !board.corrupted)) {
+                board.corrupted = true;
+                flashStatus(board, msg[4], PSG_FLASH_BAD_CHECKSUM);
+            } else if (msg[4] == 0x08) picBlock(board, data);
+            else picManifest(board, data);
+            break;
+        } case 0x09: {
+            std::string id = board.serial + ":PSGv1.2." + std::to_string(board.revision);
+            std::vector<uint8_t> out = {0xF0, 0x00, 0x46, 0x71, 0x09, 0x00};
+            out.insert(out.end(), id.begin(), id.end());
+            out.push_back(0xF7);
+            reply(board, out);
+            break;
+        }
+    }
+    return pmNoError;
+}
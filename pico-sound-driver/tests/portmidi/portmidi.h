@@ -0,0 +1,74 @@
+/*
+ * pico-sound-driver/tests/portmidi/portmidi.h
+ * PSG
+ *
+ * This file contains the part of the PortMidi API the host tools use, so they
+ * can be built against the mock boards in mock-portmidi.cpp instead of the real
+ * library. The declarations match PortMidi's own.
+ *
+ * This code is licensed under the GPLv2 license.
+ * Copyright (c) 2022-2023 JackMacWindows.
+ */
+
+#ifndef PORTMIDI_H
+#define PORTMIDI_H
+
+#include <stdint.h>
+
+typedef enum {
+    pmNoError = 0,
+    pmNoData = 0,
+    pmGotData = 1,
+    pmHostError = -10000,
+    pmInvalidDeviceId,
+    pmInsufficientMemory,
+    pmBufferTooSmall,
+    pmBufferOverflow,
+    pmBadPtr,
+    pmBadData,
+    pmInternalError,
+    pmBufferMaxSize
+} PmError;
+
+typedef int PmDeviceID;
+typedef void PortMidiStream;
+typedef int32_t PmMessage;
+typedef int32_t PmTimestamp;
+typedef PmTimestamp (*PmTimeProcPtr)(void *time_info);
+
+typedef struct {
+    int structVersion;
+    const char *interf;
+    const char *name;
+    int input;
+    int output;
+    int opened;
+} PmDeviceInfo;
+
+typedef struct {
+    PmMessage message;
+    PmTimestamp timestamp;
+} PmEvent;
+
+#define PM_FILT_ACTIVE (1 << 0x0E)
+#define PM_FILT_CLOCK (1 << 0x08)
+#define PM_FILT_PLAY ((1 << 0x0A) | (1 << 0x0C) | (1 << 0x0B))
+#define PM_FILT_TICK (1 << 0x09)
+#define PM_FILT_FD (1 << 0x0D)
+#define PM_FILT_RESET (1 << 0x0F)
+#define PM_FILT_REALTIME (PM_FILT_ACTIVE | PM_FILT_CLOCK | PM_FILT_PLAY | PM_FILT_TICK | PM_FILT_FD | PM_FILT_RESET)
+
+PmError Pm_Initialize(void);
+PmError Pm_Terminate(void);
+const char *Pm_GetErrorText(PmError errnum);
+int Pm_CountDevices(void);
+const PmDeviceInfo *Pm_GetDeviceInfo(PmDeviceID id);
+PmError Pm_OpenInput(PortMidiStream **stream, PmDeviceID inputDevice, void *inputDriverInfo, int32_t bufferSize, PmTimeProcPtr time_proc, void *time_info);
+PmError Pm_OpenOutput(PortMidiStream **stream, PmDeviceID outputDevice, void *outputDriverInfo, int32_t bufferSize, PmTimeProcPtr time_proc, void *time_info, int32_t latency);
+PmError Pm_SetFilter(PortMidiStream *stream, int32_t filters);
+PmError Pm_Close(PortMidiStream *stream);
+int Pm_Read(PortMidiStream *stream, PmEvent *buffer, int32_t length);
+PmError Pm_Poll(PortMidiStream *stream);
+PmError Pm_WriteSysEx(PortMidiStream *stream, PmTimestamp when, unsigned char *msg);
+
+#endif
@@ -0,0 +1,14 @@
+# Renders a checked-in bus trace with psg-render and checks the result against
+# the WAV file it's expected to give, so changes to the emulator (or to the PIC
+# firmware) that change what the chips play show up.
+#
+# Run by ctest as: cmake -DRENDER=... -DFIRMWARE=... -DTRACE=... -DEXPECTED=... -DOUTPUT=... -P render.cmake
+
+execute_process(COMMAND ${RENDER} -d 10 ${FIRMWARE} ${TRACE} ${OUTPUT} RESULT_VARIABLE result OUTPUT_QUIET)
+if (NOT result EQUAL 0)
+    message(FATAL_ERROR "psg-render failed: ${result}")
+endif()
+execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${OUTPUT} ${EXPECTED} RESULT_VARIABLE result)
+if (NOT result EQUAL 0)
+    message(FATAL_ERROR "${OUTPUT} differs from ${EXPECTED}")
+endif()
@@ -0,0 +1,35 @@
+/*
+ * pico-sound-driver/tests/volume.cpp
+ * PSG
+ *
+ * This file contains a test of the volume and pan law tables: for every MIDI
+ * volume and pan, the level each side's chip gets has to be the one the float
+ * code they replaced wrote, 13 * ln(vol * gain + 1) rounded, with the gain and
+ * pan worked out in single precision as it did.
+ *
+ * This code is licensed under the GPLv2 license.
+ * Copyright (c) 2022-2023 JackMacWindows.
+ */
+
+#include "hal_host.h"
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+
+int main() {
+    psg_init();
+    unsigned errors = 0;
+    for (int p = 0; p < 128; p++) {
+        float pan = (p - 64.0) / (p > 64 ? 63.0 : 64.0);
+        for (int side = 0; side < 2; side++) {
+            float gain = side ? std::min(1.0f - pan, 1.0f) : std::min(pan + 1.0f, 1.0f);
+            for (int vol = 0; vol < 128; vol++) {
+                uint8_t expected = (uint8_t)floor(13.0 * log(vol * gain + 1) + 0.5);
+                uint8_t level = psg_host_volume_level(vol, p, side);
+                if (level != expected && errors++ < 10) printf("volume %d pan %d %s: got %d, float code gave %d\n", vol, p, side ? "right" : "left", level, expected);
+            }
+        }
+    }
+    if (errors) printf("%u of 32768 levels wrong\n", errors);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,316 @@
+/*
+ * pico-sound-driver/virtual.cpp
+ * PSG
+ *
+ * This file contains a virtual PSG for Linux: the host build of the firmware,
+ * running in real time behind an ALSA sequencer port with the same name as the
+ * board's USB MIDI port, so sound-midi, the programmer and the instrument
+ * designer all find it as they would a real board. Everything sent to the
+ * port goes through the same USB callback and core 1 loop the Pico runs, and
+ * whatever the firmware sends back comes out of the port.
+ *
+ * It logs every message it gets, the bus commands the firmware writes to the
+ * chips, and how long each message took to be dealt with. Channel messages go
+ * through core 1, so they're done once it has written what they changed to the
+ * bus: at the end of the control tick that picks them up, or in express mode,
+ * once the events they made have been flushed. SysEx and system messages are
+ * done once the callback has read them, since that's where they're handled. The virtual clock follows the wall
+ * clock, so these are the times the board would take. A summary is printed on SIGINT/SIGTERM,
+ * or when the firmware reboots (which ends the program, as it does psg-host).
+ *
+ * Usage: psg-virtual [-l logfile] [-f flash.bin]
+ *
+ * With -f, the flash starts out with the contents of the given image (if it
+ * exists) and is saved back to it on exit, as psg-host does.
+ *
+ * This code is licensed under the GPLv2 license.
+ * Copyright (c) 2022-2023 JackMacWindows.
+ */
+
+#include "hal_host.h"
+#include "chip_render.h"
+#include <alsa/asoundlib.h>
+#include <poll.h>
+#include <signal.h>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#define DEVICE_NAME "PSG MIDI Device"
+#define LATENCY_BINS 8
+#define LOG_BYTES 16 // longer messages are cut short in the log
+#define REPLY_SIZE 192 // the most the firmware's output ring holds, 64 packets of 3 bytes
+
+static snd_seq_t * seq = NULL;
+static int port = -1;
+static snd_midi_event_t * decoder = NULL;
+static snd_midi_event_t * encoder = NULL;
+static std::vector<struct pollfd> pollfds;
+static std::vector<uint8_t> sysex; // a SysEx message that's come in parts
+static std::ostream * logOut = &std::cout;
+static std::string flashPath;
+static volatile sig_atomic_t stopping = 0;
+static std::chrono::steady_clock::time_point wallStart;
+static uint64_t virtualStart = 0;
+
+// a message that hasn't been dealt with yet
+struct Pending {
+    uint64_t arrival;
+    std::vector<uint8_t> data;
+    bool read; // the USB callback has taken it off the queue
+};
+static std::vector<Pending> pending;
+
+static struct {
+    uint64_t messages = 0, ticks = 0, commands = 0;
+    uint64_t latencyTotal = 0, latencyMax = 0;
+    uint64_t latency[LATENCY_BINS] = {0}; // <256us, <512us, ... >=16ms, as the firmware bins notes
+} stats;
+
+// The bus lines, and the command being written: the chips it's latched for
+// and its bytes so far.
+static struct {
+    BusLines lines;
+    uint16_t chips = 0;
+    uint64_t time = 0;
+    std::vector<uint8_t> bytes;
+} bus;
+
+static uint64_t wallTime() {
+    return virtualStart + std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - wallStart).count();
+}
+
+static void logBytes(const uint8_t * data, size_t size) {
+    char hex[4];
+    for (size_t i = 0; i < size && i < LOG_BYTES; i++) {
+        snprintf(hex, sizeof(hex), " %02x", data[i]);
+        *logOut << hex;
+    }
+    if (size > LOG_BYTES) *logOut << " ... (" << size << " bytes)";
+}
+
+// Marks the channel messages (or the rest, with `system`) that arrived by
+// `arrived` and have been read as dealt with at `time`.
+static void settle(uint64_t arrived, uint64_t time, bool system) {
+    for (auto it = pending.begin(); it != pending.end() && it->arrival <= arrived;) {
+        if (!it->read || (it->data[0] >= 0xF0) != system) {
+            ++it;
+            continue;
+        }
+        uint64_t latency = time - it->arrival;
+        uint64_t t = latency >> 8;
+        stats.latency[t ? std::min(64 - __builtin_clzll(t), LATENCY_BINS - 1) : 0]++;
+        stats.latencyTotal += latency;
+        if (latency > stats.latencyMax) stats.latencyMax = latency;
+        *logOut << it->arrival << " latency " << latency << " us:";
+        logBytes(it->data.data(), it->data.size());
+        *logOut << "\n";
+        it = pending.erase(it);
+    }
+}
+
+static void endCommand() {
+    if (bus.bytes.empty()) return;
+    stats.commands++;
+    *logOut << bus.time << " bus ";
+    if (bus.chips && !(bus.chips & (bus.chips - 1))) *logOut << "chip " << __builtin_ctz(bus.chips) << ":";
+    else *logOut << "chips " << std::hex << bus.chips << std::dec << ":";
+    logBytes(bus.bytes.data(), bus.bytes.size());
+    *logOut << "\n";
+    bus.bytes.clear();
+}
+
+// Follows the shift register the same way the chips do: a strobe latches the
+// select bits, and each rising edge on DC is a byte for the chips selected.
+// Anything else on the register ends the command being written.
+static void busActivity(uint64_t time, unsigned pin, bool value, void *) {
+    if (!bus.lines.set(pin, value)) return;
+    if (pin == PIN_STROBE || pin == PIN_CLOCK) endCommand();
+    else if (pin == PIN_DC) {
+        if (bus.bytes.empty()) {
+            bus.time = time;
+            bus.chips = bus.lines.latched;
+        }
+        bus.bytes.push_back(bus.lines.data());
+    }
+}
+
+static void receive(const uint8_t * data, size_t size) {
+    uint64_t now = hal_time_us();
+    *logOut << now << " midi:";
+    logBytes(data, size);
+    *logOut << "\n";
+    hal_host_midi_send(data, size);
+    pending.push_back({now, std::vector<uint8_t>(data, data + size), false});
+    stats.messages++;
+}
+
+// Takes everything waiting on the port and hands it to the USB queue.
+static void readInput() {
+    snd_seq_event_t * ev;
+    int err;
+    uint8_t buf[16];
+    while ((err = snd_seq_event_input(seq, &ev)) >= 0 || err == -ENOSPC) {
+        if (err < 0) {
+            std::cerr << "psg-virtual: input overrun, events were dropped\n";
+            continue;
+        }
+        if (ev->type == SND_SEQ_EVENT_SYSEX) {
+            const uint8_t * data = (const uint8_t*)ev->data.ext.ptr;
+            size_t len = ev->data.ext.len;
+            if (len && data[0] == 0xF0) sysex.clear();
+            sysex.insert(sysex.end(), data, data + len);
+            if (!sysex.empty() && sysex.back() == 0xF7) {
+                if (sysex[0] == 0xF0) receive(sysex.data(), sysex.size());
+                sysex.clear();
+            }
+        } else {
+            long len = snd_midi_event_decode(decoder, buf, sizeof(buf), ev);
+            if (len > 0) receive(buf, len);
+        }
+    }
+}
+
+// Sends what the firmware has replied with back out of the port.
+static void writeOutput() {
+    std::vector<uint8_t> bytes;
+    for (uint32_t p : hal_host_midi_output()) {
+        int n = (p & 0x0F) == 0x04 || (p & 0x0F) == 0x07 ? 3 : (p & 0x0F) == 0x06 ? 2 : 1;
+        for (int i = 0; i < n; i++) bytes.push_back((p >> (8 * (i + 1))) & 0xFF);
+    }
+    hal_host_midi_output().clear();
+    for (size_t i = 0; i < bytes.size();) {
+        snd_seq_event_t ev;
+        snd_seq_ev_clear(&ev);
+        long n = snd_midi_event_encode(encoder, bytes.data() + i, bytes.size() - i, &ev);
+        if (n <= 0) break;
+        i += n;
+        if (ev.type == SND_SEQ_EVENT_NONE) continue;
+        snd_seq_ev_set_source(&ev, port);
+        snd_seq_ev_set_subs(&ev);
+        snd_seq_ev_set_direct(&ev);
+        snd_seq_event_output_direct(seq, &ev);
+    }
+}
+
+// Stands in for core 0 and real time while core 1 waits: sleeps on the port
+// until `until`, and passes on anything that comes in as soon as it does.
+static void waitForInput(uint64_t until, void *) {
+    if (stopping) exit(0);
+    // core 1 only waits between ticks, or after flushing express events, so
+    // with none left in the ring, every channel message read so far is done
+    if (!psg_host_events_waiting()) settle(hal_time_us(), hal_time_us(), false);
+    uint64_t now = wallTime();
+    if (now < until && snd_seq_event_input_pending(seq, 1) == 0) {
+        if (pending.empty()) logOut->flush(); // nothing's going on, so the log can catch up
+        struct timespec timeout = {(time_t)((until - now) / 1000000), (long)((until - now) % 1000000) * 1000};
+        ppoll(pollfds.data(), pollfds.size(), &timeout, NULL);
+        now = wallTime();
+    }
+    hal_host_advance_to(std::min(until, now));
+    readInput();
+    if (hal_midi_available()) tud_midi_rx_cb(0);
+    flushMidiOutput(); // what core 0 does in between USB callbacks
+    picCheckTimeout();
+    writeOutput();
+    if (!hal_midi_available()) {
+        for (Pending& p : pending) p.read = true;
+        settle(hal_time_us(), hal_time_us(), true);
+    }
+}
+
+static void finish() {
+    static bool finished = false;
+    if (finished) return;
+    finished = true;
+    if (!flashPath.empty()) {
+        std::ofstream image(flashPath, std::ios::binary);
+        image.write((const char*)hal_host_flash().data(), hal_host_flash().size());
+    }
+    logOut->flush();
+    static const char * bins[] = {"<256us", "<512us", "<1ms", "<2ms", "<4ms", "<8ms", "<16ms", ">=16ms"};
+    std::cerr << "Messages:         " << stats.messages << "\n";
+    std::cerr << "Ticks:            " << stats.ticks << "\n";
+    std::cerr << "Bus commands:     " << stats.commands << "\n";
+    std::cerr << "Virtual time:     " << (hal_time_us() - virtualStart) << " us\n";
+    if (stats.messages > pending.size()) {
+        std::cerr << "Mean latency:     " << stats.latencyTotal / (stats.messages - pending.size()) << " us\n";
+        std::cerr << "Max latency:      " << stats.latencyMax << " us\n";
+        for (int i = 0; i < LATENCY_BINS; i++) {
+            std::string name = std::string("Latency ") + bins[i];
+            std::cerr << name << ":" << std::string(17 - name.size(), ' ') << stats.latency[i] << "\n";
+        }
+    }
+    if (logOut != &std::cout) delete logOut;
+    if (seq) snd_seq_close(seq);
+}
+
+static void stop(int) {
+    stopping = 1;
+}
+
+int main(int argc, const char * argv[]) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-l" && i + 1 < argc) {
+            std::ofstream * file = new std::ofstream(argv[++i]);
+            if (!file->is_open()) {
+                std::cerr << "Could not open log file\n";
+                return 2;
+            }
+            logOut = file;
+        } else if (arg == "-f" && i + 1 < argc) flashPath = argv[++i];
+        else {
+            std::cerr << "Usage: " << argv[0] << " [-l logfile] [-f flash.bin]\n";
+            return 1;
+        }
+    }
+
+    // The port is named like the board's, so the host tools can't tell them apart.
+    if (snd_seq_open(&seq, "default", SND_SEQ_OPEN_DUPLEX, SND_SEQ_NONBLOCK) < 0) {
+        std::cerr << "Could not open the ALSA sequencer\n";
+        return 2;
+    }
+    snd_seq_set_client_name(seq, DEVICE_NAME);
+    port = snd_seq_create_simple_port(seq, DEVICE_NAME " MIDI 1",
+        SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ | SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE,
+        SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_HARDWARE | SND_SEQ_PORT_TYPE_APPLICATION);
+    if (port < 0 || snd_midi_event_new(16, &decoder) < 0 || snd_midi_event_new(REPLY_SIZE, &encoder) < 0) {
+        std::cerr << "Could not create the sequencer port\n";
+        return 2;
+    }
+    snd_midi_event_no_status(decoder, 1);
+    pollfds.resize(snd_seq_poll_descriptors_count(seq, POLLIN));
+    snd_seq_poll_descriptors(seq, pollfds.data(), pollfds.size(), POLLIN);
+
+    if (!flashPath.empty()) {
+        std::ifstream image(flashPath, std::ios::binary);
+        if (image.is_open()) image.read((char*)hal_host_flash().data(), hal_host_flash().size());
+    }
+    struct sigaction sa = {};
+    sa.sa_handler = stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    atexit(finish);
+
+    // Start as a board revision with the output switch (1.1), like psg-wav.
+    hal_host_set_input(5, true);
+    hal_host_set_gpio_callback(busActivity, NULL);
+    psg_init();
+    tud_midi_rx_cb(0);
+    std::cerr << "psg-virtual: listening on " << snd_seq_client_id(seq) << ":" << port << "\n";
+    virtualStart = hal_time_us();
+    wallStart = std::chrono::steady_clock::now();
+    hal_host_set_wait_callback(waitForInput, NULL);
+    uint64_t deadline = virtualStart;
+    while (true) {
+        uint64_t start = hal_time_us();
+        bool animating = core2_tick();
+        endCommand();
+        settle(start, hal_time_us(), false);
+        stats.ticks++;
+        deadline = core2_wait(deadline, start, animating);
+    }
+}
@@ -0,0 +1,372 @@
+/*
+ * pico-sound-driver/wav.cpp
+ * PSG
+ *
+ * This file contains an offline renderer that plays a Standard MIDI File through
+ * the host build of the firmware and writes what the board would play to a
+ * stereo WAV file. Events go into the same USB callback and core 1 tick the Pico
+ * runs, at the times the file gives them; the bus activity that comes out is
+ * split up by chip, and each chip's DAC output is rendered on a pool of threads
+ * and mixed the way the board's output switch does: every chip on both sides in
+ * center mode, or chips 0-7 on the left and 8-15 on the right in stereo mode.
+ *
+ * Usage: psg-wav [-e pic.hex|firmware.bin] [-r rate-hz] [-j threads] [-d extra-ms] <input.mid> <output.wav>
+ *
+ * Chips are rendered with ChipModel, which counts the PIC firmware's cycles
+ * instead of running it, unless -e gives the PIC firmware to run in the emulator
+ * instead (much slower, but exact by construction). Output is at the chips' own
+ * sample rate unless -r is given, in which case it's averaged down to that rate.
+ *
+ * This code is licensed under the GPLv2 license.
+ * Copyright (c) 2022-2023 JackMacWindows.
+ */
+
+#include "hal_host.h"
+#include "chip_render.h"
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define BLOCK_SAMPLES 65536 // samples rendered per chip between mixes
+
+struct TimedMessage {
+    uint64_t time; // us from the start of the file
+    std::vector<uint8_t> data;
+};
+
+static uint32_t readVLQ(const std::vector<uint8_t>& data, size_t& pos, size_t end) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4 && pos < end; i++) {
+        uint8_t b = data[pos++];
+        value = value << 7 | (b & 0x7F);
+        if (!(b & 0x80)) break;
+    }
+    return value;
+}
+
+// Reads the events out of a Standard MIDI File (format 0 or 1; format 2 tracks
+// are played together as well), converting delta times to microseconds through
+// the tempo map. Meta events are dropped, and SysEx events are passed on whole.
+static bool readSMF(const std::vector<uint8_t>& data, std::vector<TimedMessage>& messages) {
+    auto be = [&](size_t pos, int size) {uint32_t v = 0; for (int i = 0; i < size; i++) v = v << 8 | data[pos + i]; return v;};
+    if (data.size() < 14 || memcmp(data.data(), "MThd", 4) != 0 || be(4, 4) < 6) return false;
+    unsigned tracks = be(10, 2), division = be(12, 2);
+    if (division == 0) return false;
+    struct Event {
+        uint64_t tick;
+        unsigned track;
+        uint32_t tempo; // us per quarter note, for tempo events
+        std::vector<uint8_t> data; // empty for tempo events
+    };
+    std::vector<Event> events;
+    size_t pos = 8 + be(4, 4);
+    for (unsigned t = 0; t < tracks && pos + 8 <= data.size(); t++) {
+        size_t len = be(pos + 4, 4);
+        bool isTrack = memcmp(data.data() + pos, "MTrk", 4) == 0;
+        pos += 8;
+        size_t end = pos + len > data.size() ? data.size() : pos + len;
+        if (!isTrack) {
+            // unknown chunks are skipped, and don't count as tracks
+            pos = end;
+            t--;
+            continue;
+        }
+        uint64_t tick = 0;
+        uint8_t status = 0;
+        while (pos < end) {
+            tick += readVLQ(data, pos, end);
+            if (pos >= end) break;
+            uint8_t b = data[pos];
+            if (b == 0xFF) {
+                if (pos + 2 > end) break;
+                uint8_t type = data[pos + 1];
+                pos += 2;
+                uint32_t size = readVLQ(data, pos, end);
+                if (type == 0x2F) break; // end of track
+                if (type == 0x51 && size == 3 && pos + 3 <= end) events.push_back({tick, t, be(pos, 3), {}});
+                pos += size;
+                status = 0;
+            } else if (b == 0xF0 || b == 0xF7) {
+                pos++;
+                uint32_t size = readVLQ(data, pos, end);
+                if (pos + size > end) break;
+                // an F7 event carries raw bytes, usually the rest of a SysEx
+                Event ev = {tick, t, 0, {}};
+                if (b == 0xF0) ev.data.push_back(0xF0);
+                ev.data.insert(ev.data.end(), data.begin() + pos, data.begin() + pos + size);
+                if (!ev.data.empty()) events.push_back(ev);
+                pos += size;
+                status = 0;
+            } else {
+                if (b & 0x80) {
+                    status = b;
+                    pos++;
+                } else if (status == 0) {
+                    pos++; // data byte with no running status to go with it
+                    continue;
+                }
+                int n = (status & 0xF0) == 0xC0 || (status & 0xF0) == 0xD0 ? 1 : 2;
+                Event ev = {tick, t, 0, {status}};
+                for (int i = 0; i < n && pos < end; i++) ev.data.push_back(data[pos++]);
+                events.push_back(ev);
+            }
+        }
+        pos = end;
+    }
+    // merge the tracks, keeping events at the same tick in track order
+    std::stable_sort(events.begin(), events.end(), [](const Event& a, const Event& b) {return a.tick < b.tick;});
+    uint64_t lastTick = 0, time = 0; // time in us * ticks per quarter note, to keep it exact
+    uint32_t tempo = 500000;
+    for (const Event& ev : events) {
+        if (division & 0x8000) {
+            // SMPTE: frames per second and ticks per frame
+            unsigned fps = 256 - (division >> 8), perFrame = division & 0xFF;
+            time = ev.tick * 1000000 / (fps * perFrame);
+            if (fps == 29) time = ev.tick * 100000000 / (2997 * perFrame);
+            if (!ev.data.empty()) messages.push_back({time, ev.data});
+            continue;
+        }
+        time += (ev.tick - lastTick) * tempo;
+        lastTick = ev.tick;
+        if (ev.data.empty()) tempo = ev.tempo;
+        else messages.push_back({time / division, ev.data});
+    }
+    return true;
+}
+
+// Hands messages to the USB callback at their times while core 1 waits.
+struct Feeder {
+    std::vector<TimedMessage> messages;
+    size_t next = 0;
+    uint64_t start = 0;
+    uint64_t arrival(size_t i) const {return start + messages[i].time;}
+};
+
+static void feed(uint64_t until, void * userdata) {
+    Feeder * f = (Feeder*)userdata;
+    if (f->next < f->messages.size() && f->arrival(f->next) <= until) {
+        // stop at the first arrival so the firmware gets to react to it
+        hal_host_advance_to(f->arrival(f->next));
+        while (f->next < f->messages.size() && f->arrival(f->next) <= hal_time_us()) {
+            hal_host_midi_send(f->messages[f->next].data.data(), f->messages[f->next].data.size());
+            f->next++;
+        }
+    } else {
+        hal_host_advance_to(until);
+    }
+    if (hal_midi_available()) tud_midi_rx_cb(0);
+    flushMidiOutput(); // what core 0 does in between USB callbacks
+}
+
+static void busActivity(uint64_t time, unsigned pin, bool value, void * userdata) {
+    ((BusSplitter*)userdata)->gpio(time, pin, value);
+}
+
+// A fixed set of threads that run batches of jobs.
+class WorkerPool {
+public:
+    explicit WorkerPool(unsigned count) {
+        for (unsigned i = 0; i < count; i++) threads.emplace_back([this]() {work();});
+    }
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wake.notify_all();
+        for (std::thread& t : threads) t.join();
+    }
+    // Runs job(0) to job(count - 1) across the pool, and returns once they're all done.
+    void run(size_t count, const std::function<void(size_t)>& fn) {
+        std::unique_lock<std::mutex> lock(mutex);
+        job = &fn;
+        jobs = count;
+        nextJob = finished = 0;
+        wake.notify_all();
+        done.wait(lock, [&]() {return finished == jobs;});
+        jobs = nextJob = finished = 0;
+        job = NULL;
+    }
+private:
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    const std::function<void(size_t)> * job = NULL;
+    size_t jobs = 0, nextJob = 0, finished = 0;
+    bool quit = false;
+
+    void work() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [&]() {return quit || nextJob < jobs;});
+            if (quit) return;
+            size_t i = nextJob++;
+            const std::function<void(size_t)> * fn = job;
+            lock.unlock();
+            (*fn)(i);
+            lock.lock();
+            if (++finished == jobs) done.notify_one();
+        }
+    }
+};
+
+int main(int argc, const char * argv[]) {
+    const char * hexPath = NULL;
+    unsigned rate = 0, threadCount = std::thread::hardware_concurrency();
+    uint64_t extra = 1000;
+    std::vector<const char *> files;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-e" && i + 1 < argc) hexPath = argv[++i];
+        else if (arg == "-r" && i + 1 < argc) rate = std::stoul(argv[++i]);
+        else if (arg == "-j" && i + 1 < argc) threadCount = std::stoul(argv[++i]);
+        else if (arg == "-d" && i + 1 < argc) extra = std::stoull(argv[++i]);
+        else files.push_back(argv[i]);
+    }
+    if (files.size() != 2 || (rate && rate > CHIP_SAMPLE_RATE)) {
+        std::cerr << "Usage: " << argv[0] << " [-e pic.hex|firmware.bin] [-r rate-hz] [-j threads] [-d extra-ms] <input.mid> <output.wav>\n";
+        return 1;
+    }
+    if (threadCount == 0) threadCount = 1;
+    static uint16_t program[PIC_PROGRAM_WORDS];
+    if (hexPath) {
+        std::ifstream hex(hexPath);
+        if (!hex.is_open() || !picLoadHex(hex, program)) {
+            std::cerr << "Could not read PIC firmware\n";
+            return 2;
+        }
+    }
+    std::ifstream in(files[0], std::ios::binary);
+    if (!in.is_open()) {
+        std::cerr << "Could not open input file\n";
+        return 2;
+    }
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+    Feeder feeder;
+    if (!readSMF(data, feeder.messages)) {
+        std::cerr << "Could not read MIDI file\n";
+        return 2;
+    }
+    std::ofstream out(files[1], std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "Could not open output file\n";
+        return 2;
+    }
+
+    // Play the file through the firmware, as a board revision with the
+    // output switch (1.1), keeping the bus activity.
+    auto wallStart = std::chrono::steady_clock::now();
+    BusSplitter bus;
+    hal_host_set_input(5, true);
+    hal_host_set_gpio_callback(busActivity, &bus);
+    psg_init();
+    tud_midi_rx_cb(0);
+    // A real board takes much longer than the PICs do to start up before it
+    // can get anything over USB, so the file starts once they're listening.
+    hal_host_advance_to(FIRMWARE_START_TIME / 1000 + 1);
+    feeder.start = hal_time_us();
+    hal_host_set_wait_callback(feed, &feeder);
+    uint64_t deadline = feeder.start, end = 0;
+    while (true) {
+        uint64_t busStart = hal_time_us();
+        bool animating = core2_tick();
+        deadline = core2_wait(deadline, busStart, animating);
+        if (feeder.next >= feeder.messages.size()) {
+            if (end == 0) end = hal_time_us() + extra * 1000;
+            else if (hal_time_us() >= end) break;
+        }
+    }
+    hal_host_set_wait_callback(NULL, NULL);
+    hal_host_set_gpio_callback(NULL, NULL);
+    bus.finish();
+    auto firmwareWall = std::chrono::steady_clock::now();
+
+    // Render every chip a block at a time, one job per chip, and mix each
+    // block as it's done. Output samples are averages of the chip samples in
+    // their period, so there's no aliasing from -r.
+    std::vector<std::unique_ptr<ChipRenderer>> chips;
+    for (int i = 0; i < CHIPS; i++) {
+        if (hexPath) chips.emplace_back(new ChipEmulator(bus.states, i, program));
+        else chips.emplace_back(new ChipModel(bus.states, i));
+    }
+    uint64_t total = end * 1000 / CHIP_SAMPLE_PERIOD; // chip samples
+    uint32_t wavRate = rate ? rate : CHIP_SAMPLE_RATE;
+    writeWAVHeader(out, wavRate, 2, 16, 0);
+    std::vector<uint8_t> block((size_t)CHIPS * BLOCK_SAMPLES);
+    std::vector<int> halves[2] = {std::vector<int>(BLOCK_SAMPLES), std::vector<int>(BLOCK_SAMPLES)}; // chips 0-7 and 8-15
+    std::vector<uint8_t> frames;
+    WorkerPool pool(threadCount);
+    size_t stereoState = 0;
+    bool stereo = false;
+    uint64_t frameCount = 0;
+    int peak = 0;
+    long sumLeft = 0, sumRight = 0, summed = 0;
+    auto emit = [&](int left, int right) {
+        left = left > 32767 ? 32767 : (left < -32768 ? -32768 : left);
+        right = right > 32767 ? 32767 : (right < -32768 ? -32768 : right);
+        if (abs(left) > peak) peak = abs(left);
+        if (abs(right) > peak) peak = abs(right);
+        frames.insert(frames.end(), {(uint8_t)left, (uint8_t)(left >> 8), (uint8_t)right, (uint8_t)(right >> 8)});
+        frameCount++;
+    };
+    for (uint64_t done = 0; done < total;) {
+        size_t n = total - done < BLOCK_SAMPLES ? total - done : BLOCK_SAMPLES;
+        pool.run(CHIPS, [&](size_t chip) {chips[chip]->render(block.data() + chip * BLOCK_SAMPLES, n);});
+        // sum each half of the board a chip at a time, so the loops vectorize
+        for (int h = 0; h < 2; h++) {
+            int * sum = halves[h].data();
+            memset(sum, 0, n * sizeof(int));
+            for (int c = h * 8; c < h * 8 + 8; c++) {
+                const uint8_t * samples = block.data() + c * BLOCK_SAMPLES;
+                for (size_t i = 0; i < n; i++) sum[i] += samples[i];
+            }
+        }
+        frames.clear();
+        for (size_t i = 0; i < n; i++) {
+            uint64_t time = (done + i) * CHIP_SAMPLE_PERIOD;
+            for (; stereoState < bus.states.size() && bus.states[stereoState].time <= time; stereoState++) stereo = bus.states[stereoState].stereo;
+            int lo = (halves[0][i] - 8 * 128) * 16, hi = (halves[1][i] - 8 * 128) * 16;
+            int left = stereo ? lo : lo + hi, right = stereo ? hi : lo + hi;
+            if (!rate) {
+                emit(left, right);
+                continue;
+            }
+            sumLeft += left;
+            sumRight += right;
+            summed++;
+            // the output sample ends when the next chip sample would be past it
+            if ((done + i + 1) * CHIP_SAMPLE_PERIOD >= (frameCount + 1) * 1000000000 / rate) {
+                emit(sumLeft / summed, sumRight / summed);
+                sumLeft = sumRight = summed = 0;
+            }
+        }
+        out.write((const char*)frames.data(), frames.size());
+        done += n;
+    }
+    out.seekp(0);
+    writeWAVHeader(out, wavRate, 2, 16, frameCount);
+    out.close();
+    auto wallEnd = std::chrono::steady_clock::now();
+
+    double seconds = (double)frameCount / wavRate;
+    double wall = std::chrono::duration<double>(wallEnd - wallStart).count();
+    std::cout << "Messages:         " << feeder.messages.size() << "\n";
+    std::cout << "Bus states:       " << bus.states.size() << "\n";
+    std::cout << "Frames:           " << frameCount << " at " << wavRate << " Hz (" << seconds << " s)\n";
+    std::cout << "Peak:             " << peak << "\n";
+    std::cout << "Firmware time:    " << std::chrono::duration_cast<std::chrono::milliseconds>(firmwareWall - wallStart).count() << " ms\n";
+    std::cout << "Render time:      " << std::chrono::duration_cast<std::chrono::milliseconds>(wallEnd - firmwareWall).count() << " ms on " << threadCount << " threads\n";
+    std::cout << "Speed:            " << (wall > 0 ? seconds / wall : 0) << "x real time\n";
+    return 0;
+}
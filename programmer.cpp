@@ -6,6 +6,11 @@
  * an attached PSG device. It can take a .uf2 (Pico only), .hex (PIC only), or
  * .bin (combined) firmware file, and sends it to the device.
  *
+ * Usage: programmer [-a] [-f] [-b rows-per-block] <firmware.bin|uf2|hex>
+ * With -a, every attached board is flashed at once. Only the PIC rows that
+ * changed since the last flash are sent, unless -f is given (e.g. after
+ * swapping a chip).
+ *
  * This code is licensed under the GPLv2 license.
  * Copyright (c) 2022-2023 JackMacWindows.
  */
@@ -18,13 +23,38 @@
 #include <chrono>
 #include <thread>
 #include <cstring>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <set>
+#include "psg-flash.h"
+#include "psg-midi.h"
+
+#define PIC_ROWS_PER_BLOCK 8 // default; each row is 35 bytes of block data
+#define PIC_BLOCK_ATTEMPTS 3
+#define HEX_TIMEOUT 10 // seconds to wait for each reply to a HEX upload
 
 #if defined(__linux__)
+#include <dirent.h>
+#include <sys/inotify.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 
+#define DEVICE_TIMEOUT 30 // seconds to wait for the RPI-RP2 drive to show up
+#define MOUNT_TIMEOUT 5 // seconds to wait for it to be automounted before mounting it manually
+#define HAVE_DRIVE_WATCH // several Pico drives can be told apart and written at once
+
+// Setting PSG_FAKE_ROOT makes the drive and mount lookups happen under that
+// directory instead of /, so they can be tried out against a fake tree.
+static std::string rootPath(const char * path) {
+    const char * root = getenv("PSG_FAKE_ROOT");
+    return root ? std::string(root) + path : std::string(path);
+}
+
 static std::vector<std::string> split(const std::string& strToSplit, const char * delims) {
     std::vector<std::string> retval;
     size_t pos = strToSplit.find_first_not_of(delims);
@@ -36,38 +66,156 @@ static std::vector<std::string> split(const std::string& strToSplit, const char
     return retval;
 }
 
+static int remainingMs(std::chrono::steady_clock::time_point deadline) {
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+    return ms > 0 ? (int)ms : 0;
+}
+
+// Waits for dir/name to exist, sleeping on inotify events for the directory.
+// The directory may not exist yet either (by-label only shows up with the
+// first labelled disk), in which case its parent is watched until it does.
+static bool waitForFile(const std::string& dir, const std::string& name, struct stat * st, std::chrono::steady_clock::time_point deadline) {
+    std::string path = dir + "/" + name, parent = dir.substr(0, dir.find_last_of('/'));
+    int fd = inotify_init1(IN_CLOEXEC);
+    int dirWatch = -1, parentWatch = -1;
+    while (stat(path.c_str(), st) != 0) {
+        if (dirWatch < 0 && fd >= 0) {
+            dirWatch = inotify_add_watch(fd, dir.c_str(), IN_CREATE | IN_MOVED_TO);
+            if (dirWatch >= 0) continue; // it may have appeared before the watch was added
+            if (parentWatch < 0) parentWatch = inotify_add_watch(fd, parent.c_str(), IN_CREATE | IN_MOVED_TO);
+        }
+        int timeout = remainingMs(deadline);
+        if (timeout == 0) break;
+        // with nothing to watch, fall back to checking every so often
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, dirWatch < 0 && parentWatch < 0 ? std::min(timeout, 250) : timeout) > 0) {
+            char buf[4096];
+            while (read(fd, buf, sizeof(buf)) > 0 && poll(&pfd, 1, 0) > 0);
+        }
+    }
+    if (fd >= 0) close(fd);
+    return stat(path.c_str(), st) == 0;
+}
+
+// Looks for where the device is mounted, reading the mount table again each
+// time it changes. /proc/self/mountinfo signals changes with POLLPRI; a plain
+// file standing in for it is watched with inotify instead.
+static std::string waitForMount(dev_t dev, std::chrono::steady_clock::time_point deadline) {
+    std::string node = std::to_string(major(dev)) + ":" + std::to_string(minor(dev));
+    std::string path = rootPath("/proc/self/mountinfo");
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return "";
+    int ifd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (ifd >= 0) inotify_add_watch(ifd, path.c_str(), IN_MODIFY | IN_CLOSE_WRITE);
+    std::string mountpoint;
+    while (mountpoint.empty()) {
+        std::string data;
+        char buf[4096];
+        ssize_t n;
+        lseek(fd, 0, SEEK_SET);
+        while ((n = read(fd, buf, sizeof(buf))) > 0) data.append(buf, n);
+        for (const std::string& line : split(data, "\n")) {
+            std::vector<std::string> parts = split(line, " ");
+            if (parts.size() > 4 && parts[2] == node) {
+                mountpoint = parts[4];
+                break;
+            }
+        }
+        int timeout = remainingMs(deadline);
+        if (!mountpoint.empty() || timeout == 0) break;
+        struct pollfd pfds[2] = {{fd, POLLPRI, 0}, {ifd, POLLIN, 0}};
+        if (poll(pfds, ifd >= 0 ? 2 : 1, timeout) > 0 && ifd >= 0 && (pfds[1].revents & POLLIN))
+            while (read(ifd, buf, sizeof(buf)) > 0);
+    }
+    close(fd);
+    if (ifd >= 0) close(ifd);
+    return mountpoint;
+}
+
+// Finds where a drive is mounted, mounting it on dir if nothing else does so
+// in time. Returns an empty string if it couldn't be mounted.
+static std::string mountDrive(const std::string& device, dev_t dev, const std::string& dir) {
+    std::string mountpoint = waitForMount(dev, std::chrono::steady_clock::now() + std::chrono::seconds(MOUNT_TIMEOUT));
+    if (!mountpoint.empty()) return mountpoint;
+    mkdir(dir.c_str(), 0777);
+    if (mount(device.c_str(), dir.c_str(), "vfat", MS_NOATIME, NULL) != 0) return "";
+    return dir;
+}
+
 std::string getMountpoint() {
     // wait for RPI-RP2 drive
     struct stat st;
-    while (true) if (stat("/dev/disk/by-label/RPI-RP2", &st) == 0) break;
-    std::this_thread::sleep_for(std::chrono::seconds(2)); // wait for possible mount
-    // search for automount
-    std::string node = std::to_string(major(st.st_rdev)) + ":" + std::to_string(minor(st.st_rdev));
-    std::ifstream in("/proc/self/mountinfo");
-    while (!in.eof()) {
-        std::string line;
-        std::getline(in, line);
-        if (line.empty()) continue;
-        std::vector<std::string> parts = split(line, " ");
-        if (parts.empty()) continue;
-        if (parts[2] == node) return parts[4];
+    std::string device = rootPath("/dev/disk/by-label/RPI-RP2");
+    if (!waitForFile(rootPath("/dev/disk/by-label"), "RPI-RP2", &st, std::chrono::steady_clock::now() + std::chrono::seconds(DEVICE_TIMEOUT))) {
+        std::cerr << "Timed out waiting for the Pico to show up as a USB drive\n";
+        return "";
     }
-    in.close();
-    // attempt to mount manually
-    mkdir(".picomount", 0777);
-    if (mount("/dev/disk/by-label/RPI-RP2", ".picomount", "vfat", MS_NOATIME, NULL) != 0) {
+    std::string mountpoint = mountDrive(device, st.st_rdev, ".picomount");
+    if (mountpoint.empty()) {
         std::cout << "Cannot find mount, and cannot mount disk manually\nPlease mount the RPI-RP2 disk manually and type the path here: ";
-        std::string line;
-        std::getline(std::cin, line);
-        return line;
+        std::getline(std::cin, mountpoint);
     }
-    return ".picomount";
+    return mountpoint;
 }
 
 void mountCleanup() {
     sync();
 }
 
+static bool writeUF2(const std::string& mountpoint, const uint8_t * data, size_t size);
+
+// Writes the firmware to count Pico drives as they show up, each on its own
+// thread. The drives all have the same label, so only one of them can be found
+// in by-label; by-id has an entry for each, named after its serial number.
+// Returns how each drive went.
+static std::vector<std::string> writeUF2Drives(size_t count, const uint8_t * data, size_t size) {
+    std::string dir = rootPath("/dev/disk/by-id");
+    std::vector<std::string> results;
+    std::vector<std::thread> threads;
+    std::set<std::string> seen;
+    std::mutex lock;
+    int fd = inotify_init1(IN_CLOEXEC);
+    bool watching = fd >= 0 && inotify_add_watch(fd, dir.c_str(), IN_CREATE | IN_MOVED_TO) >= 0;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(DEVICE_TIMEOUT);
+    while (seen.size() < count) {
+        DIR * d = opendir(dir.c_str());
+        if (d != NULL) {
+            struct dirent * ent;
+            while ((ent = readdir(d)) != NULL && seen.size() < count) {
+                std::string name = ent->d_name;
+                if (name.compare(0, 12, "usb-RPI_RP2_") != 0 || name.find("-part") != std::string::npos || seen.count(name)) continue;
+                seen.insert(name);
+                std::string mountdir = ".picomount" + std::to_string(seen.size());
+                threads.emplace_back([dir, name, mountdir, data, size, &results, &lock]() {
+                    // the filesystem is on the first partition, whose entry may turn up just after the disk's
+                    std::string path = dir + "/" + name, result;
+                    struct stat st;
+                    for (int i = 0; i < 20 && stat((path + "-part1").c_str(), &st) != 0; i++) std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                    if (stat((path + "-part1").c_str(), &st) == 0) path += "-part1";
+                    std::string mountpoint = stat(path.c_str(), &st) == 0 ? mountDrive(path, st.st_rdev, mountdir) : "";
+                    if (mountpoint.empty()) result = "couldn't mount drive";
+                    else if (!writeUF2(mountpoint, data, size)) result = "couldn't write to " + mountpoint;
+                    else result = "written to " + mountpoint;
+                    std::lock_guard<std::mutex> guard(lock);
+                    results.push_back(name + ": " + result);
+                });
+            }
+            closedir(d);
+        }
+        int timeout = remainingMs(deadline);
+        if (seen.size() >= count || timeout == 0) break;
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, watching ? timeout : std::min(timeout, 250)) > 0) {
+            char buf[4096];
+            while (read(fd, buf, sizeof(buf)) > 0 && poll(&pfd, 1, 0) > 0);
+        }
+    }
+    if (fd >= 0) close(fd);
+    for (std::thread& thread : threads) thread.join();
+    if (seen.size() < count) results.push_back("only " + std::to_string(seen.size()) + " of " + std::to_string(count) + " drives showed up");
+    return results;
+}
+
 #elif defined(_WIN32)
 #include <windows.h>
 #include <stdio.h>
@@ -225,20 +373,358 @@ void mountCleanup() {}
 #error Unsupported platform
 #endif
 
-static std::chrono::system_clock::time_point startTime = std::chrono::system_clock::now();
-static PmTimestamp milliseconds(void *time_info) {
-    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - startTime).count();
+// PortMidi isn't thread-safe, so when several boards are being flashed at once,
+// every call into it goes through this.
+static std::mutex pmLock;
+
+// Waits for the device's reply to a PIC firmware block, returning its status
+// and the number of rows written so far, or -1 on timeout.
+static int waitForFlash(PortMidiStream * streamin, unsigned * rows) {
+    std::vector<uint8_t> msg;
+    int status = psgWaitForReply(streamin, 0x08, msg, 5, &pmLock);
+    if (status != -1 && msg.size() == 10) *rows = msg[7] | (msg[8] << 7);
+    return status;
+}
+
+// Sends the device a hash of each row and returns the ones it doesn't already
+// have. Firmware from before row hashes were kept doesn't answer, so then all
+// of them are sent.
+static PSGPicRows changedRows(PortMidiStream * stream, PortMidiStream * streamin, const PSGPicRows& rows) {
+    std::vector<uint8_t> msg = psgEncodePicManifest(rows), reply;
+    for (int attempt = 0; attempt < PIC_BLOCK_ATTEMPTS; attempt++) {
+        psgWriteSysEx(stream, msg.data(), &pmLock);
+        int status = psgWaitForReply(streamin, 0x0A, reply, 1, &pmLock);
+        if (status == PSG_FLASH_PROGRESS) return psgChangedPicRows(rows, reply);
+        else if (status != PSG_FLASH_BAD_CHECKSUM) break;
+    }
+    return rows;
+}
+
+// Ends a flash that went wrong part way. The empty block that normally ends a
+// flash resets the chips and reboots the device if any rows were written, so
+// the board isn't left silent with its chips in their bootloaders. It's only
+// a best effort, since the device itself may be what went wrong.
+static void abortPIC(PortMidiStream * stream, PortMidiStream * streamin) {
+    PSGPicRows none;
+    std::vector<uint8_t> msg = psgEncodePicBlock(none.begin(), none.end()), reply;
+    psgWriteSysEx(stream, msg.data(), &pmLock);
+    psgWaitForReply(streamin, 0x08, reply, 1, &pmLock);
+}
+
+// Sends the whole HEX file with 00 00, for firmware from before binary blocks.
+// Firmware that programs rows as they arrive replies with its progress and how
+// it ended. The original firmware doesn't reply at all, and reboots once it's
+// done, so if nothing ever comes back the flash is taken to have gone through.
+static std::string flashHex(PortMidiStream * stream, PortMidiStream * streamin, const std::string& hex, size_t rows, std::atomic<unsigned> * progress, std::atomic<unsigned> * total) {
+    if (total != NULL) *total = rows;
+    if (progress == NULL) std::cout << "Device doesn't take binary blocks, uploading PIC firmware as HEX (" << hex.size() << " bytes)\n";
+    std::vector<uint8_t> msg = {0xF0, 0x00, 0x46, 0x71, 0x00, 0x00}, reply;
+    msg.insert(msg.end(), hex.begin(), hex.end());
+    msg.push_back(0xF7);
+    psgWriteSysEx(stream, msg.data(), &pmLock);
+    bool answered = false;
+    while (true) {
+        int status = psgWaitForReply(streamin, 0x00, reply, HEX_TIMEOUT, &pmLock);
+        if (status == -1) {
+            if (answered) return "no reply from device";
+            if (progress == NULL) std::cout << "Device didn't reply, which firmware this old doesn't; assuming the flash finished\n";
+            return "";
+        }
+        answered = true;
+        unsigned written = reply.size() == 10 ? reply[7] | (reply[8] << 7) : 0;
+        if (progress != NULL) *progress = written;
+        else std::cout << "\rWrote " << written << "/" << rows << " rows" << std::flush;
+        if (status == PSG_FLASH_PROGRESS) continue;
+        if (progress == NULL) std::cout << "\n";
+        return status == PSG_FLASH_DONE ? "" : psgFlashStatusText(status);
+    }
+}
+
+// Sends the rows a block at a time, waiting for the device to write each one
+// before sending the next. Unless full is set, only the rows the device says
+// have changed are sent. A block that's rejected as corrupt or goes unanswered
+// is sent again; it's only written once it arrives intact, and writing the
+// same rows twice does no harm. If the first block goes unanswered, the device
+// is taken to be running firmware from before binary blocks, and is sent the
+// HEX file instead. If the flash fails part way, it's ended with abortPIC.
+// Progress goes to the console, or to the given counters when several boards
+// are being flashed at once. Returns an empty string on success, or what went
+// wrong.
+static std::string flashPIC(PortMidiStream * stream, PortMidiStream * streamin, const PSGPicRows& image, const std::string& hex, int rowsPerBlock, bool full, std::atomic<unsigned> * progress = NULL, std::atomic<unsigned> * total = NULL) {
+    PSGPicRows rows = full ? image : changedRows(stream, streamin, image);
+    if (total != NULL) *total = rows.size();
+    if (progress == NULL) std::cout << "Uploading PIC firmware (" << rows.size() << " of " << image.size() << " rows, " << rowsPerBlock << " per block)\n";
+    auto start = std::chrono::steady_clock::now();
+    size_t sent = 0;
+    bool answered = false;
+    // the last block has no rows, and tells the device to finish up
+    for (PSGPicRows::const_iterator it = rows.begin(); ; ) {
+        PSGPicRows::const_iterator next = it;
+        for (int n = 0; n < rowsPerBlock && next != rows.end(); n++) ++next;
+        std::vector<uint8_t> msg = psgEncodePicBlock(it, next);
+        int status = -1;
+        unsigned written = 0;
+        for (int attempt = 0; attempt < PIC_BLOCK_ATTEMPTS; attempt++) {
+            psgWriteSysEx(stream, msg.data(), &pmLock);
+            sent += msg.size();
+            status = waitForFlash(streamin, &written);
+            if (status == -1 && !answered) {
+                if (progress == NULL) std::cout << "\n";
+                return flashHex(stream, streamin, hex, image.size(), progress, total);
+            }
+            answered = true;
+            if (status != -1 && status != PSG_FLASH_BAD_CHECKSUM) break;
+            if (progress == NULL) std::cout << "\nBlock " << (status == -1 ? "got no reply" : "was corrupted") << ", sending it again\n";
+        }
+        if (status != PSG_FLASH_PROGRESS && status != PSG_FLASH_DONE) {
+            abortPIC(stream, streamin);
+            return status == -1 ? "no reply from device" : psgFlashStatusText(status);
+        }
+        if (progress != NULL) *progress = written;
+        else {
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::cout << "\rWrote " << written << "/" << rows.size() << " rows, " << sent << " bytes sent (" << (int)(sent / seconds) << " B/s)" << std::flush;
+        }
+        if (status == PSG_FLASH_DONE) break;
+        it = next;
+    }
+    if (progress == NULL) std::cout << "\n";
+    return "";
+}
+
+static bool writeUF2(const std::string& mountpoint, const uint8_t * data, size_t size) {
+    std::ofstream out(mountpoint + "/firmware.uf2", std::ios::binary);
+    if (!out.is_open()) return false;
+    out.write((const char*)data, size);
+    out.close();
+    mountCleanup();
+    return !out.fail();
+}
+
+/*
+ * Fleet mode (-a) flashes every attached board at once, with a thread for each
+ * one. PortMidi doesn't say which ports belong to the same board, so each PSG
+ * output is sent an identify request (SysEx 09 00) and paired with whichever
+ * input the reply comes back on. The reply is the board's USB serial number,
+ * which also carries its firmware version, and is used to find the board again
+ * after it reboots.
+ */
+
+struct Board {
+    std::string serial, version; // from the identify reply
+    PortMidiStream * out = NULL, * in = NULL;
+    std::atomic<unsigned> rowsWritten{0}, rowsChanged{0};
+    std::string pic = "skipped", uf2 = "skipped"; // how each stage went
+    bool ok = true;
+};
+
+// Sends an identify request to an output and waits for the reply on any of
+// the inputs, returning the serial number string and which input it came on.
+static std::string identify(PortMidiStream * out, const std::vector<PortMidiStream*>& ins, int * which) {
+    static const uint8_t request[] = {0xF0, 0x00, 0x46, 0x71, 0x09, 0x00, 0xF7};
+    std::vector<std::vector<uint8_t>> msgs(ins.size());
+    for (size_t n = 0; n < ins.size(); n++) while (psgReadSysEx(ins[n], msgs[n], &pmLock)); // drop anything left over
+    psgWriteSysEx(out, request, &pmLock);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    while (std::chrono::steady_clock::now() < deadline) {
+        bool any = false;
+        for (size_t n = 0; n < ins.size(); n++) {
+            if (!psgReadSysEx(ins[n], msgs[n], &pmLock)) continue;
+            any = true;
+            const std::vector<uint8_t>& msg = msgs[n];
+            if (msg.size() > 7 && msg[1] == 0x00 && msg[2] == 0x46 && msg[3] == 0x71 && msg[4] == 0x09 && msg[5] == 0x00) {
+                *which = n;
+                return std::string(msg.begin() + 6, msg.end() - 1);
+            }
+            msgs[n].clear();
+        }
+        if (!any) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return "";
+}
+
+// Opens every PSG port and pairs them up into boards.
+static std::vector<std::unique_ptr<Board>> openFleet() {
+    std::vector<PortMidiStream*> outs, ins;
+    for (int i = 0; i < Pm_CountDevices(); i++) {
+        const PmDeviceInfo * inf = Pm_GetDeviceInfo(i);
+        if (inf == NULL) break;
+        if (!strstr(inf->name, "PSG")) continue;
+        PortMidiStream * stream;
+        PmError error = psgOpenPort(i, &stream);
+        if (error != pmNoError) {
+            std::cerr << "Could not open device " << inf->name << ": " << Pm_GetErrorText(error) << "\n";
+            continue;
+        }
+        if (inf->output) outs.push_back(stream);
+        else ins.push_back(stream);
+    }
+    std::vector<std::unique_ptr<Board>> boards;
+    std::vector<bool> used(ins.size());
+    for (PortMidiStream * out : outs) {
+        int which = -1;
+        std::string serial = identify(out, ins, &which);
+        if (serial.empty() || used[which]) {
+            std::cerr << "A PSG device didn't answer the identify request (is its firmware too old?), skipping it\n";
+            Pm_Close(out);
+            continue;
+        }
+        used[which] = true;
+        Board * board = new Board;
+        size_t colon = serial.find(':');
+        board->serial = serial.substr(0, colon);
+        board->version = colon == std::string::npos ? "" : serial.substr(colon + 1);
+        board->out = out;
+        board->in = ins[which];
+        boards.emplace_back(board);
+    }
+    for (size_t n = 0; n < ins.size(); n++) if (!used[n]) Pm_Close(ins[n]);
+    return boards;
+}
+
+static void closeFleet(std::vector<std::unique_ptr<Board>>& boards) {
+    for (std::unique_ptr<Board>& board : boards) {
+        if (board->out) Pm_Close(board->out);
+        if (board->in) Pm_Close(board->in);
+        board->out = board->in = NULL;
+    }
+}
+
+// Starts PortMidi over, so ports that went away or came back while boards
+// rebooted are seen, and finds each board again by its serial number. Returns
+// the serial numbers of boards that weren't there before.
+static std::vector<std::string> reopenFleet(std::vector<std::unique_ptr<Board>>& boards) {
+    closeFleet(boards);
+    Pm_Terminate();
+    Pm_Initialize();
+    std::vector<std::string> others;
+    for (std::unique_ptr<Board>& found : openFleet()) {
+        bool matched = false;
+        for (std::unique_ptr<Board>& board : boards) {
+            if (board->serial == found->serial) {
+                board->out = found->out;
+                board->in = found->in;
+                board->version = found->version;
+                matched = true;
+            }
+        }
+        if (!matched) {
+            others.push_back(found->serial);
+            Pm_Close(found->out);
+            Pm_Close(found->in);
+        }
+    }
+    return others;
+}
+
+static int flashFleet(const PSGPicRows& rows, const std::string& hex, int rowsPerBlock, bool full, const uint8_t * uf2data, size_t uf2size) {
+    std::vector<std::unique_ptr<Board>> boards = openFleet();
+    if (boards.empty()) {
+        std::cerr << "No PSG device found\n";
+        return 6;
+    }
+    std::cout << "Found " << boards.size() << " boards:\n";
+    for (std::unique_ptr<Board>& board : boards) std::cout << "  " << board->serial << " (" << board->version << ")\n";
+    if (!rows.empty()) {
+        std::cout << "Uploading PIC firmware to all boards (" << rows.size() << " rows, " << rowsPerBlock << " per block)\n";
+        std::vector<std::thread> threads;
+        std::atomic<size_t> running(boards.size());
+        for (std::unique_ptr<Board>& board : boards) {
+            Board * b = board.get();
+            b->rowsChanged = rows.size(); // until the board says otherwise
+            threads.emplace_back([b, &rows, &hex, rowsPerBlock, full, &running]() {
+                std::string error = flashPIC(b->out, b->in, rows, hex, rowsPerBlock, full, &b->rowsWritten, &b->rowsChanged);
+                b->ok = error.empty();
+                b->pic = b->ok ? "OK" : error;
+                running--;
+            });
+        }
+        do {
+            std::this_thread::sleep_for(std::chrono::milliseconds(250));
+            unsigned written = 0, total = 0;
+            for (std::unique_ptr<Board>& board : boards) {
+                written += board->rowsWritten;
+                total += board->rowsChanged;
+            }
+            std::cout << "\rWrote " << written << "/" << total << " rows, " << running << " boards still going" << std::flush;
+        } while (running);
+        for (std::thread& thread : threads) thread.join();
+        std::cout << "\n";
+        std::this_thread::sleep_for(std::chrono::milliseconds(1000)); // make sure the devices have time to boot
+    }
+    if (uf2size) {
+        reopenFleet(boards);
+        size_t flipped = 0;
+        for (std::unique_ptr<Board>& board : boards) {
+            if (!board->ok) continue; // its PIC flash failed, so it needs another go anyway
+            if (board->out == NULL) {
+                board->ok = false;
+                board->uf2 = "device didn't come back";
+                continue;
+            }
+            static const uint8_t msg[] = {0xF0, 0x00, 0x46, 0x71, 0x01, 0x00, 0xF7};
+            psgWriteSysEx(board->out, msg, &pmLock);
+            board->uf2 = "didn't come back with the new firmware";
+            flipped++;
+#ifndef HAVE_DRIVE_WATCH
+            // without a way to tell the drives apart, they're done one at a time
+            std::cout << "Waiting for USB device for " << board->serial << "\n";
+            std::string mountpoint = getMountpoint();
+            if (mountpoint == "" || !writeUF2(mountpoint, uf2data, uf2size)) board->uf2 = "couldn't write to drive";
+#endif
+        }
+        closeFleet(boards);
+#ifdef HAVE_DRIVE_WATCH
+        std::cout << "Uploading Pico firmware to " << flipped << " boards (" << uf2size << " bytes)\n";
+        for (const std::string& result : writeUF2Drives(flipped, uf2data, uf2size)) std::cout << "  " << result << "\n";
+#endif
+        // the boards that come back are done
+        std::cout << "Waiting for boards to come back\n";
+        std::vector<std::string> others;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(DEVICE_TIMEOUT);
+        bool waiting;
+        do {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            others = reopenFleet(boards);
+            waiting = false;
+            for (std::unique_ptr<Board>& board : boards) waiting = waiting || (board->ok && board->out == NULL);
+        } while (waiting && std::chrono::steady_clock::now() < deadline);
+        for (const std::string& serial : others) std::cout << "Found another board " << serial << ", leaving it alone\n";
+        for (std::unique_ptr<Board>& board : boards) {
+            if (board->ok && board->out != NULL) board->uf2 = "OK";
+            else if (board->ok) board->ok = false;
+        }
+        closeFleet(boards);
+    }
+    std::cout << "\nBoard             PIC                   Pico\n";
+    bool ok = true;
+    for (std::unique_ptr<Board>& board : boards) {
+        std::cout << board->serial << "  " << board->pic << std::string(board->pic.size() < 22 ? 22 - board->pic.size() : 1, ' ') << board->uf2;
+        if (board->uf2 == "OK") std::cout << " (" << board->version << ")";
+        std::cout << "\n";
+        ok = ok && board->ok;
+    }
+    return ok ? 0 : 8;
 }
 
 int main(int argc, const char * argv[]) {
     std::string hexdata;
-    uint8_t * uf2data;
+    uint8_t * uf2data = NULL;
     size_t uf2size = 0;
-    if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " <firmware.bin|uf2|hex>\n";
+    int rowsPerBlock = PIC_ROWS_PER_BLOCK;
+    bool fleet = false, full = false;
+    const char * path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) rowsPerBlock = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-a") == 0) fleet = true;
+        else if (strcmp(argv[i], "-f") == 0) full = true;
+        else path = argv[i];
+    }
+    if (path == NULL || rowsPerBlock < 1 || rowsPerBlock > 255) {
+        std::cerr << "Usage: " << argv[0] << " [-a] [-f] [-b rows-per-block] <firmware.bin|uf2|hex>\n";
         return 1;
     }
-    std::ifstream in(argv[1], std::ios::binary);
+    std::ifstream in(path, std::ios::binary);
     if (!in.is_open()) {
         std::cerr << "Could not open input file\n";
         return 2;
@@ -277,68 +763,43 @@ int main(int argc, const char * argv[]) {
         std::cerr << "No firmware data present\n";
         return 5;
     }
+    PSGPicRows rows;
+    if (!hexdata.empty() && !psgHexToRows(hexdata, rows)) {
+        std::cerr << "Invalid HEX data\n";
+        return 3;
+    }
     std::cout << "Opening MIDI device\n";
     PortMidiStream * stream = NULL, * streamin = NULL;
     PmError error;
     if ((error = Pm_Initialize()) != pmNoError) throw std::runtime_error(std::string("Could not init: ") + Pm_GetErrorText(error));
-    for (int i = 0; i < Pm_CountDevices(); i++) {
-        const PmDeviceInfo * inf = Pm_GetDeviceInfo(i);
-        if (inf == NULL) {
-            std::cerr << "No PSG device found\n";
-            return 6;
-        }
-        if (inf->output && strstr(inf->name, "PSG")) {
-            if ((error = Pm_OpenOutput(&stream, i, NULL, 0, milliseconds, NULL, 0)) != pmNoError) {
-                std::cerr << "Could not open device: " << Pm_GetErrorText(error) << "\n";
-                return error;
-            }
-            std::cout << "Opened MIDI output device " << inf->name << "\n";
-            if (streamin != NULL) break;
-        }
-        if (inf->input && strstr(inf->name, "PSG")) {
-            if ((error = Pm_OpenInput(&streamin, i, NULL, 0, milliseconds, NULL)) != pmNoError) {
-                std::cerr << "Could not open device: " << Pm_GetErrorText(error) << "\n";
-                return error;
-            }
-            std::cout << "Opened MIDI input device " << inf->name << "\n";
-            if (stream != NULL) break;
-        }
+    if (fleet) {
+        int status = flashFleet(rows, hexdata, rowsPerBlock, full, uf2data, uf2size);
+        if (uf2size) delete[] uf2data;
+        Pm_Terminate();
+        return status;
+    }
+    if ((error = psgOpenDevice(&stream, &streamin)) != pmNoError) {
+        std::cerr << "Could not open device: " << Pm_GetErrorText(error) << "\n";
+        return error;
     }
     if (stream == NULL || streamin == NULL) {
         std::cerr << "No PSG device found\n";
         return 6;
     }
     if (!hexdata.empty()) {
-        std::cout << "Uploading PIC firmware (" << hexdata.size() << " bytes)\n";
-        uint8_t * data = new uint8_t[hexdata.size()+7];
-        data[0] = 0xF0;
-        data[1] = 0x00;
-        data[2] = 0x46;
-        data[3] = 0x71;
-        data[4] = 0x00;
-        data[5] = 0;
-        memcpy(data + 6, hexdata.c_str(), hexdata.size());
-        data[hexdata.size() + 6] = 0xF7;
-        Pm_WriteSysEx(stream, 0, data);
-        std::cout << "Waiting for write to complete\n";
-        while (!Pm_Poll(streamin)) std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        std::string result = flashPIC(stream, streamin, rows, hexdata, rowsPerBlock, full);
+        if (!result.empty()) {
+            std::cerr << "PIC flash failed: " << result << "\n";
+            return 7;
+        }
         std::cout << "Flash finished, reloading output\n";
         std::this_thread::sleep_for(std::chrono::milliseconds(1000)); // make sure the device has time to boot
         Pm_Close(stream);
-        for (int i = 0; i < Pm_CountDevices(); i++) {
-            const PmDeviceInfo * inf = Pm_GetDeviceInfo(i);
-            if (inf == NULL) {
-                std::cerr << "No PSG device found\n";
-                return 6;
-            }
-            if (inf->output && strstr(inf->name, "PSG")) {
-                if ((error = Pm_OpenOutput(&stream, i, NULL, 0, milliseconds, NULL, 0)) != pmNoError) {
-                    std::cerr << "Could not open device: " << Pm_GetErrorText(error) << "\n";
-                    return error;
-                }
-                std::cout << "Opened MIDI output device " << inf->name << "\n";
-                break;
-            }
+        stream = NULL;
+        PmDeviceID id = psgFindPort(true);
+        if (id >= 0 && (error = psgOpenPort(id, &stream)) != pmNoError) {
+            std::cerr << "Could not open device: " << Pm_GetErrorText(error) << "\n";
+            return error;
         }
         if (stream == NULL) {
             std::cerr << "No PSG device found\n";
@@ -348,16 +809,17 @@ int main(int argc, const char * argv[]) {
     if (uf2size) {
         std::cout << "Flipping device into bootloader mode\n";
         uint8_t msg[] = {0xF0, 0x00, 0x46, 0x71, 0x01, 0x00, 0xF7};
-        Pm_WriteSysEx(stream, 0, msg);
+        psgWriteSysEx(stream, msg);
         std::cout << "Waiting for USB device\n";
         std::string mountpoint = getMountpoint();
         if (mountpoint == "") return 6;
         std::cout << "Found Pico at " << mountpoint << "\nUploading Pico firmware (" << uf2size << " bytes)\n";
-        std::ofstream out(mountpoint + "/firmware.uf2", std::ios::binary);
-        out.write((char*)uf2data, uf2size);
-        out.close();
-        mountCleanup();
+        bool written = writeUF2(mountpoint, uf2data, uf2size);
         delete[] uf2data;
+        if (!written) {
+            std::cerr << "Could not write firmware to " << mountpoint << "\n";
+            return 7;
+        }
         std::cout << "Upload finished, Pico will reboot momentarily\n";
     }
     Pm_Close(stream);
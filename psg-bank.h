@@ -0,0 +1,93 @@
+/*
+ * psg-bank.h
+ * PSG
+ *
+ * This file contains the encoder for patch block uploads (SysEx 07 00), which
+ * carry any number of consecutive instrument patches in one message. The patches
+ * are sent in the variable-length instrument format, packed 7 bytes to 8 so
+ * they can go over MIDI as-is, and checked with a CRC-32. instrument-designer.html
+ * has the same encoder in JavaScript; the two must be kept in step.
+ *
+ * This code is licensed under the GPLv2 license.
+ * Copyright (c) 2022-2023 JackMacWindows.
+ */
+
+#ifndef PSG_BANK_H
+#define PSG_BANK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "psg-crc.h"
+
+#define PSG_LEGACY_PATCH_SIZE 212
+#define PSG_BLOCK_MAX_SIZE 0x4000 // largest block the device can unpack, including the header and CRC
+
+// Replies to a patch block, as the byte after the command number.
+enum PSGBlockStatus {
+    PSG_BLOCK_OK,
+    PSG_BLOCK_BAD_CHECKSUM,
+    PSG_BLOCK_TOO_LARGE,
+    PSG_BLOCK_NO_ROOM,
+    PSG_BLOCK_MALFORMED
+};
+
+// Converts a patch in the fixed 212-byte layout (as made by the instrument
+// designer) to the variable-length one, dropping the unused points. Returns
+// an empty patch if an envelope claims more than 12 points.
+static inline std::vector<uint8_t> psgCompactPatch(const uint8_t * legacy) {
+    std::vector<uint8_t> patch;
+    for (int e = 0; e < 4; e++) {
+        const uint8_t * env = legacy + e * 52;
+        if (env[48] > 12) return {};
+        patch.insert(patch.end(), env + 48, env + 52);
+        patch.insert(patch.end(), env, env + env[48] * 4);
+    }
+    patch.insert(patch.end(), legacy + 208, legacy + 212);
+    return patch;
+}
+
+// Packs data 7 bytes to 8: each group of up to 7 bytes is preceded by a byte
+// holding their top bits, the first one's in bit 0.
+static inline void psgPack7(const std::vector<uint8_t>& data, std::vector<uint8_t>& out) {
+    for (size_t i = 0; i < data.size(); i += 7) {
+        uint8_t high = 0;
+        size_t n = data.size() - i < 7 ? data.size() - i : 7;
+        for (size_t j = 0; j < n; j++) high |= (data[i + j] >> 7) << j;
+        out.push_back(high);
+        for (size_t j = 0; j < n; j++) out.push_back(data[i + j] & 0x7F);
+    }
+}
+
+// Size of the unpacked block that would carry the given patches.
+static inline size_t psgBlockSize(const std::vector<std::vector<uint8_t>>& patches) {
+    size_t size = 8;
+    for (const std::vector<uint8_t>& patch : patches) size += patch.size();
+    return size;
+}
+
+// Builds the whole SysEx message storing variable-length patches from slot
+// first onwards.
+static inline std::vector<uint8_t> psgEncodeBlock(uint8_t first, const std::vector<std::vector<uint8_t>>& patches) {
+    std::vector<uint8_t> block = {first, (uint8_t)patches.size(), 0, 0};
+    for (const std::vector<uint8_t>& patch : patches) block.insert(block.end(), patch.begin(), patch.end());
+    uint32_t crc = psgCRC32(0, block.data(), block.size());
+    for (int i = 0; i < 4; i++) block.push_back(crc >> (i * 8));
+    std::vector<uint8_t> msg = {0xF0, 0x00, 0x46, 0x71, 0x07, 0x00};
+    psgPack7(block, msg);
+    msg.push_back(0xF7);
+    return msg;
+}
+
+static inline const char * psgBlockStatusText(int status) {
+    switch (status) {
+        case PSG_BLOCK_OK: return "OK";
+        case PSG_BLOCK_BAD_CHECKSUM: return "checksum mismatch";
+        case PSG_BLOCK_TOO_LARGE: return "block too large";
+        case PSG_BLOCK_NO_ROOM: return "not enough room for the envelope points";
+        case PSG_BLOCK_MALFORMED: return "malformed patch data";
+        default: return "unknown error";
+    }
+}
+
+#endif
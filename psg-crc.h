@@ -0,0 +1,29 @@
+/*
+ * psg-crc.h
+ * PSG
+ *
+ * This file contains the CRC-32 that checks patch blocks, PIC firmware blocks,
+ * the patch bank and the PIC row hashes. It's shared by the host tools and the
+ * Pico firmware, so both sides always agree on it.
+ *
+ * This code is licensed under the GPLv2 license.
+ * Copyright (c) 2022-2023 JackMacWindows.
+ */
+
+#ifndef PSG_CRC_H
+#define PSG_CRC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// The standard (zlib) CRC-32; pass the last result back in to continue it.
+static inline uint32_t psgCRC32(uint32_t crc, const uint8_t * data, size_t size) {
+    crc = ~crc;
+    while (size--) {
+        crc ^= *data++;
+        for (int i = 0; i < 8; i++) crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+#endif
@@ -0,0 +1,152 @@
+/*
+ * psg-flash.h
+ * PSG
+ *
+ * This file contains the encoder for binary PIC firmware uploads (SysEx 08 00).
+ * An Intel HEX file is read into the 16-word rows the PIC bootloader writes, and
+ * the rows are sent in blocks packed 7 bytes to 8 and checked with a CRC-32, the
+ * same way as patch blocks. This takes less than half the bytes of sending the
+ * HEX text with SysEx 00 00. Before that, a manifest of row hashes (SysEx 0A 00)
+ * can be sent in the same kind of block, and the device replies with which rows
+ * differ from what it last wrote, so the rest don't have to be sent at all.
+ *
+ * This code is licensed under the GPLv2 license.
+ * Copyright (c) 2022-2023 JackMacWindows.
+ */
+
+#ifndef PSG_FLASH_H
+#define PSG_FLASH_H
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "psg-bank.h"
+
+#define PSG_PIC_ROW_WORDS 16
+#define PSG_PIC_FLASH_WORDS 0x800
+#define PSG_PIC_BOOTLOADER_WORDS 0x200 // rows below this hold the bootloader, and the device skips them
+
+// Replies to a PIC flash, as the byte after the command number.
+enum PSGFlashStatus {
+    PSG_FLASH_PROGRESS,
+    PSG_FLASH_DONE,
+    PSG_FLASH_BAD_RECORD,
+    PSG_FLASH_BAD_CHECKSUM,
+    PSG_FLASH_OUT_OF_ORDER,
+    PSG_FLASH_TOO_LARGE
+};
+
+// A row's words, little endian. Words after the last one given are left
+// erased; words before it that the HEX file doesn't give are written as 0.
+typedef std::map<uint16_t, std::vector<uint8_t>> PSGPicRows;
+
+// Hash of a row as the device keeps it: a CRC-32 of its word count and words.
+static inline uint32_t psgPicRowHash(const std::vector<uint8_t>& data) {
+    uint8_t words = data.size() / 2;
+    return psgCRC32(psgCRC32(0, &words, 1), data.data(), data.size());
+}
+
+static inline int psgHexDigit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    else if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    else if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    else return -1;
+}
+
+// Reads the program memory rows out of an Intel HEX file, skipping the ones
+// that hold the bootloader. Returns false if a record is invalid.
+static inline bool psgHexToRows(const std::string& hex, PSGPicRows& rows) {
+    uint16_t addrHi = 0;
+    size_t pos = 0;
+    while ((pos = hex.find(':', pos)) != std::string::npos) {
+        std::vector<uint8_t> record;
+        pos++;
+        while (pos + 1 < hex.size() && psgHexDigit(hex[pos]) >= 0 && psgHexDigit(hex[pos+1]) >= 0) {
+            record.push_back(psgHexDigit(hex[pos]) << 4 | psgHexDigit(hex[pos+1]));
+            pos += 2;
+        }
+        if (record.size() < 5 || record.size() != record[0] + 5u) return false;
+        uint8_t sum = 0;
+        for (uint8_t b : record) sum += b;
+        if (sum != 0) return false;
+        uint16_t addr = (record[1] << 8 | record[2]) >> 1;
+        if (record[3] == 1) return true;
+        else if (record[3] == 4) addrHi = record[4] << 8 | record[5];
+        else if (record[3] == 0 && addrHi == 0) {
+            for (int i = 0; i < record[0] / 2; i++) {
+                uint16_t word = addr + i;
+                if (word >= PSG_PIC_FLASH_WORDS) break;
+                uint16_t row = word & ~(PSG_PIC_ROW_WORDS - 1);
+                if (row < PSG_PIC_BOOTLOADER_WORDS) continue;
+                std::vector<uint8_t>& data = rows[row];
+                size_t offset = (word - row) * 2;
+                if (data.size() < offset + 2) data.resize(offset + 2);
+                data[offset] = record[4 + i*2];
+                data[offset + 1] = record[5 + i*2];
+            }
+        } else if (record[3] > 5) return false;
+    }
+    return false; // no end record
+}
+
+// Builds the whole SysEx message carrying the given rows; with no rows, it
+// ends the flash.
+static inline std::vector<uint8_t> psgEncodePicBlock(PSGPicRows::const_iterator begin, PSGPicRows::const_iterator end) {
+    std::vector<uint8_t> block = {0, 0, 0, 0};
+    for (PSGPicRows::const_iterator it = begin; it != end; ++it) {
+        block[0]++;
+        block.push_back(it->first & 0xFF);
+        block.push_back(it->first >> 8);
+        block.push_back(it->second.size() / 2);
+        block.insert(block.end(), it->second.begin(), it->second.end());
+    }
+    uint32_t crc = psgCRC32(0, block.data(), block.size());
+    for (int i = 0; i < 4; i++) block.push_back(crc >> (i * 8));
+    std::vector<uint8_t> msg = {0xF0, 0x00, 0x46, 0x71, 0x08, 0x00};
+    psgPack7(block, msg);
+    msg.push_back(0xF7);
+    return msg;
+}
+
+// Builds the whole SysEx message carrying the hash of each row.
+static inline std::vector<uint8_t> psgEncodePicManifest(const PSGPicRows& rows) {
+    std::vector<uint8_t> block = {(uint8_t)rows.size(), 0, 0, 0};
+    for (const auto& row : rows) {
+        uint32_t hash = psgPicRowHash(row.second);
+        block.push_back(row.first & 0xFF);
+        block.push_back(row.first >> 8);
+        for (int i = 0; i < 4; i++) block.push_back(hash >> (i * 8));
+    }
+    uint32_t crc = psgCRC32(0, block.data(), block.size());
+    for (int i = 0; i < 4; i++) block.push_back(crc >> (i * 8));
+    std::vector<uint8_t> msg = {0xF0, 0x00, 0x46, 0x71, 0x0A, 0x00};
+    psgPack7(block, msg);
+    msg.push_back(0xF7);
+    return msg;
+}
+
+// Picks out the rows a manifest reply says have to be sent. The reply has a
+// bit for each row, 7 to a byte, after the status.
+static inline PSGPicRows psgChangedPicRows(const PSGPicRows& rows, const std::vector<uint8_t>& reply) {
+    PSGPicRows changed;
+    for (const auto& row : rows) {
+        size_t n = row.first / PSG_PIC_ROW_WORDS;
+        if (7 + n / 7 < reply.size() - 1 && (reply[7 + n / 7] & (1 << (n % 7)))) changed.insert(row);
+    }
+    return changed;
+}
+
+static inline const char * psgFlashStatusText(int status) {
+    switch (status) {
+        case PSG_FLASH_PROGRESS: return "in progress";
+        case PSG_FLASH_DONE: return "done";
+        case PSG_FLASH_BAD_RECORD: return "malformed data";
+        case PSG_FLASH_BAD_CHECKSUM: return "checksum mismatch";
+        case PSG_FLASH_OUT_OF_ORDER: return "HEX records out of order";
+        case PSG_FLASH_TOO_LARGE: return "block too large";
+        default: return "unknown error";
+    }
+}
+
+#endif
@@ -0,0 +1,108 @@
+/*
+ * psg-midi.h
+ * PSG
+ *
+ * This file contains the PortMidi plumbing shared by the host tools: finding
+ * and opening the PSG's ports, and sending and receiving the SysEx messages
+ * they exchange with it. Replies all start F0 00 46 71 <command> 00 <status>.
+ *
+ * This code is licensed under the GPLv2 license.
+ * Copyright (c) 2022-2023 JackMacWindows.
+ */
+
+#ifndef PSG_MIDI_H
+#define PSG_MIDI_H
+
+#include <portmidi.h>
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// PortMidi's time source: milliseconds since the program started.
+static inline PmTimestamp psgMilliseconds(void *) {
+    static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Finds the first PSG output (or input) from device start onwards, returning
+// its ID, or -1 if there isn't one.
+static inline PmDeviceID psgFindPort(bool output, PmDeviceID start = 0) {
+    for (PmDeviceID i = start; i < Pm_CountDevices(); i++) {
+        const PmDeviceInfo * inf = Pm_GetDeviceInfo(i);
+        if (inf == NULL) break;
+        if ((output ? inf->output : inf->input) && strstr(inf->name, "PSG")) return i;
+    }
+    return -1;
+}
+
+// Opens a port as an output or an input, whichever it is. Inputs leave out
+// realtime messages, so they can't get in the middle of a reply.
+static inline PmError psgOpenPort(PmDeviceID id, PortMidiStream ** stream) {
+    const PmDeviceInfo * inf = Pm_GetDeviceInfo(id);
+    if (inf == NULL) return pmInvalidDeviceId;
+    if (inf->output) return Pm_OpenOutput(stream, id, NULL, 0, psgMilliseconds, NULL, 0);
+    PmError error = Pm_OpenInput(stream, id, NULL, 0, psgMilliseconds, NULL);
+    if (error == pmNoError) Pm_SetFilter(*stream, PM_FILT_REALTIME);
+    return error;
+}
+
+// Opens the first PSG output and input. Either is left NULL if there isn't
+// one; the error is from opening them.
+static inline PmError psgOpenDevice(PortMidiStream ** out, PortMidiStream ** in) {
+    PmDeviceID outId = psgFindPort(true), inId = psgFindPort(false);
+    PmError error = pmNoError;
+    *out = *in = NULL;
+    if (outId >= 0 && (error = psgOpenPort(outId, out)) != pmNoError) return error;
+    if (inId >= 0 && (error = psgOpenPort(inId, in)) != pmNoError) {
+        if (*out) Pm_Close(*out);
+        *out = NULL;
+    }
+    return error;
+}
+
+// PortMidi isn't thread-safe, so a tool talking to several devices at once
+// passes a lock for every call into it to go through.
+static inline void psgWriteSysEx(PortMidiStream * stream, const uint8_t * msg, std::mutex * lock = NULL) {
+    if (lock) lock->lock();
+    Pm_WriteSysEx(stream, 0, (unsigned char*)msg);
+    if (lock) lock->unlock();
+}
+
+// Reads the next complete SysEx message from an input, if one has come in.
+// Partial messages are kept in msg until the rest arrives.
+static inline bool psgReadSysEx(PortMidiStream * streamin, std::vector<uint8_t>& msg, std::mutex * lock = NULL) {
+    PmEvent ev;
+    if (lock) lock->lock();
+    int count = Pm_Read(streamin, &ev, 1);
+    if (lock) lock->unlock();
+    if (count != 1) return false;
+    for (int i = 0; i < 4; i++) {
+        uint8_t b = (ev.message >> (i * 8)) & 0xFF;
+        if (b == 0xF0) msg.clear();
+        else if (b & 0x80 && b != 0xF7) continue;
+        msg.push_back(b);
+        if (b == 0xF7) return true;
+    }
+    return false;
+}
+
+// Waits for a reply to the given command that carries a status, returning
+// the status with the whole message in msg, or -1 on timeout.
+static inline int psgWaitForReply(PortMidiStream * streamin, uint8_t command, std::vector<uint8_t>& msg, int seconds, std::mutex * lock = NULL) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+    msg.clear();
+    while (std::chrono::steady_clock::now() < deadline) {
+        if (!psgReadSysEx(streamin, msg, lock)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        if (msg.size() >= 8 && msg[1] == 0x00 && msg[2] == 0x46 && msg[3] == 0x71 && msg[4] == command && msg[5] == 0x00) return msg[6];
+        msg.clear();
+    }
+    return -1;
+}
+
+#endif